@@ -0,0 +1,160 @@
+/*
+Display task. This is the only thing that talks to the EPD; the web server and anything
+else hands it display requests through a queue.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "epd.h"
+#include "epd_flash_image.h"
+#include "metrics.h"
+#include "sched.h"
+#include "display.h"
+#include "io.h"
+#include "sdkconfig.h"
+#include "progress.h"
+
+static const char *TAG="display";
+
+typedef struct {
+	int slot;
+} display_req_t;
+
+//This queue has room for exactly one request; a new request overwrites one that is still
+//waiting. That way, if three uploads come in during a refresh, only the last one is shown.
+static QueueHandle_t display_queue;
+static SemaphoreHandle_t images_mutex;
+static volatile display_state_t state=DISPLAY_IDLE;
+static volatile int cur_slot=-1;
+static bool images_held=false;
+
+static const char *phase_name[]={
+	[EPD_PHASE_INIT]="init",
+	[EPD_PHASE_PUSH]="push",
+	[EPD_PHASE_POWER_ON]="power_on",
+	[EPD_PHASE_REFRESH]="refresh",
+	[EPD_PHASE_POWER_OFF]="power_off",
+	[EPD_PHASE_DONE]="done",
+};
+
+static void phase_cb(epd_phase_t phase) {
+	if (phase==EPD_PHASE_INIT || phase==EPD_PHASE_PUSH) {
+		state=DISPLAY_PUSHING;
+	} else if (phase==EPD_PHASE_POWER_ON) {
+		//Pixel data is in the panel; the slot can be written again.
+		if (images_held) {
+			images_held=false;
+			display_unlock_images();
+		}
+		state=DISPLAY_REFRESHING;
+	}
+	//Done is sent once the display task is idle again.
+	if (phase!=EPD_PHASE_DONE) progress_send_display(phase_name[phase]);
+}
+
+static void show_slot(int slot) {
+	const esp_partition_t *part=esp_partition_find_first(123, 0, NULL);
+	if (part==NULL) {
+		ESP_LOGE(TAG, "Images partition not found!");
+		return;
+	}
+	const flash_image_t *image=NULL;
+	spi_flash_mmap_handle_t mmap_handle;
+	esp_err_t err=esp_partition_mmap(part, slot*IMG_SIZE_BYTES, IMG_SIZE_BYTES, SPI_FLASH_MMAP_DATA, (const void**)&image, &mmap_handle);
+	if (err!=ESP_OK) {
+		ESP_LOGE(TAG, "Failed to map slot %d: %s", slot, esp_err_to_name(err));
+		return;
+	}
+	display_lock_images(); //normally released by phase_cb as soon as the data is sent
+	images_held=true;
+	if (!img_valid(&image->hdr)) {
+		ESP_LOGW(TAG, "Slot %d does not contain a valid image", slot);
+	} else {
+		cur_slot=slot;
+#if CONFIG_PHOTOFRAME_OVERLAY_STATUS
+		overlay_t overlay;
+		overlay_init(&overlay);
+		overlay_add_status(&overlay, io_get_battery_mv());
+		epd_send(image->data, &overlay);
+		overlay_free(&overlay);
+#else
+		epd_send(image->data, NULL);
+#endif
+		epd_shutdown();
+		sched_shown(slot);
+	}
+	if (images_held) {
+		images_held=false;
+		display_unlock_images();
+	}
+	spi_flash_munmap(mmap_handle);
+}
+
+static void display_task(void *arg) {
+	display_req_t req;
+	while(1) {
+		xQueueReceive(display_queue, &req, portMAX_DELAY);
+		ESP_LOGI(TAG, "Showing slot %d", req.slot);
+		show_slot(req.slot);
+		state=DISPLAY_IDLE;
+		progress_send_display("done");
+	}
+}
+
+void display_init() {
+	display_queue=xQueueCreate(1, sizeof(display_req_t));
+	images_mutex=xSemaphoreCreateMutex();
+	epd_set_phase_cb(phase_cb);
+	TaskHandle_t task;
+	xTaskCreate(display_task, "display", 4096, NULL, 5, &task);
+	metrics_register_task("display", task);
+}
+
+void display_show_slot(int slot) {
+	display_req_t req={
+		.slot=slot
+	};
+	if (uxQueueMessagesWaiting(display_queue)) {
+		ESP_LOGI(TAG, "Display request for slot %d replaces a pending one", slot);
+	}
+	xQueueOverwrite(display_queue, &req);
+}
+
+display_state_t display_get_state() {
+	return state;
+}
+
+const char *display_state_name(display_state_t st) {
+	switch (st) {
+		case DISPLAY_IDLE: return "idle";
+		case DISPLAY_PUSHING: return "pushing";
+		case DISPLAY_REFRESHING: return "refreshing";
+	}
+	return "unknown";
+}
+
+int display_get_slot() {
+	return cur_slot;
+}
+
+void display_lock_images() {
+	xSemaphoreTake(images_mutex, portMAX_DELAY);
+}
+
+void display_unlock_images() {
+	xSemaphoreGive(images_mutex);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+//The display task owns the EPD and its SPI bus. Everything else asks it to show an image
+//slot; requests that come in while it's busy are collapsed so only the newest gets shown.
+
+typedef enum {
+	DISPLAY_IDLE=0,
+	DISPLAY_PUSHING,		//sending image data to the panel
+	DISPLAY_REFRESHING,		//panel is updating; takes 15-30 seconds
+} display_state_t;
+
+void display_init();
+
+//Queue showing the image in the given slot. Returns immediately.
+void display_show_slot(int slot);
+
+display_state_t display_get_state();
+const char *display_state_name(display_state_t state);
+//Slot being shown, or last shown. -1 if nothing has been shown yet.
+int display_get_slot();
+
+//Anything that erases or writes the images partition must hold this lock while doing so.
+//The display task holds it while reading a slot, so an image isn't overwritten halfway
+//through being sent to the panel.
+void display_lock_images();
+void display_unlock_images();
@@ -14,9 +14,13 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
 #include "esp_timer.h"
+#include "esp_sleep.h"
+#include "epd.h"
+#include "metrics.h"
 
 #ifdef HSPI_HOST
 //Waveshare ESP32 board
@@ -40,8 +44,10 @@
 
 
 //To speed up transfers, every SPI transfer sends a bunch of lines. This define specifies how many. More means more memory use,
-//but less overhead for setting up / finishing transfers. Make sure 240 is dividable by this.
+//but less overhead for setting up / finishing transfers. Make sure 448 is dividable by this.
 #define PARALLEL_LINES 16
+#define LINE_BYTES (600/2)
+#define LINES 448
 
 static const char *TAG="epd";
 
@@ -106,16 +112,39 @@ static void epd_spi_pre_transfer_callback(spi_transaction_t *t) {
 	gpio_set_level(PIN_NUM_DC, dc);
 }
 
-//Wait for the EPD to not be busy anymore
-static void wait_busy(int val, int timeout_ms) {
-	int64_t tout=esp_timer_get_time()+timeout_ms*1000;
-	while(gpio_get_level(PIN_NUM_BUSY)!=val) {
-		vTaskDelay(2);
-		if (esp_timer_get_time()>tout) {
-			ESP_LOGE(TAG, "Timeout on waiting for busy to go %s!", val?"high":"low");
-			return;
-		}
+//Durations of the phases of the last epd_send() call
+static epd_timings_t last_timings;
+
+//Task blocked in wait_busy(), if any. Notified by the BUSY interrupt.
+static TaskHandle_t busy_task=NULL;
+
+//Called in irq context when BUSY reaches the level we're waiting for. The interrupt is
+//level-triggered, so it needs to be disabled here; wait_busy() re-arms it.
+static void busy_isr(void *arg) {
+	BaseType_t woken=pdFALSE;
+	gpio_intr_disable(PIN_NUM_BUSY);
+	if (busy_task) vTaskNotifyGiveFromISR(busy_task, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+
+//Wait for the EPD to not be busy anymore. Returns the time waited, in us.
+//Instead of polling, this blocks on a task notification from the BUSY interrupt. The same
+//level is also armed as a GPIO wakeup, so with automatic light sleep enabled the chip can
+//sleep through the (15-30 second) refresh.
+static int64_t wait_busy(int val, int timeout_ms) {
+	int64_t start=esp_timer_get_time();
+	gpio_int_type_t level=val?GPIO_INTR_HIGH_LEVEL:GPIO_INTR_LOW_LEVEL;
+	busy_task=xTaskGetCurrentTaskHandle();
+	ulTaskNotifyTake(pdTRUE, 0); //clear any stale notification
+	gpio_wakeup_enable(PIN_NUM_BUSY, level); //also sets the interrupt type
+	gpio_intr_enable(PIN_NUM_BUSY);
+	if (!ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout_ms)) && gpio_get_level(PIN_NUM_BUSY)!=val) {
+		ESP_LOGE(TAG, "Timeout on waiting for busy to go %s!", val?"high":"low");
 	}
+	gpio_intr_disable(PIN_NUM_BUSY);
+	gpio_wakeup_disable(PIN_NUM_BUSY);
+	busy_task=NULL;
+	return esp_timer_get_time()-start;
 }
 
 //Initialize the display
@@ -140,6 +169,18 @@ static void epd_init(spi_device_handle_t spi) {
 	gpio_set_direction(PIN_NUM_RST, GPIO_MODE_OUTPUT);
 	gpio_set_direction(PIN_NUM_BUSY, GPIO_MODE_INPUT);
 
+	//Hook up the BUSY interrupt. The ISR service may already have been installed by
+	//an earlier epd_init, or by some other driver.
+	static int busy_isr_installed=0;
+	if (!busy_isr_installed) {
+		esp_err_t r=gpio_install_isr_service(0);
+		if (r!=ESP_OK && r!=ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(r);
+		ESP_ERROR_CHECK(gpio_isr_handler_add(PIN_NUM_BUSY, busy_isr, NULL));
+		esp_sleep_enable_gpio_wakeup();
+		busy_isr_installed=1;
+	}
+	gpio_intr_disable(PIN_NUM_BUSY);
+
 	//Reset the display
 	gpio_set_level(PIN_NUM_RST, 0);
 	vTaskDelay(pdMS_TO_TICKS(10));
@@ -147,7 +188,7 @@ static void epd_init(spi_device_handle_t spi) {
 	vTaskDelay(pdMS_TO_TICKS(100));
 
 	//wait for not busy
-	wait_busy(1, 1000);
+	last_timings.init_us=wait_busy(1, 1000);
 
 	//Send all the commands
 	while (epd_init_cmds[cmd].databytes!=0xff) {
@@ -162,11 +203,45 @@ static void epd_init(spi_device_handle_t spi) {
 	}
 }
 
-extern const uint8_t icons_bmp_start[] asm("_binary_icons_bmp_start");
-
 spi_device_handle_t spi;
 
-void epd_send(const uint8_t *epddata, int icon) {
+static epd_phase_cb_t phase_cb=NULL;
+
+void epd_set_phase_cb(epd_phase_cb_t cb) {
+	phase_cb=cb;
+}
+
+static void set_phase(epd_phase_t phase) {
+	if (phase_cb) phase_cb(phase);
+}
+
+void epd_get_timings(epd_timings_t *timings) {
+	*timings=last_timings;
+}
+
+//Sends the pixel data in bands of up to PARALLEL_LINES lines. Bands no overlay touches go
+//out straight from epddata (the SPI driver copies them into its DMA buffer anyway); the
+//others are copied into band and get the overlays drawn on them first.
+static void push_lines(const uint8_t *epddata, const overlay_t *overlay, uint8_t *band) {
+	int y=0;
+	while (y<LINES) {
+		int n=0;
+		if (!band || !overlay_touches(overlay, y)) {
+			while (n<PARALLEL_LINES && y+n<LINES && !(band && overlay_touches(overlay, y+n))) n++;
+			epd_data(spi, &epddata[y*LINE_BYTES], n*LINE_BYTES);
+		} else {
+			while (n<PARALLEL_LINES && y+n<LINES && overlay_touches(overlay, y+n)) {
+				memcpy(&band[n*LINE_BYTES], &epddata[(y+n)*LINE_BYTES], LINE_BYTES);
+				overlay_line(overlay, y+n, &band[n*LINE_BYTES]);
+				n++;
+			}
+			epd_data(spi, band, n*LINE_BYTES);
+		}
+		y+=n;
+	}
+}
+
+void epd_send(const uint8_t *epddata, const overlay_t *overlay) {
 	gpio_hold_dis(PIN_NUM_CS);
 	gpio_hold_dis(PIN_NUM_RST);
 
@@ -194,30 +269,39 @@ void epd_send(const uint8_t *epddata, int icon) {
 	ret=spi_bus_add_device(EPD_HOST, &devcfg, &spi);
 	ESP_ERROR_CHECK(ret);
 	//Initialize the EPD
+	set_phase(EPD_PHASE_INIT);
 	epd_init(spi);
 	
 	epd_cmd(spi, 0x61);
 	uint8_t data[4]={0x02, 0x58, 0x01, 0xC0};
 	epd_data(spi, data, 4);
 	epd_cmd(spi, 0x10);
-	int bmp_pix_start=icons_bmp_start[0xa]+(icons_bmp_start[0xb]<<8); //actually header is 32-bit... care.
-	//ESP_LOGI(TAG, "bmp starts at 0x%X", bmp_pix_start);
-	for (int y=0; y<448; y++) {
-		uint8_t buf[300];
-		memcpy(buf, &epddata[y*300], 300);
-		if (icon!=0 && y<32) {
-			//the bmp is a file with 4-bit info. Each icon is 32x32 pixels (aka 32x16 bytes)
-			memcpy(buf, &icons_bmp_start[bmp_pix_start+y*16+(icon-1)*(16*32)], 16);
-		}
-		epd_data(spi, buf, 300);
+	set_phase(EPD_PHASE_PUSH);
+	int64_t push_start=esp_timer_get_time();
+	uint8_t *band=NULL;
+	if (overlay && overlay->count>0) {
+		band=heap_caps_malloc(PARALLEL_LINES*LINE_BYTES, MALLOC_CAP_DMA);
+		if (!band) ESP_LOGW(TAG, "No memory for overlays; sending the image without them");
 	}
+	push_lines(epddata, overlay, band);
+	free(band);
+	last_timings.push_us=esp_timer_get_time()-push_start;
+	set_phase(EPD_PHASE_POWER_ON);
 	epd_cmd(spi, 0x4);
-	wait_busy(1, 30000);
+	last_timings.power_on_us=wait_busy(1, 30000);
+	set_phase(EPD_PHASE_REFRESH);
 	epd_cmd(spi, 0x12);
-	wait_busy(1, 30000);
+	last_timings.refresh_us=wait_busy(1, 30000);
+	set_phase(EPD_PHASE_POWER_OFF);
 	epd_cmd(spi, 0x2);
-	wait_busy(1, 30000);
-	ESP_LOGI(TAG, "Displayed image.");
+	last_timings.power_off_us=wait_busy(1, 30000);
+	metrics_add(METRIC_EPD_SEND_COUNT, 1);
+	metrics_add(METRIC_EPD_SPI_US, last_timings.push_us);
+	metrics_add(METRIC_EPD_REFRESH_US, last_timings.power_on_us+last_timings.refresh_us+last_timings.power_off_us);
+	ESP_LOGI(TAG, "Displayed image. init %lld ms, push %lld ms, power on %lld ms, refresh %lld ms, power off %lld ms",
+			last_timings.init_us/1000, last_timings.push_us/1000, last_timings.power_on_us/1000,
+			last_timings.refresh_us/1000, last_timings.power_off_us/1000);
+	set_phase(EPD_PHASE_DONE);
 }
 
 void epd_shutdown() {
@@ -225,6 +309,9 @@ void epd_shutdown() {
 	epd_cmd(spi, 0x7);
 	uint8_t sdata=0xA5;
 	epd_data(spi, &sdata, 1);
+	//Release the bus, so the next epd_send() can set it up again.
+	spi_bus_remove_device(spi);
+	spi_bus_free(EPD_HOST);
 	const gpio_config_t cfg={
 		.pin_bit_mask=(1<<PIN_NUM_DC)|(1<<PIN_NUM_RST)|(1<<PIN_NUM_MOSI)|(1<<PIN_NUM_CS)|(1<<PIN_NUM_CLK),
 		.mode=GPIO_MODE_OUTPUT
@@ -1,9 +1,31 @@
+#pragma once
+#include <stdint.h>
+#include "overlay.h"
 
-#define ICON_NONE 0
-//note: icons are bottom to top in bmp
-#define ICON_BAT_EMPTY 1
-#define ICON_WIFI 2
-#define ICON_SERVER 3
+//Duration of each phase of the last epd_send(), in microseconds
+typedef struct {
+	int64_t init_us;		//reset until the panel is ready for commands
+	int64_t push_us;		//sending the pixel data over SPI
+	int64_t power_on_us;
+	int64_t refresh_us;
+	int64_t power_off_us;
+} epd_timings_t;
 
-void epd_send(const uint8_t *epddata, int icon);
+//What epd_send() is doing
+typedef enum {
+	EPD_PHASE_INIT=0,
+	EPD_PHASE_PUSH,
+	EPD_PHASE_POWER_ON,
+	EPD_PHASE_REFRESH,
+	EPD_PHASE_POWER_OFF,
+	EPD_PHASE_DONE
+} epd_phase_t;
+
+//Called from epd_send() every time it enters a new phase
+typedef void (*epd_phase_cb_t)(epd_phase_t phase);
+
+//Sends an image to the panel and refreshes it, with the overlays (if not NULL) drawn over it.
+void epd_send(const uint8_t *epddata, const overlay_t *overlay);
 void epd_shutdown();
+void epd_get_timings(epd_timings_t *timings);
+void epd_set_phase_cb(epd_phase_cb_t cb);
@@ -3,7 +3,13 @@
 typedef struct __attribute__((packed)) {
 	uint32_t id;
 	uint64_t timestamp;
-	uint8_t unused[64-12];
+	uint8_t strategy;		//how conv converted the image; informational only
+	uint8_t kernel;
+	uint16_t conv_ms;
+	uint16_t deadline_ms;
+	uint8_t strength;
+	uint8_t saturation;
+	uint8_t unused[64-20];
 } flash_image_hdr_t;
 
 typedef struct __attribute__((packed)) {
@@ -18,3 +24,18 @@ typedef struct __attribute__((packed)) {
 static inline int img_valid(const flash_image_hdr_t *img) {
 	return (img->id==0xfafa1a1a);
 }
+
+//Block delta from an image the device already has to a new one, as served by
+//epd-imgdelta.php: an img_delta_hdr_t, the new image's flash_image_hdr_t, a bitmap with one
+//bit per IMG_DELTA_BLOCK bytes of image data (LSB first; set if the block changed), and then
+//the contents of the changed blocks, in order.
+#define IMG_DELTA_MAGIC 0x44445045 //'EPDD'
+#define IMG_DELTA_BLOCK 64
+#define IMG_DELTA_BLOCKS ((600*448/2)/IMG_DELTA_BLOCK)
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	int32_t id;				//image this makes
+	int32_t base_id;		//image it's made from
+	uint32_t block_size;
+} img_delta_hdr_t;
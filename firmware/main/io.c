@@ -13,7 +13,6 @@
 #include <esp_adc/adc_oneshot.h>
 #include <esp_adc/adc_cali_scheme.h>
 #include <driver/gpio.h>
-#include <esp_timer.h>
 
 
 #define PIN_NUM_BTN 10
@@ -22,10 +21,12 @@ static adc_oneshot_unit_handle_t adc1_handle;
 static adc_cali_handle_t cal_handle;
 
 //For the battery, we record the minimum voltage. Given that WiFi startup loads the battery,
-//this gives a better indication of the state of the thing.
+//this gives a better indication of the state of the thing. It's sampled once at boot and
+//again whenever someone asks, rather than on a timer: a periodic timer would wake the CPU
+//out of light sleep during the EPD refresh.
 int min_bat=9999;
 
-void adc_callback(void *arg) {
+static void sample_battery() {
 	int raw, mv;
 	ESP_ERROR_CHECK(adc_oneshot_read(adc1_handle, ADC_CHANNEL_0, &raw));
 	adc_cali_raw_to_voltage(cal_handle, raw, &mv);
@@ -39,12 +40,7 @@ void io_init() {
 		.pull_up_en=GPIO_PULLUP_ENABLE
 	};
 	gpio_config(&gpio_cfg);
-	esp_timer_create_args_t config={
-		.callback=adc_callback,
-		.name="adc",
-		.skip_unhandled_events=true
-	};
-	
+
 	adc_oneshot_unit_init_cfg_t adc1_cfg = {
 		.unit_id = ADC_UNIT_1,
 		.ulp_mode = false,
@@ -62,10 +58,7 @@ void io_init() {
 	};
 	ESP_ERROR_CHECK(adc_cali_create_scheme_curve_fitting(&cali_config, &cal_handle));
 
-	adc_callback(NULL); //first callback is manual
-	esp_timer_handle_t handle;
-	esp_timer_create(&config, &handle);
-	esp_timer_start_periodic(handle, 50*1000);
+	sample_battery();
 }
 
 int io_get_btn() {
@@ -73,5 +66,6 @@ int io_get_btn() {
 }
 
 int io_get_battery_mv() {
+	sample_battery();
 	return min_bat;
 }
\ No newline at end of file
@@ -0,0 +1,524 @@
+/*
+On-device JPEG to EPD conversion. This takes a baseline JPEG as the body of a POST to
+/upload-jpeg, decodes it with the TJpgDec decoder in ROM one MCU row at a time, scales
+it to fit 600x448, Floyd-Steinberg dithers it to the EPD palette and streams the result
+into an image slot. It does the same thing as conv does on the server, but never holds
+more than a strip of the image in RAM. Flash sectors are erased just before they're first
+written to, and the header goes in last, so a JPEG that fails to decode leaves an empty
+slot rather than a half-converted image. (There's no room in the partition to stage the
+new image next to the old one.)
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/param.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "esp_http_server.h"
+#include "rom/tjpgd.h"
+#include "epd.h"
+#include "epd_flash_image.h"
+#include "metrics.h"
+#include "jpegconv.h"
+#include "display.h"
+#include "progress.h"
+#include "sched.h"
+
+static const char *TAG="jpegconv";
+
+#define EPD_W 600
+#define EPD_H 448
+
+//Same as conv: the panel is mounted upside down.
+#define EPD_UPSIDE_DOWN 1
+
+//Work memory the ROM decoder needs
+#define TJPGD_POOL_SIZE 3100
+//Rows of packed EPD data we collect before writing them to flash in one go. Must divide EPD_H.
+#define ROWS_PER_WRITE 8
+//Send a receive progress event every this many bytes of JPEG
+#define PROGRESS_BYTES 8192
+
+//Fixed point: linear light values are 0..LIN_ONE
+#define LIN_SHIFT 12
+#define LIN_ONE (1<<LIN_SHIFT)
+
+//Palette, in linear RGB. Same as epd_colors in conv.c.
+static const float epd_colors[7][3]={
+	{0,0,0},
+	{1,1,1},
+	{0.059, 0.329, 0.119},
+	{0.061, 0.147, 0.336},
+	{0.574, 0.066, 0.010},
+	{0.982, 0.756, 0.004},
+	{0.795, 0.255, 0.018},
+};
+
+//Lookup tables, generated on first use.
+static uint16_t srgb_to_lin[256];			//8-bit sRGB -> linear, fixed point
+static uint8_t lin_to_cell[(LIN_ONE>>2)+1];	//linear>>2 -> 0..15, perceptually spaced
+static uint8_t nearest_lut[16*16*16];		//cell rgb -> palette index
+static int16_t pal_lin[7][3];
+static int luts_ready=0;
+
+//Converts linearized RGB [0..1] to CIE-LAB. See conv.c.
+static void rgb_to_lab(const float *rgb, float *lab) {
+	float v[3];
+	for (int i=0; i<3; i++) {
+		v[i]=rgb[i]*100;
+		if (v[i]>100) v[i]=100;
+		if (v[i]<0) v[i]=0;
+	}
+	float xyz[3]={
+		(v[0]*0.4124f+v[1]*0.3576f+v[2]*0.1805f)/95.047f,
+		(v[0]*0.2126f+v[1]*0.7152f+v[2]*0.0722f)/100.0f,
+		(v[0]*0.0193f+v[1]*0.1192f+v[2]*0.9505f)/108.883f
+	};
+	for (int i=0; i<3; i++) {
+		xyz[i]=(xyz[i]>0.008856f)?cbrtf(xyz[i]):(7.787f*xyz[i])+(16.0f/116);
+	}
+	lab[0]=(116*xyz[1])-16;
+	lab[1]=500*(xyz[0]-xyz[1]);
+	lab[2]=200*(xyz[1]-xyz[2]);
+}
+
+static inline float deg2rad(float deg) {
+	return (2*M_PI*deg)/360.0f;
+}
+
+//deltaE00 difference between two LAB colors. Same as col_diff in conv.c.
+static float lab_diff(const float *lab1, const float *lab2) {
+	float avgL=(lab1[0]+lab2[0])/2;
+	float c1=sqrtf(lab1[1]*lab1[1]+lab1[2]*lab1[2]);
+	float c2=sqrtf(lab2[1]*lab2[1]+lab2[2]*lab2[2]);
+	float avgC=(c1+c2)/2;
+	float avgC7=powf(avgC, 7);
+	float g=(1-sqrtf(avgC7/(avgC7+6103515625.0f)))/2; //25^7
+	float a1p=lab1[1]*(1+g);
+	float a2p=lab2[1]*(1+g);
+	float c1p=sqrtf(a1p*a1p+lab1[2]*lab1[2]);
+	float c2p=sqrtf(a2p*a2p+lab2[2]*lab2[2]);
+	float avgCp=(c1p+c2p)/2;
+	float h1p=atan2f(lab1[2], a1p)*180/M_PI;
+	if (h1p<0) h1p+=360;
+	float h2p=atan2f(lab2[2], a2p)*180/M_PI;
+	if (h2p<0) h2p+=360;
+	float avghp=fabsf(h1p-h2p)>180?(h1p+h2p+360)/2:(h1p+h2p)/2;
+	float t=1-0.17f*cosf(deg2rad(avghp-30))+0.24f*cosf(deg2rad(2*avghp))+0.32f*cosf(deg2rad(3*avghp+6))-0.2f*cosf(deg2rad(4*avghp-63));
+	float deltahp=h2p-h1p;
+	if (fabsf(deltahp)>180) {
+		if (h2p<=h1p) deltahp+=360; else deltahp-=360;
+	}
+	float deltalp=lab2[0]-lab1[0];
+	float deltacp=c2p-c1p;
+	deltahp=2*sqrtf(c1p*c2p)*sinf(deg2rad(deltahp)/2);
+	float sl=1+((0.015f*(avgL-50)*(avgL-50))/sqrtf(20+(avgL-50)*(avgL-50)));
+	float sc=1+0.045f*avgCp;
+	float sh=1+0.015f*avgCp*t;
+	float deltaro=30*expf(-((avghp-275)/25)*((avghp-275)/25));
+	float avgCp7=powf(avgCp, 7);
+	float rc=2*sqrtf(avgCp7/(avgCp7+6103515625.0f));
+	float rt=-rc*sinf(2*deg2rad(deltaro));
+	float dl=deltalp/sl, dc=deltacp/sc, dh=deltahp/sh;
+	return sqrtf(dl*dl+dc*dc+dh*dh+rt*dc*dh);
+}
+
+static float gamma_linear(float in) {
+	return (in>0.04045f)?powf((in+0.055f)/1.055f, 2.4f):(in/12.92f);
+}
+
+static float gamma_srgb(float in) {
+	return (in>0.0031308f)?1.055f*powf(in, 1/2.4f)-0.055f:in*12.92f;
+}
+
+//The palette search is the expensive bit, so it's done once per boot into a 16x16x16
+//table. Cells are spaced evenly in sRGB, which is close enough to perceptually even
+//that the error diffusion takes care of the rest.
+static void init_luts() {
+	if (luts_ready) return;
+	int64_t start=esp_timer_get_time();
+	for (int i=0; i<256; i++) {
+		srgb_to_lin[i]=gamma_linear(i/255.0f)*LIN_ONE+0.5f;
+	}
+	for (int i=0; i<=(LIN_ONE>>2); i++) {
+		int s=gamma_srgb((i<<2)/(float)LIN_ONE)*255.0f+0.5f;
+		lin_to_cell[i]=MIN(s, 255)>>4;
+	}
+	float pal_lab[7][3];
+	for (int i=0; i<7; i++) {
+		rgb_to_lab(epd_colors[i], pal_lab[i]);
+		for (int c=0; c<3; c++) pal_lin[i][c]=epd_colors[i][c]*LIN_ONE+0.5f;
+	}
+	for (int r=0; r<16; r++) {
+		for (int g=0; g<16; g++) {
+			for (int b=0; b<16; b++) {
+				//center of the cell
+				float rgb[3]={gamma_linear((r*16+8)/255.0f), gamma_linear((g*16+8)/255.0f), gamma_linear((b*16+8)/255.0f)};
+				float lab[3];
+				rgb_to_lab(rgb, lab);
+				int best=0;
+				float best_dif=999999999;
+				for (int i=0; i<7; i++) {
+					float d=lab_diff(lab, pal_lab[i]);
+					if (d<best_dif) {
+						best_dif=d;
+						best=i;
+					}
+				}
+				nearest_lut[(r<<8)|(g<<4)|b]=best;
+			}
+		}
+	}
+	luts_ready=1;
+	ESP_LOGI(TAG, "Palette tables generated in %lld ms", (esp_timer_get_time()-start)/1000);
+}
+
+typedef struct {
+	httpd_req_t *req;
+	int remaining;				//bytes of request body not read yet
+	int reported;				//remaining at the last progress event
+	const esp_partition_t *part;
+	int slot;
+	esp_err_t err;				//first error while writing
+	uint64_t erased;			//bitmap of the sectors of the slot erased so far
+	//Geometry
+	int sw, sh;					//size of the (scaled) decoded image
+	int ox, oy, nw, nh;			//where the image goes in the EPD frame
+	int16_t *dx_first;			//[sw] first destination column for a source column, -1 if none
+	uint16_t *sxmap;			//[nw] source column for each destination column
+	//Buffers
+	uint8_t *strip;				//[strip_h][nw][3] sampled columns of the current MCU row
+	int strip_h;
+	uint8_t *row;				//[EPD_W][3] rgb row being dithered
+	int16_t *err_cur, *err_next;	//[(EPD_W+2)*3] error diffusion rows
+	uint8_t *packed;			//[ROWS_PER_WRITE][EPD_W/2] packed output waiting to be written
+	int next_row;				//next destination row to output
+} jpegconv_t;
+
+static UINT jpeg_in(JDEC *jd, BYTE *buf, UINT len) {
+	jpegconv_t *c=(jpegconv_t*)jd->device;
+	uint8_t skip[64];
+	UINT done=0;
+	while (done<len && c->remaining>0) {
+		int n=MIN(len-done, c->remaining);
+		if (!buf) n=MIN(n, sizeof(skip));
+		int r=httpd_req_recv(c->req, buf?(char*)buf+done:(char*)skip, n);
+		if (r==HTTPD_SOCK_ERR_TIMEOUT) continue;
+		if (r<=0) break;
+		done+=r;
+		c->remaining-=r;
+	}
+	metrics_add(METRIC_UPLOAD_BYTES, done);
+	if (c->reported-c->remaining>=PROGRESS_BYTES || (c->remaining==0 && c->reported!=0)) {
+		c->reported=c->remaining;
+		progress_send("{\"type\":\"upload\",\"stage\":\"receive\",\"offset\":%d,\"size\":%d,\"slot\":%d}",
+				c->req->content_len-c->remaining, c->req->content_len, c->slot);
+	}
+	return done;
+}
+
+//Dither one 600-pixel rgb row into the palette and pack it the way the EPD wants it.
+//Only two rows of error are kept: the one for this row and the one for the next.
+static void dither_row(jpegconv_t *c, int y) {
+	int16_t *e=c->err_cur+3; //error arrays have a pixel of slack on each side
+	int16_t *en=c->err_next+3;
+	memset(c->err_next, 0, (EPD_W+2)*3*sizeof(int16_t));
+#if EPD_UPSIDE_DOWN
+	uint8_t *prow=&c->packed[(ROWS_PER_WRITE-1-(y%ROWS_PER_WRITE))*(EPD_W/2)];
+#else
+	uint8_t *prow=&c->packed[(y%ROWS_PER_WRITE)*(EPD_W/2)];
+#endif
+	int ob=0;
+	for (int x=0; x<EPD_W; x++) {
+		int v[3];
+		for (int i=0; i<3; i++) {
+			v[i]=srgb_to_lin[c->row[x*3+i]]+e[x*3+i];
+			if (v[i]<0) v[i]=0;
+			if (v[i]>LIN_ONE) v[i]=LIN_ONE;
+		}
+		int best=nearest_lut[(lin_to_cell[v[0]>>2]<<8)|(lin_to_cell[v[1]>>2]<<4)|lin_to_cell[v[2]>>2]];
+		//Distribute difference between chosen and ideal color using Floyd-Steinberg
+		for (int i=0; i<3; i++) {
+			int dif=v[i]-pal_lin[best][i];
+			e[(x+1)*3+i]+=(dif*7)/16;
+			en[(x-1)*3+i]+=(dif*3)/16;
+			en[x*3+i]+=(dif*5)/16;
+			en[(x+1)*3+i]+=dif/16;
+		}
+#if EPD_UPSIDE_DOWN
+		if (x&1) {
+			prow[(EPD_W-1-x)/2]=ob|(best<<4);
+		} else {
+			ob=best;
+		}
+#else
+		if (x&1) {
+			prow[x/2]=(ob<<4)|best;
+		} else {
+			ob=best;
+		}
+#endif
+	}
+	int16_t *t=c->err_cur;
+	c->err_cur=c->err_next;
+	c->err_next=t;
+}
+
+_Static_assert(IMG_SIZE_BYTES/SPI_FLASH_SEC_SIZE<=64, "erased bitmap is 64 bits");
+
+//Erases the sectors of the slot in [offset, offset+len) that haven't been erased yet.
+//Called with the images lock held.
+static esp_err_t erase_sectors(jpegconv_t *c, int offset, int len) {
+	for (int s=offset/SPI_FLASH_SEC_SIZE; s<=(offset+len-1)/SPI_FLASH_SEC_SIZE; s++) {
+		if (c->erased&(1ULL<<s)) continue;
+		int64_t t=esp_timer_get_time();
+		esp_err_t err=esp_partition_erase_range(c->part, c->slot*IMG_SIZE_BYTES+s*SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+		metrics_add(METRIC_FLASH_ERASE_US, esp_timer_get_time()-t);
+		metrics_add(METRIC_FLASH_ERASE_COUNT, 1);
+		metrics_add(METRIC_FLASH_ERASE_BYTES, SPI_FLASH_SEC_SIZE);
+		if (err!=ESP_OK) return err;
+		c->erased|=(1ULL<<s);
+	}
+	return ESP_OK;
+}
+
+//Outputs the row in c->row as destination row c->next_row.
+static void output_row(jpegconv_t *c) {
+	int y=c->next_row++;
+	dither_row(c, y);
+	if ((y%ROWS_PER_WRITE)==ROWS_PER_WRITE-1 && c->err==ESP_OK) {
+		//Rows come in top to bottom, but the image is upside down in flash, so the block
+		//we've collected goes right before the previous one.
+#if EPD_UPSIDE_DOWN
+		int first=EPD_H-1-y;
+#else
+		int first=y-(ROWS_PER_WRITE-1);
+#endif
+		int offset=sizeof(flash_image_hdr_t)+first*(EPD_W/2);
+		display_lock_images();
+		c->err=erase_sectors(c, offset, ROWS_PER_WRITE*(EPD_W/2));
+		if (c->err==ESP_OK) {
+			int64_t t=esp_timer_get_time();
+			c->err=esp_partition_write(c->part, c->slot*IMG_SIZE_BYTES+offset, c->packed, ROWS_PER_WRITE*(EPD_W/2));
+			metrics_add(METRIC_FLASH_WRITE_US, esp_timer_get_time()-t);
+			metrics_add(METRIC_FLASH_WRITE_COUNT, 1);
+			metrics_add(METRIC_FLASH_WRITE_BYTES, ROWS_PER_WRITE*(EPD_W/2));
+		}
+		display_unlock_images();
+		progress_send("{\"type\":\"upload\",\"stage\":\"flash\",\"offset\":%d,\"size\":%d,\"slot\":%d}",
+				(y+1)*(EPD_W/2), EPD_H*(EPD_W/2), c->slot);
+	}
+}
+
+//Outputs white rows until we're at destination row 'end'.
+static void output_blank_rows(jpegconv_t *c, int end) {
+	memset(c->row, 0xff, EPD_W*3);
+	while (c->next_row<end) output_row(c);
+}
+
+//Called by the decoder for every decoded MCU block, in raster order.
+static UINT jpeg_out(JDEC *jd, void *bitmap, JRECT *rect) {
+	jpegconv_t *c=(jpegconv_t*)jd->device;
+	const uint8_t *src=(const uint8_t*)bitmap;
+	int w=rect->right-rect->left+1;
+	//Keep only the columns we actually sample
+	for (int y=rect->top; y<=rect->bottom; y++) {
+		uint8_t *srow=&c->strip[(y-rect->top)*c->nw*3];
+		for (int x=rect->left; x<=rect->right; x++) {
+			int dx=c->dx_first[x];
+			if (dx>=0) {
+				const uint8_t *p=&src[((y-rect->top)*w+(x-rect->left))*3];
+				while (dx<c->nw && c->sxmap[dx]==x) {
+					memcpy(&srow[dx*3], p, 3);
+					dx++;
+				}
+			}
+		}
+	}
+	if (rect->right<c->sw-1) return 1; //MCU row not complete yet
+	//MCU row done: output all destination rows that sample from it.
+	while (c->next_row<c->oy+c->nh) {
+		int sy=((c->next_row-c->oy)*c->sh)/c->nh;
+		if (sy>rect->bottom) break;
+		memcpy(&c->row[c->ox*3], &c->strip[(sy-rect->top)*c->nw*3], c->nw*3);
+		output_row(c);
+	}
+	return (c->err==ESP_OK)?1:0;
+}
+
+//Map a decoder result to a message for the client.
+static const char *jresult_str(JRESULT r) {
+	switch (r) {
+		case JDR_INP: return "Premature end of JPEG data";
+		case JDR_MEM1: case JDR_MEM2: return "JPEG too complex for the decoder";
+		case JDR_FMT1: return "Not a JPEG file";
+		case JDR_FMT3: return "Unsupported JPEG (progressive?)";
+		default: return "Could not decode JPEG";
+	}
+}
+
+static void jpegconv_free(jpegconv_t *c) {
+	free(c->dx_first);
+	free(c->sxmap);
+	free(c->strip);
+	free(c->row);
+	free(c->err_cur);
+	free(c->err_next);
+	free(c->packed);
+}
+
+esp_err_t upload_jpeg_handler(httpd_req_t *req) {
+	jpegconv_t c={0};
+	JDEC jd;
+	int64_t start=esp_timer_get_time();
+	int heap_before=esp_get_free_heap_size();
+	char query[32], val[8];
+	if (httpd_req_get_url_query_str(req, query, sizeof(query))==ESP_OK &&
+			httpd_query_key_value(query, "slot", val, sizeof(val))==ESP_OK) {
+		c.slot=atoi(val);
+	}
+	if (c.slot<0 || c.slot>=IMG_SLOT_COUNT) {
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid slot");
+		return ESP_FAIL;
+	}
+	c.part=esp_partition_find_first(123, 0, NULL);
+	if (c.part==NULL) {
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Images partition not found");
+		return ESP_FAIL;
+	}
+	init_luts();
+	c.req=req;
+	c.remaining=req->content_len;
+	c.reported=c.remaining;
+
+	void *pool=malloc(TJPGD_POOL_SIZE);
+	if (!pool) {
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+		return ESP_FAIL;
+	}
+	JRESULT jr=jd_prepare(&jd, jpeg_in, pool, TJPGD_POOL_SIZE, &c);
+	if (jr!=JDR_OK) {
+		free(pool);
+		ESP_LOGE(TAG, "jd_prepare failed: %d", jr);
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, jresult_str(jr));
+		return ESP_FAIL;
+	}
+
+	//Fit the image in the frame, same as conv does: scale to fit, center, white borders.
+	c.nw=EPD_W;
+	c.nh=(jd.height*EPD_W)/jd.width;
+	if (c.nh>EPD_H) {
+		c.nh=EPD_H;
+		c.nw=(jd.width*EPD_H)/jd.height;
+	}
+	if (c.nw<1) c.nw=1;
+	if (c.nh<1) c.nh=1;
+	c.ox=(EPD_W-c.nw)/2;
+	c.oy=(EPD_H-c.nh)/2;
+	//Let the decoder do as much of the downscaling as it can (1/2, 1/4 or 1/8); we
+	//pick the remaining pixels nearest-neighbour.
+	int scale=0;
+	while (scale<3 && ((jd.width-1)>>(scale+1))+1>=c.nw && ((jd.height-1)>>(scale+1))+1>=c.nh) scale++;
+	c.sw=((jd.width-1)>>scale)+1;
+	c.sh=((jd.height-1)>>scale)+1;
+	c.strip_h=(jd.msy*8)>>scale;
+	if (c.strip_h<1) c.strip_h=1;
+	ESP_LOGI(TAG, "JPEG %dx%d, decoding at 1/%d to %dx%d, placing at %dx%d+%d+%d",
+				jd.width, jd.height, 1<<scale, c.sw, c.sh, c.nw, c.nh, c.ox, c.oy);
+
+	c.dx_first=malloc(c.sw*sizeof(int16_t));
+	c.sxmap=malloc(c.nw*sizeof(uint16_t));
+	c.strip=malloc(c.strip_h*c.nw*3);
+	c.row=malloc(EPD_W*3);
+	c.err_cur=calloc((EPD_W+2)*3, sizeof(int16_t));
+	c.err_next=calloc((EPD_W+2)*3, sizeof(int16_t));
+	c.packed=malloc(ROWS_PER_WRITE*(EPD_W/2));
+	if (!c.dx_first || !c.sxmap || !c.strip || !c.row || !c.err_cur || !c.err_next || !c.packed) {
+		jpegconv_free(&c);
+		free(pool);
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+		return ESP_FAIL;
+	}
+	int heap_used=heap_before-esp_get_free_heap_size();
+	for (int x=0; x<c.sw; x++) c.dx_first[x]=-1;
+	for (int dx=c.nw-1; dx>=0; dx--) {
+		c.sxmap[dx]=(dx*c.sw)/c.nw;
+		c.dx_first[c.sxmap[dx]]=dx;
+	}
+
+	//Erase the header first, so the slot is invalid until the whole image is in and the
+	//header goes back in last. The rest of the slot is erased as the rows get there.
+	display_lock_images();
+	esp_err_t err=erase_sectors(&c, 0, sizeof(flash_image_hdr_t));
+	display_unlock_images();
+	if (err!=ESP_OK) {
+		jpegconv_free(&c);
+		free(pool);
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to erase slot");
+		return ESP_FAIL;
+	}
+	sched_slot_updated(c.slot, false);
+
+	output_blank_rows(&c, c.oy);
+	memset(c.row, 0xff, EPD_W*3); //left/right borders stay white
+	jr=jd_decomp(&jd, jpeg_out, scale);
+	if (jr==JDR_OK) output_blank_rows(&c, EPD_H);
+	jpegconv_free(&c);
+	free(pool);
+	if (jr!=JDR_OK || c.err!=ESP_OK) {
+		ESP_LOGE(TAG, "Conversion failed: jd_decomp %d, flash %s", jr, esp_err_to_name(c.err));
+		if (c.err!=ESP_OK) {
+			httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write data");
+		} else {
+			httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, jresult_str(jr));
+		}
+		return ESP_FAIL;
+	}
+
+	//Without a clock set by a sync, time(NULL) counts from 1970 and means nothing.
+	time_t now=time(NULL);
+	struct tm tm;
+	localtime_r(&now, &tm);
+	flash_image_hdr_t hdr={
+		.id=0xfafa1a1a,
+		.timestamp=(tm.tm_year+1900>=2024)?now:0
+	};
+	display_lock_images();
+	err=esp_partition_write(c.part, c.slot*IMG_SIZE_BYTES, &hdr, sizeof(hdr));
+	display_unlock_images();
+	if (err!=ESP_OK) {
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write header");
+		return ESP_FAIL;
+	}
+	int64_t conv_us=esp_timer_get_time()-start;
+	metrics_add(METRIC_UPLOAD_COUNT, 1);
+	metrics_add(METRIC_UPLOAD_US, conv_us);
+	metrics_set(METRIC_UPLOAD_LAST_BYTES, req->content_len);
+	metrics_set(METRIC_UPLOAD_LAST_US, conv_us);
+	ESP_LOGI(TAG, "Converted %d byte JPEG into slot %d in %lld ms; working memory %d bytes",
+				req->content_len, c.slot, conv_us/1000, heap_used);
+
+	progress_send("{\"type\":\"upload\",\"stage\":\"done\",\"offset\":%d,\"size\":%d,\"slot\":%d}",
+			EPD_H*(EPD_W/2), EPD_H*(EPD_W/2), c.slot);
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
+
+	sched_slot_updated(c.slot, true);
+	display_show_slot(c.slot);
+	return ESP_OK;
+}
@@ -0,0 +1,6 @@
+#pragma once
+#include "esp_http_server.h"
+
+//Handler for POST /upload-jpeg[?slot=n]. The body is a baseline JPEG, which gets converted
+//to EPD format on the device, stored in the slot and shown.
+esp_err_t upload_jpeg_handler(httpd_req_t *req);
@@ -0,0 +1,222 @@
+/*
+Performance counters, and the /metrics endpoint that exposes them.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_wifi.h"
+#include "esp_http_server.h"
+#include "epd.h"
+#include "metrics.h"
+#include "telemetry.h"
+
+static const char *TAG="metrics";
+
+//Counters are 64-bit so the microsecond totals don't wrap; increments are relaxed atomics,
+//we only need them not to tear.
+static _Atomic uint64_t counters[METRIC_COUNT];
+
+typedef struct {
+	const char *name;		//name without prefix; Prometheus metric is picframe_<name>
+	const char *type;		//"counter" or "gauge"
+	const char *help;
+} metric_desc_t;
+
+static const metric_desc_t metric_desc[METRIC_COUNT]={
+	[METRIC_UPLOAD_COUNT]={"upload_count", "counter", "Image uploads completed"},
+	[METRIC_UPLOAD_BYTES]={"upload_bytes", "counter", "Bytes received in image uploads"},
+	[METRIC_UPLOAD_US]={"upload_us", "counter", "Time spent receiving image uploads"},
+	[METRIC_UPLOAD_LAST_BYTES]={"upload_last_bytes", "gauge", "Size of the last upload"},
+	[METRIC_UPLOAD_LAST_US]={"upload_last_us", "gauge", "Duration of the last upload"},
+	[METRIC_FLASH_ERASE_COUNT]={"flash_erase_count", "counter", "Flash erase operations"},
+	[METRIC_FLASH_ERASE_BYTES]={"flash_erase_bytes", "counter", "Bytes of flash erased"},
+	[METRIC_FLASH_ERASE_US]={"flash_erase_us", "counter", "Time spent erasing flash"},
+	[METRIC_FLASH_WRITE_COUNT]={"flash_write_count", "counter", "Flash write operations"},
+	[METRIC_FLASH_WRITE_BYTES]={"flash_write_bytes", "counter", "Bytes written to flash"},
+	[METRIC_FLASH_WRITE_US]={"flash_write_us", "counter", "Time spent writing flash"},
+	[METRIC_EPD_SEND_COUNT]={"epd_send_count", "counter", "Images sent to the EPD"},
+	[METRIC_EPD_SPI_US]={"epd_spi_us", "counter", "Time spent pushing pixel data over SPI"},
+	[METRIC_EPD_REFRESH_US]={"epd_refresh_us", "counter", "Time spent waiting for the EPD to refresh"},
+	[METRIC_WIFI_STA_CONNECTS]={"wifi_sta_connects", "counter", "Stations that associated with the AP"},
+	[METRIC_WIFI_STA_DISCONNECTS]={"wifi_sta_disconnects", "counter", "Stations that dropped off the AP"},
+	[METRIC_FAST_WAKE_COUNT]={"fast_wake_count", "gauge", "Deep sleep wakes that only refreshed the panel, since power-on"},
+	[METRIC_FAST_WAKE_LAST_US]={"fast_wake_last_us", "gauge", "Wake to sleep time of the last fast wake"},
+	[METRIC_FAST_WAKE_LAST_NAH]={"fast_wake_last_nah", "gauge", "Estimated charge used by the last fast wake, in nAh"},
+	[METRIC_FAST_WAKE_TOTAL_NAH]={"fast_wake_total_nah", "gauge", "Estimated charge used by all fast wakes, in nAh"},
+};
+
+//Time counters that are also a phase of the wake telemetry
+static const int8_t metric_phase[METRIC_COUNT]={
+	[0 ... METRIC_COUNT-1]=-1,
+	[METRIC_FLASH_ERASE_US]=TEL_FLASH_ERASE,
+	[METRIC_FLASH_WRITE_US]=TEL_FLASH_WRITE,
+	[METRIC_EPD_SPI_US]=TEL_SPI,
+	[METRIC_EPD_REFRESH_US]=TEL_REFRESH,
+};
+
+void metrics_add(metric_t m, uint32_t val) {
+	atomic_fetch_add_explicit(&counters[m], val, memory_order_relaxed);
+	if (metric_phase[m]>=0) telemetry_add(metric_phase[m], val);
+}
+
+void metrics_set(metric_t m, uint32_t val) {
+	atomic_store_explicit(&counters[m], val, memory_order_relaxed);
+}
+
+uint64_t metrics_get(metric_t m) {
+	return atomic_load_explicit(&counters[m], memory_order_relaxed);
+}
+
+#define MAX_TASKS 6
+
+typedef struct {
+	const char *name;
+	TaskHandle_t handle;
+} metric_task_t;
+
+static metric_task_t tasks[MAX_TASKS];
+static int task_count=0;
+
+void metrics_register_task(const char *name, TaskHandle_t task) {
+	if (task_count>=MAX_TASKS) {
+		ESP_LOGW(TAG, "No room to register task %s", name);
+		return;
+	}
+	tasks[task_count].name=name;
+	tasks[task_count].handle=task;
+	task_count++;
+}
+
+//Output helper, so the same code can generate JSON or Prometheus text. Everything goes out
+//via chunked transfer so we don't need a big buffer.
+typedef struct {
+	httpd_req_t *req;
+	int json;
+	int first;				//no value written yet (for JSON commas)
+	const char *group;		//JSON array currently open, if any
+} metric_out_t;
+
+static void out_str(metric_out_t *o, const char *s) {
+	httpd_resp_sendstr_chunk(o->req, s);
+}
+
+//Writes a plain value.
+static void out_val(metric_out_t *o, const char *name, const char *type, const char *help, uint64_t val) {
+	char buf[192];
+	if (o->json) {
+		snprintf(buf, sizeof(buf), "%s\"%s\":%llu", o->first?"":",", name, (unsigned long long)val);
+	} else {
+		snprintf(buf, sizeof(buf), "# HELP picframe_%s %s\n# TYPE picframe_%s %s\npicframe_%s %llu\n",
+				name, help, name, type, name, (unsigned long long)val);
+	}
+	o->first=0;
+	out_str(o, buf);
+}
+
+//Starts a group of labeled values, e.g. per-task stack water marks.
+static void out_group_start(metric_out_t *o, const char *name, const char *type, const char *help) {
+	char buf[160];
+	if (o->json) {
+		snprintf(buf, sizeof(buf), "%s\"%s\":{", o->first?"":",", name);
+	} else {
+		snprintf(buf, sizeof(buf), "# HELP picframe_%s %s\n# TYPE picframe_%s %s\n", name, help, name, type);
+	}
+	o->first=1;
+	o->group=name;
+	out_str(o, buf);
+}
+
+static void out_group_val(metric_out_t *o, const char *label, const char *labelval, int64_t val) {
+	char buf[128];
+	if (o->json) {
+		snprintf(buf, sizeof(buf), "%s\"%s\":%lld", o->first?"":",", labelval, (long long)val);
+	} else {
+		snprintf(buf, sizeof(buf), "picframe_%s{%s=\"%s\"} %lld\n", o->group, label, labelval, (long long)val);
+	}
+	o->first=0;
+	out_str(o, buf);
+}
+
+static void out_group_end(metric_out_t *o) {
+	if (o->json) out_str(o, "}");
+	o->first=0;
+	o->group=NULL;
+}
+
+esp_err_t metrics_handler(httpd_req_t *req) {
+	metric_out_t o={.req=req, .first=1};
+	char query[32];
+	char format[16];
+	if (httpd_req_get_url_query_str(req, query, sizeof(query))==ESP_OK &&
+			httpd_query_key_value(query, "format", format, sizeof(format))==ESP_OK) {
+		o.json=(strcmp(format, "json")==0);
+	}
+	httpd_resp_set_type(req, o.json?"application/json":"text/plain; version=0.0.4");
+	httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+	if (o.json) out_str(&o, "{");
+
+	for (int i=0; i<METRIC_COUNT; i++) {
+		out_val(&o, metric_desc[i].name, metric_desc[i].type, metric_desc[i].help, metrics_get(i));
+	}
+
+	//Derived throughput values, in bytes/second
+	uint64_t last_us=metrics_get(METRIC_UPLOAD_LAST_US);
+	uint64_t total_us=metrics_get(METRIC_UPLOAD_US);
+	out_val(&o, "upload_last_bps", "gauge", "Throughput of the last upload",
+			last_us?(metrics_get(METRIC_UPLOAD_LAST_BYTES)*1000000ULL)/last_us:0);
+	out_val(&o, "upload_avg_bps", "gauge", "Average upload throughput since boot",
+			total_us?(metrics_get(METRIC_UPLOAD_BYTES)*1000000ULL)/total_us:0);
+
+	//Phases of the last EPD refresh
+	epd_timings_t t;
+	epd_get_timings(&t);
+	out_group_start(&o, "epd_phase_us", "gauge", "Duration of each phase of the last EPD update");
+	out_group_val(&o, "phase", "init", t.init_us);
+	out_group_val(&o, "phase", "push", t.push_us);
+	out_group_val(&o, "phase", "power_on", t.power_on_us);
+	out_group_val(&o, "phase", "refresh", t.refresh_us);
+	out_group_val(&o, "phase", "power_off", t.power_off_us);
+	out_group_end(&o);
+
+	//Memory
+	out_val(&o, "heap_free_bytes", "gauge", "Free heap", esp_get_free_heap_size());
+	out_val(&o, "heap_min_free_bytes", "gauge", "Lowest free heap since boot", esp_get_minimum_free_heap_size());
+	out_val(&o, "heap_largest_block_bytes", "gauge", "Largest allocatable heap block",
+			heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+	out_group_start(&o, "stack_free_min_bytes", "gauge", "Stack high-water mark per task");
+	out_group_val(&o, "task", "httpd", uxTaskGetStackHighWaterMark(NULL)); //we run in the httpd task
+	for (int i=0; i<task_count; i++) {
+		out_group_val(&o, "task", tasks[i].name, uxTaskGetStackHighWaterMark(tasks[i].handle));
+	}
+	out_group_end(&o);
+
+	//WiFi
+	wifi_sta_list_t sta_list={0};
+	esp_wifi_ap_get_sta_list(&sta_list);
+	out_val(&o, "wifi_stations", "gauge", "Stations currently connected to the AP", sta_list.num);
+	out_group_start(&o, "wifi_rssi_dbm", "gauge", "Signal strength of each connected station");
+	for (int i=0; i<sta_list.num; i++) {
+		char mac[18];
+		const uint8_t *m=sta_list.sta[i].mac;
+		sprintf(mac, "%02x:%02x:%02x:%02x:%02x:%02x", m[0], m[1], m[2], m[3], m[4], m[5]);
+		out_group_val(&o, "mac", mac, sta_list.sta[i].rssi);
+	}
+	out_group_end(&o);
+
+	if (o.json) out_str(&o, "}");
+	httpd_resp_sendstr_chunk(req, NULL);
+	return ESP_OK;
+}
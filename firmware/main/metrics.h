@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_http_server.h"
+
+//Counters that are updated from the hot paths. These are all cumulative since boot;
+//times are in microseconds.
+typedef enum {
+	METRIC_UPLOAD_COUNT=0,
+	METRIC_UPLOAD_BYTES,
+	METRIC_UPLOAD_US,
+	METRIC_UPLOAD_LAST_BYTES,		//set, not added
+	METRIC_UPLOAD_LAST_US,			//set, not added
+	METRIC_FLASH_ERASE_COUNT,
+	METRIC_FLASH_ERASE_BYTES,
+	METRIC_FLASH_ERASE_US,
+	METRIC_FLASH_WRITE_COUNT,
+	METRIC_FLASH_WRITE_BYTES,
+	METRIC_FLASH_WRITE_US,
+	METRIC_EPD_SEND_COUNT,
+	METRIC_EPD_SPI_US,
+	METRIC_EPD_REFRESH_US,
+	METRIC_WIFI_STA_CONNECTS,
+	METRIC_WIFI_STA_DISCONNECTS,
+	METRIC_FAST_WAKE_COUNT,			//set from RTC memory at boot
+	METRIC_FAST_WAKE_LAST_US,		//set
+	METRIC_FAST_WAKE_LAST_NAH,		//set
+	METRIC_FAST_WAKE_TOTAL_NAH,		//set
+	METRIC_COUNT
+} metric_t;
+
+void metrics_add(metric_t m, uint32_t val);
+void metrics_set(metric_t m, uint32_t val);
+uint64_t metrics_get(metric_t m);
+
+//Register a task so its stack high-water mark shows up in the metrics.
+void metrics_register_task(const char *name, TaskHandle_t task);
+
+//Handler for the /metrics endpoint. Outputs Prometheus text format, or JSON when
+//called as /metrics?format=json.
+esp_err_t metrics_handler(httpd_req_t *req);
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+//Delta firmware update format, as made by www/otadiff and applied by the sync code.
+//A patch is a patch_hdr_t followed by ops. Each op is one byte of type, then a
+//little-endian uint32 length and a little-endian uint32 argument:
+// - PATCH_OP_COPY: copy len bytes from offset arg of the running image
+// - PATCH_OP_ADD: the next len bytes of the patch go into the new image; arg is 0
+// - PATCH_OP_END: done; no length or argument follows
+//The server names patches <running app SHA>-<new app SHA>.patch, with the first
+//PATCH_NAME_SHA_BYTES of each SHA in uppercase hex.
+
+#define PATCH_MAGIC 0x50445045 //'EPDP'
+#define PATCH_VERSION 1
+#define PATCH_NAME_SHA_BYTES 8
+
+#define PATCH_OP_END 0
+#define PATCH_OP_COPY 1
+#define PATCH_OP_ADD 2
+#define PATCH_OP_HDR_LEN 9
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint8_t src_sha[32];	//app_elf_sha256 of the image the patch applies to
+	uint8_t dst_sha[32];	//...and of the image it makes
+	uint32_t dst_len;		//size of the new image
+	uint32_t reserved;
+} patch_hdr_t;
@@ -0,0 +1,235 @@
+/*
+Overlay compositor. Every overlay is rendered once into a small 4bpp sprite; epd_send()
+then asks us to draw the sprites over the lines they cover while it pushes the image out.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "overlay.h"
+
+static const char *TAG="overlay";
+
+#define EPD_W 600
+#define EPD_H 448
+
+//Same as conv: the panel is mounted upside down.
+#define EPD_UPSIDE_DOWN 1
+
+//Battery voltage we call empty and full, for the gauge
+#define BAT_EMPTY_MV 3400
+#define BAT_FULL_MV 4100
+
+extern const uint8_t icons_bmp_start[] asm("_binary_icons_bmp_start");
+
+//5x7 font, one byte per column, LSB at the top. Only what dates, times and voltages need.
+static const char font_chars[]=" 0123456789:-./%V";
+static const uint8_t font[][5]={
+	{0x00, 0x00, 0x00, 0x00, 0x00},	//space
+	{0x3E, 0x51, 0x49, 0x45, 0x3E},	//0
+	{0x00, 0x42, 0x7F, 0x40, 0x00},	//1
+	{0x42, 0x61, 0x51, 0x49, 0x46},	//2
+	{0x21, 0x41, 0x45, 0x4B, 0x31},	//3
+	{0x18, 0x14, 0x12, 0x7F, 0x10},	//4
+	{0x27, 0x45, 0x45, 0x45, 0x39},	//5
+	{0x3C, 0x4A, 0x49, 0x49, 0x30},	//6
+	{0x01, 0x71, 0x09, 0x05, 0x03},	//7
+	{0x36, 0x49, 0x49, 0x49, 0x36},	//8
+	{0x06, 0x49, 0x49, 0x29, 0x1E},	//9
+	{0x00, 0x36, 0x36, 0x00, 0x00},	//:
+	{0x08, 0x08, 0x08, 0x08, 0x08},	//-
+	{0x00, 0x60, 0x60, 0x00, 0x00},	//.
+	{0x20, 0x10, 0x08, 0x04, 0x02},	///
+	{0x23, 0x13, 0x08, 0x64, 0x62},	//%
+	{0x1F, 0x20, 0x40, 0x20, 0x1F},	//V
+};
+#define FONT_ADVANCE 6
+#define FONT_HEIGHT 8
+
+static inline void sprite_set(overlay_sprite_t *s, int x, int y, int c) {
+	uint8_t *p=&s->pix[y*((s->w+1)/2)+x/2];
+	if (x&1) {
+		*p=(*p&0xF0)|c;
+	} else {
+		*p=(*p&0x0F)|(c<<4);
+	}
+}
+
+static inline int sprite_get(const overlay_sprite_t *s, int x, int y) {
+	uint8_t b=s->pix[y*((s->w+1)/2)+x/2];
+	return (x&1)?(b&0xF):(b>>4);
+}
+
+//Adds an empty sprite, filled with color c.
+static overlay_sprite_t *sprite_new(overlay_t *o, int x, int y, int w, int h, int c) {
+	if (o->count==OVERLAY_MAX) {
+		ESP_LOGW(TAG, "Too many overlays");
+		return NULL;
+	}
+	overlay_sprite_t *s=&o->sprite[o->count];
+	int len=((w+1)/2)*h;
+	s->pix=malloc(len);
+	if (!s->pix) return NULL;
+	memset(s->pix, c|(c<<4), len);
+	s->x=x;
+	s->y=y;
+	s->w=w;
+	s->h=h;
+	o->count++;
+	//Which lines of panel data this touches
+#if EPD_UPSIDE_DOWN
+	int y0=EPD_H-(y+h), y1=EPD_H-y;
+#else
+	int y0=y, y1=y+h;
+#endif
+	if (y0<0) y0=0;
+	if (y1>EPD_H) y1=EPD_H;
+	if (y0<y1) {
+		if (o->y_min>=o->y_max) {
+			o->y_min=y0;
+			o->y_max=y1;
+		} else {
+			if (y0<o->y_min) o->y_min=y0;
+			if (y1>o->y_max) o->y_max=y1;
+		}
+	}
+	return s;
+}
+
+void overlay_init(overlay_t *o) {
+	memset(o, 0, sizeof(overlay_t));
+}
+
+void overlay_free(overlay_t *o) {
+	for (int i=0; i<o->count; i++) free(o->sprite[i].pix);
+	overlay_init(o);
+}
+
+esp_err_t overlay_add_icon(overlay_t *o, int icon, int x, int y, bool transparent) {
+	if (icon<ICON_BAT_EMPTY || icon>ICON_SERVER) return ESP_ERR_INVALID_ARG;
+	overlay_sprite_t *s=sprite_new(o, x, y, 32, 32, OVERLAY_TRANSPARENT);
+	if (!s) return ESP_ERR_NO_MEM;
+	//4bpp BMP, 32 pixels (16 bytes) wide, rows stored bottom to top; the pixel values are
+	//already EPD colors. The icons are drawn mirrored, as they used to be copied straight
+	//into the (upside down) panel data.
+	const uint8_t *bmp=&icons_bmp_start[icons_bmp_start[0xa]|(icons_bmp_start[0xb]<<8)];
+	const uint8_t *src=&bmp[(icon-1)*32*16];
+	for (int row=0; row<32; row++) {
+		const uint8_t *line=&src[(31-row)*16];
+		for (int col=0; col<32; col++) {
+			int bx=31-col;
+			int c=(bx&1)?(line[bx/2]&0xF):(line[bx/2]>>4);
+			if (!(transparent && c==EPD_WHITE)) sprite_set(s, col, row, c);
+		}
+	}
+	return ESP_OK;
+}
+
+esp_err_t overlay_add_text(overlay_t *o, const char *text, int x, int y, int scale, int fg, int bg) {
+	int len=strlen(text);
+	if (len==0 || scale<1) return ESP_ERR_INVALID_ARG;
+	overlay_sprite_t *s=sprite_new(o, x, y, len*FONT_ADVANCE*scale, FONT_HEIGHT*scale, bg);
+	if (!s) return ESP_ERR_NO_MEM;
+	for (int i=0; i<len; i++) {
+		const char *f=strchr(font_chars, text[i]);
+		if (!f || text[i]==0) continue; //unknown characters come out as a space
+		const uint8_t *g=font[f-font_chars];
+		for (int col=0; col<5; col++) {
+			for (int row=0; row<7; row++) {
+				if (!(g[col]&(1<<row))) continue;
+				for (int sy=0; sy<scale; sy++) {
+					for (int sx=0; sx<scale; sx++) {
+						sprite_set(s, (i*FONT_ADVANCE+col)*scale+sx, row*scale+sy, fg);
+					}
+				}
+			}
+		}
+	}
+	return ESP_OK;
+}
+
+esp_err_t overlay_add_battery(overlay_t *o, int bat_mv, int x, int y) {
+	overlay_sprite_t *s=sprite_new(o, x, y, 32, 16, OVERLAY_TRANSPARENT);
+	if (!s) return ESP_ERR_NO_MEM;
+	int level=((bat_mv-BAT_EMPTY_MV)*26)/(BAT_FULL_MV-BAT_EMPTY_MV);
+	if (level<0) level=0;
+	if (level>26) level=26;
+	int fill=(level>13)?EPD_GREEN:(level>6)?EPD_YELLOW:EPD_RED;
+	//Body is 29x16 with a 1-pixel black outline, then a 3x6 tip on the right.
+	for (int row=0; row<16; row++) {
+		for (int col=0; col<29; col++) {
+			int c=EPD_WHITE;
+			if (row==0 || row==15 || col==0 || col==28) {
+				c=EPD_BLACK;
+			} else if (row>=2 && row<=13 && col>=2 && col<2+level) {
+				c=fill;
+			}
+			sprite_set(s, col, row, c);
+		}
+	}
+	for (int row=5; row<11; row++) {
+		for (int col=29; col<32; col++) sprite_set(s, col, row, EPD_BLACK);
+	}
+	return ESP_OK;
+}
+
+void overlay_add_status(overlay_t *o, int bat_mv) {
+	const int margin=4;
+	int x=EPD_W-margin-32;
+	if (bat_mv<BAT_EMPTY_MV) {
+		overlay_add_icon(o, ICON_BAT_EMPTY, x, EPD_H-margin-32, false);
+	} else {
+		overlay_add_battery(o, bat_mv, x, EPD_H-margin-16);
+	}
+	//Before the first sync the clock starts at 1970; no point in showing that.
+	time_t now=time(NULL);
+	struct tm tm;
+	localtime_r(&now, &tm);
+	if (tm.tm_year+1900>=2024) {
+		char buf[24];
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm);
+		int w=strlen(buf)*FONT_ADVANCE*2;
+		overlay_add_text(o, buf, x-margin-w, EPD_H-margin-FONT_HEIGHT*2, 2, EPD_BLACK, EPD_WHITE);
+	}
+}
+
+void overlay_line(const overlay_t *o, int y, uint8_t *line) {
+	if (!overlay_touches(o, y)) return;
+#if EPD_UPSIDE_DOWN
+	int vy=EPD_H-1-y;
+#else
+	int vy=y;
+#endif
+	for (int i=0; i<o->count; i++) {
+		const overlay_sprite_t *s=&o->sprite[i];
+		int row=vy-s->y;
+		if (row<0 || row>=s->h) continue;
+		int c0=(s->x<0)?-s->x:0;
+		int c1=(s->x+s->w>EPD_W)?EPD_W-s->x:s->w;
+		for (int col=c0; col<c1; col++) {
+			int c=sprite_get(s, col, row);
+			if (c==OVERLAY_TRANSPARENT) continue;
+#if EPD_UPSIDE_DOWN
+			int px=EPD_W-1-(s->x+col);
+#else
+			int px=s->x+col;
+#endif
+			//Even pixels are in the high nibble
+			uint8_t *p=&line[px/2];
+			if (px&1) {
+				*p=(*p&0xF0)|c;
+			} else {
+				*p=(*p&0x0F)|(c<<4);
+			}
+		}
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+//Overlays: small images (icons, text, a battery gauge) that epd_send() draws over the image
+//as it goes out to the panel. They're kept as 4bpp sprites in EPD colors and composited
+//straight into the packed lines; lines no overlay touches are sent without being copied.
+//Coordinates are as the viewer sees the frame: (0,0) is the top left, whichever way up
+//the panel data is stored.
+
+//note: icons are bottom to top in icons.bmp
+#define ICON_NONE 0
+#define ICON_BAT_EMPTY 1
+#define ICON_WIFI 2
+#define ICON_SERVER 3
+
+//EPD colors, as used in the packed image data
+#define EPD_BLACK 0
+#define EPD_WHITE 1
+#define EPD_GREEN 2
+#define EPD_BLUE 3
+#define EPD_RED 4
+#define EPD_YELLOW 5
+#define EPD_ORANGE 6
+//Not a panel color: pixels of this color leave the image underneath alone.
+#define OVERLAY_TRANSPARENT 0xF
+
+#define OVERLAY_MAX 8
+
+typedef struct {
+	int16_t x, y, w, h;
+	uint8_t *pix;			//w*h 4bpp pixels, rows of (w+1)/2 bytes, high nibble first
+} overlay_sprite_t;
+
+typedef struct {
+	int count;
+	int16_t y_min, y_max;	//rows of panel data touched by any sprite; y_max exclusive
+	overlay_sprite_t sprite[OVERLAY_MAX];
+} overlay_t;
+
+void overlay_init(overlay_t *o);
+void overlay_free(overlay_t *o);
+
+//Adds one of the ICON_* icons from icons.bmp. With transparent set, its white pixels are
+//left out.
+esp_err_t overlay_add_icon(overlay_t *o, int icon, int x, int y, bool transparent);
+//Adds a line of text from the built-in 5x7 font (digits and a bit of punctuation), each
+//pixel scale x scale big. bg can be OVERLAY_TRANSPARENT.
+esp_err_t overlay_add_text(overlay_t *o, const char *text, int x, int y, int scale, int fg, int bg);
+//Adds a 32x16 battery gauge, filled according to the voltage.
+esp_err_t overlay_add_battery(overlay_t *o, int bat_mv, int x, int y);
+//Adds the status corner at the bottom right: the date and time (if the clock is set), and
+//the battery gauge, or the empty battery icon if it's about time to charge.
+void overlay_add_status(overlay_t *o, int bat_mv);
+
+//True if any overlay touches line y of the panel data.
+static inline bool overlay_touches(const overlay_t *o, int y) {
+	return o && y>=o->y_min && y<o->y_max;
+}
+//Draws the overlays over line y of the panel data.
+void overlay_line(const overlay_t *o, int y, uint8_t *line);
@@ -0,0 +1,193 @@
+/*
+Power management: automatic light sleep, and the deep sleep slideshow. On a battery frame
+most wakes only need to show the next image, so those skip NVS, WiFi and the web server
+entirely and go straight back to deep sleep.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
+#include "esp_pm.h"
+#include "esp_partition.h"
+#include "nvs_flash.h"
+#include "spi_flash_mmap.h"
+#include "driver/gpio.h"
+#include "sdkconfig.h"
+#include "epd.h"
+#include "epd_flash_image.h"
+#include "metrics.h"
+#include "io.h"
+#include "sched.h"
+#include "power.h"
+#include "telemetry.h"
+
+static const char *TAG="power";
+
+#define SLIDESHOW_INTERVAL_US ((uint64_t)CONFIG_PHOTOFRAME_SLIDESHOW_INTERVAL_MIN*60*1000000ULL)
+
+//Rough current draw, used to estimate the charge a wake costs. ACTIVE is the C3 running
+//with the radio off; REFRESH is the panel refreshing while the C3 light-sleeps on BUSY.
+#define ACTIVE_UA 24000
+#define REFRESH_UA 9000
+
+static RTC_DATA_ATTR power_stats_t stats;
+static RTC_DATA_ATTR int last_sync_day=-1;
+
+void power_pm_init() {
+#if CONFIG_PM_ENABLE
+	//Light-sleep whenever all tasks are blocked, e.g. while the EPD refreshes. WiFi holds
+	//its own PM lock, so this only kicks in while the radio is off.
+	const esp_pm_config_t pm_config={
+		.max_freq_mhz=CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+		.min_freq_mhz=CONFIG_XTAL_FREQ,
+		.light_sleep_enable=true
+	};
+	ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+	ESP_LOGI(TAG, "Automatic light sleep enabled");
+#endif
+}
+
+//The time is only right if something set it; otherwise this counts from first power-on.
+//That still gives a sync once every 24 hours.
+static void get_day_hour(int *day, int *hour) {
+	time_t now=time(NULL);
+	struct tm tm;
+	localtime_r(&now, &tm);
+	*day=now/(24*3600);
+	*hour=tm.tm_hour;
+}
+
+static bool sync_due() {
+#if CONFIG_PHOTOFRAME_SYNC_HOUR>=0
+	int day, hour;
+	get_day_hour(&day, &hour);
+	return (hour>=CONFIG_PHOTOFRAME_SYNC_HOUR && day!=last_sync_day);
+#else
+	return false;
+#endif
+}
+
+bool power_is_fast_wake() {
+	if (SLIDESHOW_INTERVAL_US==0) return false;
+	if (esp_sleep_get_wakeup_cause()!=ESP_SLEEP_WAKEUP_TIMER) return false;
+	if (!sched_init()) {
+		ESP_LOGI(TAG, "Scheduler state lost; doing a full boot");
+		return false;
+	}
+	if (io_get_btn()) {
+		ESP_LOGI(TAG, "Button held; doing a full boot");
+		return false;
+	}
+	if (sync_due()) {
+		ESP_LOGI(TAG, "Sync hour; doing a full boot");
+		return false;
+	}
+	return true;
+}
+
+void power_fast_wake() {
+	const esp_partition_t *part=esp_partition_find_first(123, 0, NULL);
+	int slot=(part!=NULL)?sched_next(part):-1;
+	int64_t refresh_us=0;
+	if (slot<0) {
+		ESP_LOGW(TAG, "No valid image to show");
+	} else {
+		const flash_image_t *image=NULL;
+		spi_flash_mmap_handle_t mmap_handle;
+		esp_err_t err=esp_partition_mmap(part, slot*IMG_SIZE_BYTES, IMG_SIZE_BYTES, SPI_FLASH_MMAP_DATA, (const void**)&image, &mmap_handle);
+		if (err==ESP_OK) {
+			ESP_LOGI(TAG, "Fast wake: showing slot %d", slot);
+#if CONFIG_PHOTOFRAME_OVERLAY_STATUS
+			overlay_t overlay;
+			overlay_init(&overlay);
+			overlay_add_status(&overlay, io_get_battery_mv());
+			epd_send(image->data, &overlay);
+			overlay_free(&overlay);
+#else
+			epd_send(image->data, NULL);
+#endif
+			epd_shutdown();
+			spi_flash_munmap(mmap_handle);
+			epd_timings_t t;
+			epd_get_timings(&t);
+			refresh_us=t.power_on_us+t.refresh_us+t.power_off_us;
+			sched_shown(slot);
+		} else {
+			ESP_LOGE(TAG, "Failed to map slot %d: %s", slot, esp_err_to_name(err));
+		}
+	}
+	if (sched_checkpoint_due()) {
+		//This is the only fast wake that needs NVS.
+		if (nvs_flash_init()==ESP_OK) sched_checkpoint();
+	}
+	//The button may have been pressed while the panel refreshed.
+	if (io_get_btn()) {
+		ESP_LOGI(TAG, "Button pressed; continuing with a full boot");
+		return;
+	}
+
+	int64_t wake_us=esp_timer_get_time();
+	int64_t active_us=wake_us-refresh_us;
+	//1 nAh is 3.6e6 uA*us
+	uint32_t nah=(active_us*ACTIVE_UA+refresh_us*REFRESH_UA)/3600000LL;
+	stats.wakes++;
+	stats.last_wake_us=wake_us;
+	stats.last_wake_nah=nah;
+	stats.total_nah+=nah;
+	stats.last_bat_mv=io_get_battery_mv();
+	ESP_LOGI(TAG, "Fast wake took %lld ms, used about %lu nAh; battery %ld mV",
+				wake_us/1000, (unsigned long)nah, (long)stats.last_bat_mv);
+	power_sleep();
+}
+
+void power_full_boot() {
+	int day, hour;
+	get_day_hour(&day, &hour);
+	last_sync_day=day;
+	metrics_set(METRIC_FAST_WAKE_COUNT, stats.wakes);
+	metrics_set(METRIC_FAST_WAKE_LAST_US, stats.last_wake_us);
+	metrics_set(METRIC_FAST_WAKE_LAST_NAH, stats.last_wake_nah);
+	metrics_set(METRIC_FAST_WAKE_TOTAL_NAH, stats.total_nah);
+}
+
+void power_sleep() {
+	uint64_t sleep_us=SLIDESHOW_INTERVAL_US;
+	time_t next_wake=sched_next_wake();
+	if (sleep_us!=0 && next_wake!=0) {
+		//Sleep until the next image is due, but never longer than the interval, in case
+		//the clock got set in the meantime.
+		int64_t secs=next_wake-time(NULL);
+		if (secs<1) secs=1;
+		if ((uint64_t)secs*1000000ULL<sleep_us) sleep_us=(uint64_t)secs*1000000ULL;
+	}
+#if CONFIG_PHOTOFRAME_SYNC_HOUR>=0
+	//Wake up for the sync if that comes before the next image.
+	time_t now=time(NULL);
+	struct tm tm;
+	localtime_r(&now, &tm);
+	int secs=((CONFIG_PHOTOFRAME_SYNC_HOUR-tm.tm_hour)*60-tm.tm_min)*60-tm.tm_sec;
+	if (secs<=0) secs+=24*3600;
+	if (sleep_us==0 || (uint64_t)secs*1000000ULL<sleep_us) sleep_us=(uint64_t)secs*1000000ULL;
+#endif
+	if (sleep_us==0) {
+		ESP_LOGW(TAG, "Nothing to wake up for; sleeping until reset");
+	} else {
+		ESP_LOGI(TAG, "Deep sleep for %llu s", sleep_us/1000000ULL);
+		esp_sleep_enable_timer_wakeup(sleep_us);
+	}
+	telemetry_end(io_get_battery_mv());
+	//Keep the EPD CS and RST lines held through deep sleep.
+	gpio_deep_sleep_hold_en();
+	esp_deep_sleep_start();
+}
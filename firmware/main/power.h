@@ -0,0 +1,30 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+//Stats about the fast wake path. These live in RTC memory, so they survive deep sleep
+//but start over at power-on.
+typedef struct {
+	uint32_t wakes;				//fast wakes since power-on
+	uint32_t last_wake_us;		//app start to deep sleep, last fast wake
+	uint32_t last_wake_nah;		//estimated charge used by the last fast wake, in nAh
+	uint64_t total_nah;			//estimated charge used by all fast wakes
+	int32_t last_bat_mv;		//battery voltage under load during the last fast wake
+} power_stats_t;
+
+//Sets up automatic light sleep, if enabled in menuconfig.
+void power_pm_init();
+
+//True if this boot is a slideshow timer wake that only needs to show the next image.
+bool power_is_fast_wake();
+
+//Shows the next image and goes back to deep sleep without starting WiFi. Only returns
+//if the button was pressed, in which case the caller should continue with a full boot.
+void power_fast_wake();
+
+//Call at the start of a full boot (power-on, button, sync hour).
+void power_full_boot();
+
+//Deep-sleeps until the next slideshow image or sync is due. Never returns. WiFi must be
+//stopped and the display idle before calling this.
+void power_sleep();
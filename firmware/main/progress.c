@@ -0,0 +1,139 @@
+/*
+WebSocket endpoint that pushes upload and display progress to the web UI, so it can show
+what the frame is actually doing (including when the panel refresh is done) without
+polling /status.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_http_server.h"
+#include "display.h"
+#include "progress.h"
+
+static const char *TAG="progress";
+
+//Each client holds on to one of the server's sockets, so don't let them take all of them.
+#define MAX_CLIENTS 3
+#define MAX_EVENT_LEN 160
+
+//Only touched from the httpd task: the /ws handler and sends.
+static int clients[MAX_CLIENTS]={-1, -1, -1};
+static TaskHandle_t httpd_task;
+//Read from other tasks to skip the work when nobody listens; a stale value is harmless.
+static volatile int client_count=0;
+static httpd_handle_t server;
+
+typedef struct {
+	int len;
+	char msg[];
+} progress_msg_t;
+
+static void add_client(int fd) {
+	int free_idx=-1;
+	for (int i=0; i<MAX_CLIENTS; i++) {
+		if (clients[i]==fd) return;
+		if (clients[i]<0 && free_idx<0) free_idx=i;
+	}
+	if (free_idx<0) {
+		//Replace the oldest; it's most likely a tab that's long gone. Close it too, or
+		//it would keep its socket and httpd session all the same.
+		httpd_sess_trigger_close(server, clients[0]);
+		memmove(&clients[0], &clients[1], (MAX_CLIENTS-1)*sizeof(int));
+		free_idx=MAX_CLIENTS-1;
+		client_count--;
+	}
+	clients[free_idx]=fd;
+	client_count++;
+}
+
+static void send_work(void *arg) {
+	progress_msg_t *m=(progress_msg_t*)arg;
+	httpd_ws_frame_t frame={
+		.final=true,
+		.type=HTTPD_WS_TYPE_TEXT,
+		.payload=(uint8_t*)m->msg,
+		.len=m->len
+	};
+	for (int i=0; i<MAX_CLIENTS; i++) {
+		if (clients[i]<0) continue;
+		if (httpd_ws_get_fd_info(server, clients[i])!=HTTPD_WS_CLIENT_WEBSOCKET ||
+				httpd_ws_send_frame_async(server, clients[i], &frame)!=ESP_OK) {
+			clients[i]=-1;
+			client_count--;
+		}
+	}
+	free(m);
+}
+
+void progress_send(const char *fmt, ...) {
+	if (server==NULL || client_count==0) return;
+	progress_msg_t *m=malloc(sizeof(progress_msg_t)+MAX_EVENT_LEN);
+	if (!m) return;
+	va_list ap;
+	va_start(ap, fmt);
+	m->len=vsnprintf(m->msg, MAX_EVENT_LEN, fmt, ap);
+	va_end(ap);
+	if (m->len>=MAX_EVENT_LEN) m->len=MAX_EVENT_LEN-1;
+	//Events from inside an upload handler go out right away. Anything else has to go
+	//through the httpd task, as that one owns the sockets.
+	if (xTaskGetCurrentTaskHandle()==httpd_task) {
+		send_work(m);
+	} else if (httpd_queue_work(server, send_work, m)!=ESP_OK) {
+		free(m);
+	}
+}
+
+void progress_send_display(const char *phase) {
+	progress_send("{\"type\":\"display\",\"state\":\"%s\",\"phase\":\"%s\",\"slot\":%d}",
+			display_state_name(display_get_state()), phase, display_get_slot());
+}
+
+static esp_err_t ws_handler(httpd_req_t *req) {
+	if (req->method==HTTP_GET) {
+		//Handshake done. Tell the new client where the display is at.
+		httpd_task=xTaskGetCurrentTaskHandle();
+		add_client(httpd_req_to_sockfd(req));
+		ESP_LOGI(TAG, "Client connected, %d total", client_count);
+		char msg[MAX_EVENT_LEN];
+		int len=snprintf(msg, sizeof(msg), "{\"type\":\"display\",\"state\":\"%s\",\"phase\":\"\",\"slot\":%d}",
+				display_state_name(display_get_state()), display_get_slot());
+		httpd_ws_frame_t frame={
+			.final=true,
+			.type=HTTPD_WS_TYPE_TEXT,
+			.payload=(uint8_t*)msg,
+			.len=len
+		};
+		return httpd_ws_send_frame(req, &frame);
+	}
+	//Clients have nothing to say; read and drop whatever they send.
+	httpd_ws_frame_t frame={0};
+	esp_err_t err=httpd_ws_recv_frame(req, &frame, 0);
+	if (err!=ESP_OK || frame.len==0) return err;
+	uint8_t buf[64];
+	if (frame.len>sizeof(buf)) return ESP_FAIL; //closes the connection
+	frame.payload=buf;
+	return httpd_ws_recv_frame(req, &frame, frame.len);
+}
+
+void progress_register_handlers(httpd_handle_t s) {
+	server=s;
+	const httpd_uri_t uri={
+		.uri="/ws",
+		.method=HTTP_GET,
+		.handler=ws_handler,
+		.is_websocket=true
+	};
+	httpd_register_uri_handler(server, &uri);
+}
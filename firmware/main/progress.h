@@ -0,0 +1,17 @@
+#pragma once
+#include "esp_http_server.h"
+
+//Progress events, pushed to the web UI over a WebSocket at /ws. Every event is one text
+//frame with a JSON object; "type" says what it's about:
+// {"type":"upload","stage":"receive"|"flash"|"done","offset":<n>,"size":<n>,"slot":<n>}
+// {"type":"display","state":"idle"|"pushing"|"refreshing","phase":"<epd phase>","slot":<n>}
+//A client gets a display event with the current state as soon as it connects.
+
+void progress_register_handlers(httpd_handle_t server);
+
+//Sends an event to all connected clients. Takes printf-style arguments that make up the
+//JSON object. Can be called from any task; it returns without waiting for the send.
+void progress_send(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+//Sends the state of the display task.
+void progress_send_display(const char *phase);
@@ -0,0 +1,265 @@
+/*
+Slideshow scheduler. Decides which slot to show on each wake, keeping its state in RTC
+slow memory so deep sleep wakes don't need NVS.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_rom_crc.h"
+#include "esp_partition.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+#include "epd_flash_image.h"
+#include "sched.h"
+
+static const char *TAG="sched";
+
+#define SCHED_MAGIC 0x5c4ed001
+#define INTERVAL_S (CONFIG_PHOTOFRAME_SLIDESHOW_INTERVAL_MIN*60)
+
+_Static_assert(IMG_SLOT_COUNT<=16, "valid bitmask is 16 bits");
+
+typedef struct {
+	uint32_t magic;
+	int64_t next_wake;					//time() the next image is due; 0 is now
+	uint16_t valid;						//bitmask of slots that hold an image
+	int16_t cursor;						//slot shown last
+	uint16_t shows[IMG_SLOT_COUNT];
+	uint8_t weight[IMG_SLOT_COUNT];
+	int16_t credit[IMG_SLOT_COUNT];		//for smooth weighted round-robin
+	uint32_t crc;
+} sched_state_t;
+
+//RTC_NOINIT so it also survives a panic or watchdog reset; the magic and CRC tell us
+//whether it's still good.
+static RTC_NOINIT_ATTR sched_state_t st;
+static RTC_DATA_ATTR int wakes_since_checkpoint;
+static RTC_DATA_ATTR uint32_t checkpoint_crc;
+//The display task and the web server both change the state; this guards all of the above.
+static SemaphoreHandle_t st_mutex;
+static StaticSemaphore_t st_mutex_buf;
+
+static void lock() {
+	//The first call is at boot, from the main task, before there's anyone to race with.
+	if (!st_mutex) st_mutex=xSemaphoreCreateMutexStatic(&st_mutex_buf);
+	xSemaphoreTake(st_mutex, portMAX_DELAY);
+}
+
+static void unlock() {
+	xSemaphoreGive(st_mutex);
+}
+
+static uint32_t state_crc(const sched_state_t *s) {
+	return esp_rom_crc32_le(0, (const uint8_t*)s, offsetof(sched_state_t, crc));
+}
+
+static void state_changed() {
+	st.crc=state_crc(&st);
+}
+
+static void state_defaults() {
+	memset(&st, 0, sizeof(st));
+	st.magic=SCHED_MAGIC;
+	st.cursor=-1;
+	for (int i=0; i<IMG_SLOT_COUNT; i++) st.weight[i]=1;
+}
+
+static bool state_ok() {
+	return (st.magic==SCHED_MAGIC && st.crc==state_crc(&st));
+}
+
+bool sched_init() {
+	lock();
+	bool ok=state_ok();
+	unlock();
+	return ok;
+}
+
+void sched_restore(const esp_partition_t *part) {
+	lock();
+	if (!state_ok()) {
+		nvs_handle_t nvs;
+		size_t len=sizeof(st);
+		if (nvs_open("epd", NVS_READONLY, &nvs)==ESP_OK) {
+			if (nvs_get_blob(nvs, "sched", &st, &len)!=ESP_OK || len!=sizeof(st) || !state_ok()) {
+				state_defaults();
+			} else {
+				ESP_LOGI(TAG, "Restored scheduler state from NVS");
+			}
+			nvs_close(nvs);
+		} else {
+			state_defaults();
+		}
+		//The clock started over, so the saved wake time means nothing.
+		st.next_wake=0;
+		checkpoint_crc=0;
+	}
+	//Anything could have happened to the slots while we weren't looking.
+	st.valid=0;
+	for (int i=0; i<IMG_SLOT_COUNT; i++) {
+		flash_image_hdr_t hdr;
+		if (esp_partition_read(part, i*IMG_SIZE_BYTES, &hdr, sizeof(hdr))==ESP_OK && img_valid(&hdr)) {
+			st.valid|=(1<<i);
+		}
+	}
+	state_changed();
+	unlock();
+}
+
+static bool eligible(int slot) {
+	return (st.valid&(1<<slot)) && st.weight[slot]!=0;
+}
+
+static int pick() {
+	int best=-1;
+#if CONFIG_PHOTOFRAME_SCHED_LEAST_SHOWN
+	//Lowest show count wins; ties go to the first slot after the cursor.
+	for (int i=1; i<=IMG_SLOT_COUNT; i++) {
+		int slot=(st.cursor+i+IMG_SLOT_COUNT)%IMG_SLOT_COUNT;
+		if (!eligible(slot)) continue;
+		if (best<0 || st.shows[slot]<st.shows[best]) best=slot;
+	}
+#elif CONFIG_PHOTOFRAME_SCHED_WEIGHTED
+	//Smooth weighted round-robin: every slot earns its weight in credit each round, the
+	//richest slot is shown and pays back the total. Spreads out heavy slots evenly and
+	//needs no random numbers.
+	int total=0;
+	for (int slot=0; slot<IMG_SLOT_COUNT; slot++) {
+		if (!eligible(slot)) continue;
+		st.credit[slot]+=st.weight[slot];
+		total+=st.weight[slot];
+		if (best<0 || st.credit[slot]>st.credit[best]) best=slot;
+	}
+	if (best>=0) st.credit[best]-=total;
+#else
+	for (int i=1; i<=IMG_SLOT_COUNT; i++) {
+		int slot=(st.cursor+i+IMG_SLOT_COUNT)%IMG_SLOT_COUNT;
+		if (eligible(slot)) {
+			best=slot;
+			break;
+		}
+	}
+#endif
+	return best;
+}
+
+int sched_next(const esp_partition_t *part) {
+	int slot;
+	lock();
+	while ((slot=pick())>=0) {
+		flash_image_hdr_t hdr;
+		if (esp_partition_read(part, slot*IMG_SIZE_BYTES, &hdr, sizeof(hdr))==ESP_OK && img_valid(&hdr)) break;
+		ESP_LOGW(TAG, "Slot %d no longer holds a valid image", slot);
+		st.valid&=~(1<<slot);
+	}
+	state_changed();
+	unlock();
+	return slot;
+}
+
+void sched_shown(int slot) {
+	if (slot<0 || slot>=IMG_SLOT_COUNT) return;
+	lock();
+	st.cursor=slot;
+	if (st.shows[slot]==UINT16_MAX) {
+		//Halve everything; keeps the ratios and stops the counts from wrapping.
+		for (int i=0; i<IMG_SLOT_COUNT; i++) st.shows[i]/=2;
+	}
+	st.shows[slot]++;
+	//Keep the cadence, unless we're so far behind that it makes no sense.
+	time_t now=time(NULL);
+	if (st.next_wake==0 || now>=st.next_wake+INTERVAL_S) {
+		st.next_wake=now+INTERVAL_S;
+	} else {
+		st.next_wake+=INTERVAL_S;
+	}
+	wakes_since_checkpoint++;
+	state_changed();
+	unlock();
+}
+
+void sched_slot_updated(int slot, bool valid) {
+	if (slot<0 || slot>=IMG_SLOT_COUNT) return;
+	lock();
+	if (valid) {
+		st.valid|=(1<<slot);
+	} else {
+		st.valid&=~(1<<slot);
+	}
+	int min=-1;
+	for (int i=0; i<IMG_SLOT_COUNT; i++) {
+		if (i!=slot && (st.valid&(1<<i)) && (min<0 || st.shows[i]<min)) min=st.shows[i];
+	}
+	st.shows[slot]=(min<0)?0:min;
+	st.credit[slot]=0;
+	state_changed();
+	unlock();
+}
+
+void sched_set_weight(int slot, int weight) {
+	if (slot<0 || slot>=IMG_SLOT_COUNT) return;
+	if (weight<0) weight=0;
+	if (weight>255) weight=255;
+	lock();
+	st.weight[slot]=weight;
+	st.credit[slot]=0;
+	state_changed();
+	unlock();
+}
+
+void sched_get_slot(int slot, int *shows, int *weight) {
+	lock();
+	*shows=st.shows[slot];
+	*weight=st.weight[slot];
+	unlock();
+}
+
+time_t sched_next_wake() {
+	lock();
+	time_t t=st.next_wake;
+	unlock();
+	return t;
+}
+
+bool sched_checkpoint_due() {
+	lock();
+	bool due=wakes_since_checkpoint>=CONFIG_PHOTOFRAME_SCHED_CHECKPOINT_WAKES;
+	unlock();
+	return due;
+}
+
+void sched_checkpoint() {
+	//Write a copy, so nobody waits on NVS
+	lock();
+	wakes_since_checkpoint=0;
+	sched_state_t copy=st;
+	unlock();
+	if (copy.crc==checkpoint_crc) return;
+	nvs_handle_t nvs;
+	esp_err_t err=nvs_open("epd", NVS_READWRITE, &nvs);
+	if (err==ESP_OK) {
+		//A blob write is atomic in NVS; if we brown out halfway, the old one stays.
+		err=nvs_set_blob(nvs, "sched", &copy, sizeof(copy));
+		if (err==ESP_OK) err=nvs_commit(nvs);
+		nvs_close(nvs);
+	}
+	if (err!=ESP_OK) {
+		ESP_LOGE(TAG, "Checkpoint failed: %s", esp_err_to_name(err));
+		return;
+	}
+	checkpoint_crc=copy.crc;
+	ESP_LOGI(TAG, "Scheduler state checkpointed to NVS");
+}
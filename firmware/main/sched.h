@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "esp_partition.h"
+
+//Slideshow scheduler. Its state lives in RTC memory, so a wake from deep sleep can pick
+//the next image without touching NVS. It only goes to NVS at a sync (full boot) and
+//every CONFIG_PHOTOFRAME_SCHED_CHECKPOINT_WAKES wakes, so a power loss costs at most
+//that many wakes' worth of show counts.
+
+//Checks the RTC state. Returns false if it didn't survive (power loss, first boot); in
+//that case sched_restore() needs to be called once NVS is up.
+bool sched_init();
+
+//Loads the last checkpoint from NVS if the RTC state is gone, and rescans the slot
+//headers. Needs NVS; call at a full boot.
+void sched_restore(const esp_partition_t *part);
+
+//Picks the slot to show next. The slot header is checked before it's returned. Returns
+//-1 if there are no valid images.
+int sched_next(const esp_partition_t *part);
+
+//Records that a slot was shown, and sets the time the next image is due.
+void sched_shown(int slot);
+
+//Call after a slot has been rewritten. A new image starts out with the lowest show count,
+//so it's not skipped in least-shown mode.
+void sched_slot_updated(int slot, bool valid);
+
+//Weight for the weighted mode, 0-255. 0 means the slot is never picked. Default is 1.
+void sched_set_weight(int slot, int weight);
+void sched_get_slot(int slot, int *shows, int *weight);
+
+//time() at which the next image is due, or 0 if it's due now.
+time_t sched_next_wake();
+
+//Checkpoints are due every CONFIG_PHOTOFRAME_SCHED_CHECKPOINT_WAKES shows.
+bool sched_checkpoint_due();
+//Saves the state to NVS. NVS must be initialized. Skips the write if nothing changed.
+void sched_checkpoint();
@@ -0,0 +1,171 @@
+/*
+Lets you look at what's stored in the images partition: list the slots, download them
+and show one without uploading it again.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "esp_http_server.h"
+#include "epd_flash_image.h"
+#include "display.h"
+#include "sched.h"
+#include "slots.h"
+
+static const char *TAG="slots";
+
+//What's actually used in a slot: header plus pixel data.
+#define SLOT_IMAGE_BYTES (sizeof(flash_image_hdr_t)+sizeof(((flash_image_t*)0)->data))
+//The data goes out straight from the flash mapping; this only sets how much we hand
+//to the TCP stack at a time.
+#define SEND_CHUNK 4096
+
+static const esp_partition_t *get_part() {
+	return esp_partition_find_first(123, 0, NULL);
+}
+
+//Parses the slot number out of /slots/<n>[/...]. Returns -1 if there's no valid one.
+static int uri_slot(httpd_req_t *req, const char **rest) {
+	const char *p=req->uri+strlen("/slots/");
+	char *end;
+	long slot=strtol(p, &end, 10);
+	if (end==p || slot<0 || slot>=IMG_SLOT_COUNT) return -1;
+	if (rest) *rest=end;
+	return slot;
+}
+
+static esp_err_t read_hdr(int slot, flash_image_hdr_t *hdr) {
+	const esp_partition_t *part=get_part();
+	if (part==NULL) return ESP_ERR_NOT_FOUND;
+	return esp_partition_read(part, slot*IMG_SIZE_BYTES, hdr, sizeof(*hdr));
+}
+
+static esp_err_t slots_list_handler(httpd_req_t *req) {
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+	httpd_resp_send_chunk(req, "[", 1);
+	for (int i=0; i<IMG_SLOT_COUNT; i++) {
+		flash_image_hdr_t hdr;
+		int valid=(read_hdr(i, &hdr)==ESP_OK && img_valid(&hdr));
+		int shows, weight;
+		sched_get_slot(i, &shows, &weight);
+		char buf[160];
+		int len=snprintf(buf, sizeof(buf), "%s{\"slot\":%d,\"valid\":%s,\"timestamp\":%llu,\"size\":%d,"
+				"\"shows\":%d,\"weight\":%d,\"showing\":%s}",
+				i?",":"", i, valid?"true":"false", valid?(unsigned long long)hdr.timestamp:0ULL,
+				valid?(int)SLOT_IMAGE_BYTES:0, shows, weight,
+				(i==display_get_slot())?"true":"false");
+		httpd_resp_send_chunk(req, buf, len);
+	}
+	httpd_resp_send_chunk(req, "]", 1);
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+//Streams the slot from a flash mapping. Note this doesn't need the images lock: the only
+//writers are other HTTP handlers, and those run in this same task.
+static esp_err_t slot_get_handler(httpd_req_t *req) {
+	const char *rest;
+	int slot=uri_slot(req, &rest);
+	if (slot<0 || (*rest!=0 && *rest!='?')) {
+		httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such slot");
+		return ESP_FAIL;
+	}
+	flash_image_hdr_t hdr;
+	if (read_hdr(slot, &hdr)!=ESP_OK || !img_valid(&hdr)) {
+		httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Slot is empty");
+		return ESP_FAIL;
+	}
+
+	//The timestamp changes with every upload, so it makes a fine ETag. Images converted
+	//here before the clock was ever set have none, so those can't be cached.
+	char etag[32], inm[32];
+	if (hdr.timestamp!=0) {
+		snprintf(etag, sizeof(etag), "\"%d-%llx\"", slot, (unsigned long long)hdr.timestamp);
+		httpd_resp_set_hdr(req, "ETag", etag);
+		if (httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm))==ESP_OK && strcmp(inm, etag)==0) {
+			httpd_resp_set_status(req, "304 Not Modified");
+			return httpd_resp_send(req, NULL, 0);
+		}
+	}
+
+	const uint8_t *image=NULL;
+	spi_flash_mmap_handle_t mmap_handle;
+	esp_err_t err=esp_partition_mmap(get_part(), slot*IMG_SIZE_BYTES, IMG_SIZE_BYTES, SPI_FLASH_MMAP_DATA, (const void**)&image, &mmap_handle);
+	if (err!=ESP_OK) {
+		ESP_LOGE(TAG, "Failed to map slot %d: %s", slot, esp_err_to_name(err));
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to map slot");
+		return ESP_FAIL;
+	}
+	char disp[48];
+	snprintf(disp, sizeof(disp), "attachment; filename=\"slot%d.bin\"", slot);
+	httpd_resp_set_type(req, "application/octet-stream");
+	httpd_resp_set_hdr(req, "Content-Disposition", disp);
+	for (int pos=0; pos<SLOT_IMAGE_BYTES && err==ESP_OK; pos+=SEND_CHUNK) {
+		int len=SLOT_IMAGE_BYTES-pos;
+		if (len>SEND_CHUNK) len=SEND_CHUNK;
+		err=httpd_resp_send_chunk(req, (const char*)image+pos, len);
+	}
+	if (err==ESP_OK) err=httpd_resp_send_chunk(req, NULL, 0);
+	spi_flash_munmap(mmap_handle);
+	return err;
+}
+
+static esp_err_t slot_post_handler(httpd_req_t *req) {
+	const char *rest;
+	int slot=uri_slot(req, &rest);
+	flash_image_hdr_t hdr;
+	if (slot<0 || read_hdr(slot, &hdr)!=ESP_OK || !img_valid(&hdr)) {
+		httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No image in that slot");
+		return ESP_FAIL;
+	}
+	if (strncmp(rest, "/show", 5)==0 && (rest[5]==0 || rest[5]=='?')) {
+		display_show_slot(slot);
+	} else if (strncmp(rest, "/weight", 7)==0 && (rest[7]==0 || rest[7]=='?')) {
+		char query[32], val[8];
+		if (httpd_req_get_url_query_str(req, query, sizeof(query))!=ESP_OK ||
+				httpd_query_key_value(query, "w", val, sizeof(val))!=ESP_OK) {
+			httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing weight");
+			return ESP_FAIL;
+		}
+		sched_set_weight(slot, atoi(val));
+	} else {
+		httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Unknown slot action");
+		return ESP_FAIL;
+	}
+	httpd_resp_set_type(req, "application/json");
+	return httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
+}
+
+static const httpd_uri_t slots_list_uri={
+	.uri="/slots",
+	.method=HTTP_GET,
+	.handler=slots_list_handler
+};
+
+static const httpd_uri_t slot_get_uri={
+	.uri="/slots/*",
+	.method=HTTP_GET,
+	.handler=slot_get_handler
+};
+
+static const httpd_uri_t slot_post_uri={
+	.uri="/slots/*",
+	.method=HTTP_POST,
+	.handler=slot_post_handler
+};
+
+void slots_register_handlers(httpd_handle_t server) {
+	httpd_register_uri_handler(server, &slots_list_uri);
+	httpd_register_uri_handler(server, &slot_get_uri);
+	httpd_register_uri_handler(server, &slot_post_uri);
+}
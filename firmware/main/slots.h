@@ -0,0 +1,9 @@
+#pragma once
+#include "esp_http_server.h"
+
+//Registers the handlers for browsing the image slots:
+// GET /slots                   - JSON list of slot headers
+// GET /slots/<n>               - raw image in slot n, as stored in flash
+// POST /slots/<n>/show         - show slot n on the EPD
+// POST /slots/<n>/weight?w=<w> - set the slideshow weight of slot n
+void slots_register_handlers(httpd_handle_t server);
@@ -0,0 +1,104 @@
+/*
+Wake telemetry: how long every phase of a wake took, kept in RTC memory across deep sleep
+and sent to the server at the next check-in. Together with the battery voltage that tells
+us where the time (and so the charge) of a wake goes, across the whole fleet.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "telemetry.h"
+
+#define RING_LEN CONFIG_PHOTOFRAME_TELEMETRY_WAKES
+
+typedef struct {
+	uint32_t seq;				//counts wakes since power-on
+	uint8_t kind;
+	uint8_t images;
+	uint16_t bat_mv;
+	uint16_t ms[TEL_PHASES];	//saturates at 65535
+} tel_wake_t;
+
+//RTC_DATA_ATTR is zeroed at power-on, so we start out with an empty ring.
+static RTC_DATA_ATTR tel_wake_t ring[RING_LEN];
+static RTC_DATA_ATTR uint32_t next_seq;		//seq of the next wake to store
+static RTC_DATA_ATTR uint32_t acked_seq;	//wakes before this one are on the server
+
+//Phases get added to from the display and web server tasks too, hence the atomics.
+static _Atomic int64_t cur_us[TEL_PHASES];
+static tel_wake_t cur;
+static uint32_t formatted_seq;
+
+void telemetry_begin(tel_wake_kind_t kind) {
+	for (int i=0; i<TEL_PHASES; i++) atomic_store_explicit(&cur_us[i], 0, memory_order_relaxed);
+	memset(&cur, 0, sizeof(cur));
+	cur.kind=kind;
+	atomic_store_explicit(&cur_us[TEL_BOOT], esp_timer_get_time(), memory_order_relaxed);
+}
+
+void telemetry_set_kind(tel_wake_kind_t kind) {
+	cur.kind=kind;
+}
+
+void telemetry_add(tel_phase_t phase, int64_t us) {
+	atomic_fetch_add_explicit(&cur_us[phase], us, memory_order_relaxed);
+}
+
+void telemetry_max(tel_phase_t phase, int64_t us) {
+	int64_t old=atomic_load_explicit(&cur_us[phase], memory_order_relaxed);
+	while (us>old && !atomic_compare_exchange_weak_explicit(&cur_us[phase], &old, us,
+				memory_order_relaxed, memory_order_relaxed)) ;
+}
+
+void telemetry_add_images(int count) {
+	cur.images+=count;
+}
+
+void telemetry_end(int bat_mv) {
+	atomic_store_explicit(&cur_us[TEL_AWAKE], esp_timer_get_time(), memory_order_relaxed);
+	for (int i=0; i<TEL_PHASES; i++) {
+		int64_t ms=atomic_load_explicit(&cur_us[i], memory_order_relaxed)/1000;
+		cur.ms[i]=(ms>65535)?65535:ms;
+	}
+	cur.bat_mv=bat_mv;
+	cur.seq=next_seq++;
+	ring[cur.seq%RING_LEN]=cur;
+}
+
+//One wake is seq,kind,bat_mv,images,ms... with zeros left out (so ",," instead of ",0,").
+//Wakes are separated by '.'.
+int telemetry_format(char *buf, size_t len) {
+	uint32_t first=acked_seq;
+	if (next_seq-first>RING_LEN) first=next_seq-RING_LEN; //older ones got overwritten
+	size_t n=0;
+	int count=0;
+	buf[0]=0;
+	for (uint32_t seq=first; seq!=next_seq; seq++) {
+		const tel_wake_t *w=&ring[seq%RING_LEN];
+		char tmp[96];
+		int l=snprintf(tmp, sizeof(tmp), "%s%lu,%c,%u,%u", count?".":"", (unsigned long)w->seq, w->kind, w->bat_mv, w->images);
+		for (int i=0; i<TEL_PHASES; i++) {
+			l+=(w->ms[i])?snprintf(tmp+l, sizeof(tmp)-l, ",%u", w->ms[i]):snprintf(tmp+l, sizeof(tmp)-l, ",");
+		}
+		if (n+l+1>len) break;
+		memcpy(buf+n, tmp, l+1);
+		n+=l;
+		count++;
+	}
+	formatted_seq=first+count;
+	return count;
+}
+
+void telemetry_sent() {
+	acked_seq=formatted_seq;
+}
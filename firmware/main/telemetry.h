@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+//Per-wake phase timings. The current wake is built up in RAM; when the frame goes to deep
+//sleep it's added to a ring of the last CONFIG_PHOTOFRAME_TELEMETRY_WAKES wakes in RTC
+//memory, and the sync sends whatever the server hasn't seen yet along with the check-in.
+
+typedef enum {
+	TEL_BOOT=0,				//reset to app_main
+	TEL_WIFI,				//bringing the radio up
+	TEL_MANIFEST,			//fetching and handling epd-info.php
+	TEL_DOWNLOAD,			//downloading images, including writing them to flash
+	TEL_IMAGE_MAX,			//the slowest single image download of those
+	TEL_FLASH_ERASE,
+	TEL_FLASH_WRITE,
+	TEL_SPI,				//pushing an image to the panel
+	TEL_REFRESH,			//panel power on, refresh and power off
+	TEL_AWAKE,				//reset to deep sleep
+	TEL_PHASES
+} tel_phase_t;
+
+typedef enum {
+	TEL_WAKE_FAST='f',		//slideshow wake: only showed the next image
+	TEL_WAKE_FULL='b',		//full boot with the access point
+	TEL_WAKE_SYNC='s',		//full boot that synced with the server
+} tel_wake_kind_t;
+
+//Call first thing in app_main.
+void telemetry_begin(tel_wake_kind_t kind);
+void telemetry_set_kind(tel_wake_kind_t kind);
+//Adds time to a phase of the current wake. Phases can happen more than once.
+void telemetry_add(tel_phase_t phase, int64_t us);
+//For phases that are the longest of something rather than a total: keeps the largest time.
+void telemetry_max(tel_phase_t phase, int64_t us);
+void telemetry_add_images(int count);
+//Closes the current wake and stores it in RTC memory. Call right before deep sleep.
+void telemetry_end(int bat_mv);
+
+//Writes the wakes the server hasn't acknowledged yet, oldest first, for the &tel= query
+//argument. Returns the number of wakes written; 0 if there are none (or they don't fit).
+int telemetry_format(char *buf, size_t len);
+//The server has stored the wakes from the last telemetry_format().
+void telemetry_sent();
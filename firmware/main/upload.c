@@ -0,0 +1,280 @@
+/*
+Resumable, offset-addressed image uploads into the images partition.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "esp_http_server.h"
+#include "epd.h"
+#include "epd_flash_image.h"
+#include "metrics.h"
+#include "upload.h"
+#include "display.h"
+#include "sched.h"
+#include "progress.h"
+
+static const char *TAG="upload";
+
+//Max size of one chunk. One flash sector; the client is free to send less.
+#define UPLOAD_CHUNK_MAX 4096
+//Bytes at the start of the image that are held back until commit
+#define UPLOAD_HDR_LEN sizeof(flash_image_hdr_t)
+
+//There's only one upload session; starting a new one abandons the old one.
+typedef struct {
+	uint32_t id;			//0 if no session
+	int slot;
+	int size;				//total image size
+	int offset;				//bytes received and durably written (or held in hdr)
+	int erased;				//bytes of the slot erased so far, sector-aligned
+	uint32_t crc;			//CRC32 of bytes [0..offset)
+	int64_t start_us;
+	uint8_t hdr[UPLOAD_HDR_LEN];
+} upload_session_t;
+
+static upload_session_t session;
+
+static const esp_partition_t *get_part() {
+	return esp_partition_find_first(123, 0, NULL);
+}
+
+//Get a query parameter as a string. Returns ESP_OK if found.
+static esp_err_t get_param(httpd_req_t *req, const char *key, char *val, int len) {
+	char query[128];
+	if (httpd_req_get_url_query_str(req, query, sizeof(query))!=ESP_OK) return ESP_ERR_NOT_FOUND;
+	return httpd_query_key_value(query, key, val, len);
+}
+
+//Get a query parameter as a number in the given base. Returns ESP_OK if found and valid.
+static esp_err_t get_param_num(httpd_req_t *req, const char *key, uint32_t *val, int base) {
+	char buf[16];
+	esp_err_t r=get_param(req, key, buf, sizeof(buf));
+	if (r!=ESP_OK) return r;
+	char *end;
+	*val=strtoul(buf, &end, base);
+	if (end==buf || *end!=0) return ESP_ERR_INVALID_ARG;
+	return ESP_OK;
+}
+
+//Checks the session parameter against the current session.
+static int session_valid(httpd_req_t *req) {
+	uint32_t id;
+	if (get_param_num(req, "session", &id, 16)!=ESP_OK) return 0;
+	return (session.id!=0 && id==session.id);
+}
+
+static esp_err_t send_session(httpd_req_t *req) {
+	char resp[128];
+	snprintf(resp, sizeof(resp), "{\"session\":\"%08lx\",\"slot\":%d,\"size\":%d,\"offset\":%d,\"chunk_max\":%d}",
+			(unsigned long)session.id, session.slot, session.size, session.offset, UPLOAD_CHUNK_MAX);
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+	return httpd_resp_sendstr(req, resp);
+}
+
+//Writes image data to the slot, erasing sectors just before they're first written to.
+//This way an upload that dies early doesn't needlessly wear out the rest of the slot.
+static esp_err_t slot_write(const esp_partition_t *part, int offset, const uint8_t *data, int len) {
+	int base=session.slot*IMG_SIZE_BYTES;
+	display_lock_images();
+	while (session.erased<offset+len) {
+		int64_t t=esp_timer_get_time();
+		esp_err_t err=esp_partition_erase_range(part, base+session.erased, SPI_FLASH_SEC_SIZE);
+		metrics_add(METRIC_FLASH_ERASE_US, esp_timer_get_time()-t);
+		metrics_add(METRIC_FLASH_ERASE_COUNT, 1);
+		metrics_add(METRIC_FLASH_ERASE_BYTES, SPI_FLASH_SEC_SIZE);
+		if (err!=ESP_OK) {
+			display_unlock_images();
+			return err;
+		}
+		session.erased+=SPI_FLASH_SEC_SIZE;
+	}
+	int64_t t=esp_timer_get_time();
+	esp_err_t err=esp_partition_write(part, base+offset, data, len);
+	display_unlock_images();
+	metrics_add(METRIC_FLASH_WRITE_US, esp_timer_get_time()-t);
+	metrics_add(METRIC_FLASH_WRITE_COUNT, 1);
+	metrics_add(METRIC_FLASH_WRITE_BYTES, len);
+	return err;
+}
+
+esp_err_t upload_begin_handler(httpd_req_t *req) {
+	uint32_t size, slot=0;
+	if (get_param_num(req, "size", &size, 10)!=ESP_OK ||
+			size<=UPLOAD_HDR_LEN || size>IMG_SIZE_BYTES) {
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing or invalid size");
+		return ESP_FAIL;
+	}
+	esp_err_t r=get_param_num(req, "slot", &slot, 10);
+	if ((r!=ESP_OK && r!=ESP_ERR_NOT_FOUND) || slot>=IMG_SLOT_COUNT) {
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid slot");
+		return ESP_FAIL;
+	}
+	if (session.id!=0) {
+		ESP_LOGW(TAG, "Abandoning upload session %08lx at %d/%d bytes", (unsigned long)session.id, session.offset, session.size);
+	}
+	memset(&session, 0, sizeof(session));
+	do {
+		session.id=esp_random();
+	} while (session.id==0);
+	session.slot=slot;
+	session.size=size;
+	session.start_us=esp_timer_get_time();
+	ESP_LOGI(TAG, "Upload session %08lx: %d bytes to slot %d", (unsigned long)session.id, session.size, session.slot);
+	return send_session(req);
+}
+
+esp_err_t upload_chunk_handler(httpd_req_t *req) {
+	uint32_t offset, crc;
+	if (!session_valid(req)) {
+		httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such upload session");
+		return ESP_FAIL;
+	}
+	if (get_param_num(req, "offset", &offset, 10)!=ESP_OK || get_param_num(req, "crc", &crc, 16)!=ESP_OK) {
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing offset or crc");
+		return ESP_FAIL;
+	}
+	int len=req->content_len;
+	if (len==0 || len>UPLOAD_CHUNK_MAX || offset+len>session.size) {
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid chunk size");
+		return ESP_FAIL;
+	}
+	if (offset!=session.offset) {
+		//Client is out of sync with us (e.g. the response to its last chunk got lost).
+		//Tell it where we really are.
+		ESP_LOGW(TAG, "Chunk for offset %lu, but we're at %d", (unsigned long)offset, session.offset);
+		httpd_resp_set_status(req, "409 Conflict");
+		return send_session(req);
+	}
+
+	uint8_t *buf=malloc(len);
+	if (!buf) {
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+		return ESP_FAIL;
+	}
+	int got=0;
+	while (got<len) {
+		int r=httpd_req_recv(req, (char*)buf+got, len-got);
+		if (r==HTTPD_SOCK_ERR_TIMEOUT) continue;
+		if (r<=0) {
+			//Connection dropped. Nothing of this chunk has been written; the client can
+			//resend it from the offset /upload/status reports.
+			ESP_LOGW(TAG, "Connection lost during chunk at offset %lu", (unsigned long)offset);
+			free(buf);
+			return ESP_FAIL;
+		}
+		got+=r;
+	}
+	if (esp_rom_crc32_le(0, buf, len)!=crc) {
+		free(buf);
+		ESP_LOGW(TAG, "CRC mismatch in chunk at offset %lu", (unsigned long)offset);
+		//Not a 400: the chunk got corrupted on the way, and the client should send it again.
+		httpd_resp_set_status(req, "422 Unprocessable Entity");
+		httpd_resp_sendstr(req, "Chunk CRC mismatch");
+		return ESP_FAIL;
+	}
+
+	//Anything that falls in the header is kept in RAM until commit; the rest goes to flash.
+	const esp_partition_t *part=get_part();
+	esp_err_t err=(part==NULL)?ESP_ERR_NOT_FOUND:ESP_OK;
+	int p=0;
+	if (offset<UPLOAD_HDR_LEN) {
+		p=MIN(len, UPLOAD_HDR_LEN-offset);
+		memcpy(&session.hdr[offset], buf, p);
+	}
+	if (err==ESP_OK && p<len) {
+		err=slot_write(part, offset+p, buf+p, len-p);
+	}
+	if (err!=ESP_OK) {
+		free(buf);
+		ESP_LOGE(TAG, "Failed to write chunk at offset %lu: %s", (unsigned long)offset, esp_err_to_name(err));
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write data");
+		return ESP_FAIL;
+	}
+	session.crc=esp_rom_crc32_le(session.crc, buf, len);
+	session.offset+=len;
+	free(buf);
+	metrics_add(METRIC_UPLOAD_BYTES, len);
+	progress_send("{\"type\":\"upload\",\"stage\":\"flash\",\"offset\":%d,\"size\":%d,\"slot\":%d}",
+			session.offset, session.size, session.slot);
+	return send_session(req);
+}
+
+esp_err_t upload_status_handler(httpd_req_t *req) {
+	if (!session_valid(req)) {
+		httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such upload session");
+		return ESP_FAIL;
+	}
+	return send_session(req);
+}
+
+esp_err_t upload_commit_handler(httpd_req_t *req) {
+	uint32_t crc;
+	if (!session_valid(req)) {
+		httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such upload session");
+		return ESP_FAIL;
+	}
+	if (get_param_num(req, "crc", &crc, 16)!=ESP_OK) {
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing crc");
+		return ESP_FAIL;
+	}
+	if (session.offset!=session.size) {
+		httpd_resp_set_status(req, "409 Conflict");
+		return send_session(req);
+	}
+	if (crc!=session.crc) {
+		//Whole-image checksum doesn't match; the data can't be trusted. Kill the session so
+		//the client starts over.
+		ESP_LOGE(TAG, "Image CRC mismatch: got %08lx, calculated %08lx", (unsigned long)crc, (unsigned long)session.crc);
+		session.id=0;
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Image CRC mismatch");
+		return ESP_FAIL;
+	}
+	if (!img_valid((flash_image_hdr_t*)session.hdr)) {
+		session.id=0;
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid image header");
+		return ESP_FAIL;
+	}
+	//All data is in; writing the header makes the slot valid.
+	const esp_partition_t *part=get_part();
+	esp_err_t err=(part==NULL)?ESP_ERR_NOT_FOUND:slot_write(part, 0, session.hdr, UPLOAD_HDR_LEN);
+	if (err!=ESP_OK) {
+		ESP_LOGE(TAG, "Failed to write header: %s", esp_err_to_name(err));
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write header");
+		return ESP_FAIL;
+	}
+	int64_t upload_us=esp_timer_get_time()-session.start_us;
+	metrics_add(METRIC_UPLOAD_COUNT, 1);
+	metrics_add(METRIC_UPLOAD_US, upload_us);
+	metrics_set(METRIC_UPLOAD_LAST_BYTES, session.size);
+	metrics_set(METRIC_UPLOAD_LAST_US, upload_us);
+	ESP_LOGI(TAG, "Upload session %08lx committed to slot %d", (unsigned long)session.id, session.slot);
+	int slot=session.slot;
+	progress_send("{\"type\":\"upload\",\"stage\":\"done\",\"offset\":%d,\"size\":%d,\"slot\":%d}",
+			session.size, session.size, slot);
+	session.id=0;
+
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
+
+	sched_slot_updated(slot, true);
+	display_show_slot(slot);
+	return ESP_OK;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include "esp_http_server.h"
+
+//Resumable uploads. A client starts a session, sends the image in chunks addressed by offset
+//(each with a CRC32), can ask how many bytes are safely in flash after a connection drop,
+//and finally commits with the CRC32 of the whole image. Only a commit with a matching
+//checksum writes the image header, so an interrupted upload never leaves a valid-looking slot.
+//
+// POST /upload/begin?size=<bytes>[&slot=<n>]           -> {"session":"<id>","offset":0,...}
+// PUT  /upload/chunk?session=<id>&offset=<n>&crc=<hex>   (body: chunk data; 422 if the CRC is wrong)
+// GET  /upload/status?session=<id>                     -> {"session":"<id>","offset":<n>,...}
+// POST /upload/commit?session=<id>&crc=<hex>
+
+esp_err_t upload_begin_handler(httpd_req_t *req);
+esp_err_t upload_chunk_handler(httpd_req_t *req);
+esp_err_t upload_status_handler(httpd_req_t *req);
+esp_err_t upload_commit_handler(httpd_req_t *req);
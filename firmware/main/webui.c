@@ -0,0 +1,87 @@
+/*
+Serves the web UI. The files in www/ are gzipped at build time and embedded in the
+firmware; we send them as-is with Content-Encoding: gzip. Each gets an ETag derived from
+its contents, so a browser revisiting the page gets a 304 instead of the whole thing.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_http_server.h"
+#include "webui.h"
+
+static const char *TAG="webui";
+
+//index.html refers to the other files with a ?v=<content hash> suffix (filled in by
+//CMake), so those can be cached forever. index.html itself must be revalidated every
+//time, which is cheap thanks to the ETag.
+#define CACHE_REVALIDATE "no-cache"
+#define CACHE_FOREVER "public, max-age=31536000, immutable"
+
+#define ASSET(name) \
+	extern const uint8_t name##_gz_start[] asm("_binary_" #name "_gz_start"); \
+	extern const uint8_t name##_gz_end[] asm("_binary_" #name "_gz_end");
+ASSET(index_html)
+ASSET(style_css)
+ASSET(converter_js)
+ASSET(converter_worker_js)
+ASSET(app_js)
+
+typedef struct {
+	const char *uri;
+	const char *type;
+	const char *cache;
+	const uint8_t *start;
+	const uint8_t *end;
+	char etag[12];
+} webui_asset_t;
+
+static webui_asset_t assets[]={
+	{"/", "text/html", CACHE_REVALIDATE, index_html_gz_start, index_html_gz_end},
+	{"/style.css", "text/css", CACHE_FOREVER, style_css_gz_start, style_css_gz_end},
+	{"/converter.js", "text/javascript", CACHE_FOREVER, converter_js_gz_start, converter_js_gz_end},
+	{"/converter-worker.js", "text/javascript", CACHE_FOREVER, converter_worker_js_gz_start, converter_worker_js_gz_end},
+	{"/app.js", "text/javascript", CACHE_FOREVER, app_js_gz_start, app_js_gz_end},
+};
+
+static esp_err_t asset_handler(httpd_req_t *req) {
+	webui_asset_t *a=(webui_asset_t*)req->user_ctx;
+	httpd_resp_set_hdr(req, "ETag", a->etag);
+	httpd_resp_set_hdr(req, "Cache-Control", a->cache);
+
+	char inm[16];
+	if (httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm))==ESP_OK && strcmp(inm, a->etag)==0) {
+		httpd_resp_set_status(req, "304 Not Modified");
+		return httpd_resp_send(req, NULL, 0);
+	}
+
+	//Note: every browser we care about accepts gzip, so we don't bother checking
+	//Accept-Encoding; there's no uncompressed copy to fall back to anyway.
+	httpd_resp_set_type(req, a->type);
+	httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+	return httpd_resp_send(req, (const char*)a->start, a->end-a->start);
+}
+
+void webui_register_handlers(httpd_handle_t server) {
+	for (int i=0; i<sizeof(assets)/sizeof(assets[0]); i++) {
+		webui_asset_t *a=&assets[i];
+		uint32_t crc=esp_rom_crc32_le(0, a->start, a->end-a->start);
+		snprintf(a->etag, sizeof(a->etag), "\"%08lx\"", (unsigned long)crc);
+		const httpd_uri_t uri={
+			.uri=a->uri,
+			.method=HTTP_GET,
+			.handler=asset_handler,
+			.user_ctx=a
+		};
+		httpd_register_uri_handler(server, &uri);
+		ESP_LOGI(TAG, "%s: %d bytes gzipped, etag %s", a->uri, (int)(a->end-a->start), a->etag);
+	}
+}
@@ -0,0 +1,5 @@
+#pragma once
+#include "esp_http_server.h"
+
+//Registers the handlers serving the (embedded, pre-gzipped) web UI files.
+void webui_register_handlers(httpd_handle_t server);
@@ -0,0 +1,212 @@
+const converter = new EPDConverter();
+const form = document.getElementById('uploadForm');
+const imageInput = document.getElementById('imageInput');
+const previewCanvas = document.getElementById('previewCanvas');
+const uploadButton = document.getElementById('uploadButton');
+const loading = document.getElementById('loading');
+const progressContainer = document.getElementById('progressContainer');
+const progressBar = document.getElementById('progressBar');
+const progressText = document.getElementById('progressText');
+let currentImage = null;
+
+// Add status message container
+const statusContainer = document.createElement('div');
+statusContainer.className = 'status';
+form.insertBefore(statusContainer, form.firstChild);
+
+// Fill in the connection info
+fetch('/status').then(r => r.json()).then(st => {
+    document.getElementById('wifiSsid').textContent = st.ssid;
+    document.getElementById('wifiPass').textContent = st.password;
+    document.getElementById('displayState').textContent = st.display;
+}).catch(() => {});
+
+// Live events from the frame: upload progress, and what the panel is doing. With those we
+// know when the image is actually on the display instead of guessing.
+const PANEL_STEPS = {
+    init: [5, 'Waking up the panel...'],
+    push: [10, 'Sending image to the panel...'],
+    power_on: [25, 'Panel powering on...'],
+    refresh: [30, 'Panel refreshing, this takes 15-30 seconds...'],
+    power_off: [95, 'Panel powering off...'],
+};
+let events = null;
+let uploading = false;
+let waitingForPanel = false;
+
+function connectEvents() {
+    events = new WebSocket('ws://' + location.host + '/ws');
+    events.onmessage = (e) => {
+        const ev = JSON.parse(e.data);
+        if (ev.type === 'display') {
+            document.getElementById('displayState').textContent = ev.state;
+            if (!waitingForPanel) return;
+            if (ev.state === 'idle') {
+                waitingForPanel = false;
+                updateProgress(100, 'Done');
+                showStatus('Image is on the display.');
+                loading.classList.remove('active');
+                uploadButton.disabled = false;
+            } else if (PANEL_STEPS[ev.phase]) {
+                updateProgress(...PANEL_STEPS[ev.phase]);
+            }
+        } else if (ev.type === 'upload' && uploading && ev.stage !== 'done') {
+            updateProgress(Math.round(ev.offset * 100 / ev.size), 'Uploading... ' + ev.offset + '/' + ev.size + ' bytes');
+        }
+    };
+    events.onclose = () => {
+        events = null;
+        setTimeout(connectEvents, 3000);
+    };
+}
+connectEvents();
+
+function showStatus(message, isError = false) {
+    statusContainer.textContent = message;
+    statusContainer.className = 'status ' + (isError ? 'error' : 'success');
+    statusContainer.style.display = 'block';
+}
+
+function updateProgress(percent, message) {
+    progressBar.style.width = percent + '%';
+    progressText.textContent = message || (percent + '%');
+}
+
+imageInput.addEventListener('change', async (e) => {
+    const file = e.target.files[0];
+    if (!file) return;
+
+    try {
+        showStatus('Processing image...');
+        progressContainer.classList.add('active');
+        updateProgress(0, 'Loading image...');
+
+        // Create image from file
+        const img = new Image();
+        img.src = URL.createObjectURL(file);
+        await new Promise((resolve, reject) => {
+            img.onload = resolve;
+            img.onerror = () => reject(new Error('Failed to load image'));
+        });
+
+        updateProgress(20, 'Resizing image...');
+
+        // Create canvas and draw image
+        const canvas = document.createElement('canvas');
+        canvas.width = 600;
+        canvas.height = 448;
+        const ctx = canvas.getContext('2d');
+        ctx.drawImage(img, 0, 0, 600, 448);
+
+        updateProgress(40, 'Converting to EPD format...');
+
+        // Convert image
+        const result = await converter.convertImage(canvas, (done, total) => {
+            updateProgress(40 + Math.round(done * 50 / total), 'Converting to EPD format...');
+        });
+        currentImage = result.binaryData;
+
+        updateProgress(90, 'Generating preview...');
+
+        // Show preview
+        const previewCtx = previewCanvas.getContext('2d');
+        previewCtx.drawImage(result.previewCanvas, 0, 0);
+
+        updateProgress(100, 'Ready to upload');
+        showStatus('Image processed successfully! Click Upload to continue.');
+        uploadButton.disabled = false;
+    } catch (error) {
+        console.error('Error processing image:', error);
+        showStatus('Error: ' + error.message, true);
+        progressContainer.classList.remove('active');
+        uploadButton.disabled = true;
+    }
+});
+
+const CRC_TABLE = new Uint32Array(256).map((_, n) => {
+    let c = n;
+    for (let k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >>> 1) : c >>> 1;
+    return c;
+});
+
+function crc32(data, crc = 0) {
+    crc = ~crc;
+    for (let i = 0; i < data.length; i++) crc = CRC_TABLE[(crc ^ data[i]) & 0xFF] ^ (crc >>> 8);
+    return (~crc) >>> 0;
+}
+
+async function uploadRequest(method, url, body) {
+    const response = await fetch(url, { method: method, body: body });
+    if (!response.ok && response.status !== 409) {
+        const err = new Error(response.status + ' ' + await response.text());
+        // A chunk that got corrupted on the way (422) is worth sending again, like a 500
+        err.fatal = response.status !== 500 && response.status !== 422;
+        throw err;
+    }
+    return response.json();
+}
+
+async function resumableUpload(data, onProgress) {
+    const session = await uploadRequest('POST', '/upload/begin?size=' + data.length);
+    const id = session.session;
+    let offset = 0;
+    let failures = 0;
+    while (offset < data.length) {
+        const chunk = data.subarray(offset, Math.min(offset + session.chunk_max, data.length));
+        try {
+            const st = await uploadRequest('PUT', '/upload/chunk?session=' + id + '&offset=' + offset +
+                '&crc=' + crc32(chunk).toString(16), chunk);
+            offset = st.offset;
+            failures = 0;
+        } catch (error) {
+            if (error.fatal || ++failures > 10) throw error;
+            // Link dropped; wait a bit, then resume from what the frame has in flash.
+            await new Promise(r => setTimeout(r, 1000 * failures));
+            try {
+                offset = (await uploadRequest('GET', '/upload/status?session=' + id)).offset;
+            } catch (e) { if (e.fatal) throw e; }
+        }
+        onProgress(offset, data.length);
+    }
+    await uploadRequest('POST', '/upload/commit?session=' + id + '&crc=' + crc32(data).toString(16));
+}
+
+form.addEventListener('submit', async (e) => {
+    e.preventDefault();
+    if (!currentImage) return;
+
+    try {
+        loading.classList.add('active');
+        progressContainer.classList.add('active');
+        uploadButton.disabled = true;
+        uploading = true;
+        showStatus('Uploading image...');
+
+        // Resumable upload: chunks are addressed by offset, so after a dropped
+        // connection we ask the frame how far it got and continue from there.
+        await resumableUpload(currentImage, (done, total) => {
+            updateProgress(Math.round(done * 100 / total), 'Uploading... ' + done + '/' + total + ' bytes');
+        });
+
+        uploading = false;
+        if (events && events.readyState === WebSocket.OPEN) {
+            // The frame tells us when the panel is done
+            waitingForPanel = true;
+            updateProgress(0, 'Waiting for the panel...');
+            showStatus('Image uploaded successfully! Showing it on the display...');
+        } else {
+            updateProgress(100, 'Upload complete!');
+            showStatus('Image uploaded successfully!');
+            setTimeout(() => {
+                window.location.href = '/upload-success';
+            }, 2000);
+        }
+    } catch (error) {
+        uploading = false;
+        console.error('Upload error:', error);
+        showStatus('Upload failed: ' + error.message, true);
+        loading.classList.remove('active');
+        progressContainer.classList.remove('active');
+        uploadButton.disabled = false;
+    }
+});
@@ -0,0 +1,59 @@
+// EPD Image Converter. The conversion itself runs in converter-worker.js, so the page
+// stays responsive; index.html tells us where that lives (with its content hash).
+const EPD_WORKER_URL = document.currentScript.dataset.worker;
+
+class EPDConverter {
+    constructor() {
+        this.width = 600;
+        this.height = 448;
+    }
+    
+    // Returns a promise for {binaryData, previewCanvas}. onProgress(done, total) is
+    // called every few rows.
+    convertImage(canvas, onProgress) {
+        const ctx = canvas.getContext('2d');
+        const imageData = ctx.getImageData(0, 0, this.width, this.height);
+        
+        return new Promise((resolve, reject) => {
+            const worker = new Worker(EPD_WORKER_URL);
+            worker.onmessage = (e) => {
+                const msg = e.data;
+                if (msg.type === 'progress') {
+                    if (onProgress) onProgress(msg.done, msg.total);
+                    return;
+                }
+                worker.terminate();
+                if (msg.type === 'error') {
+                    reject(new Error(msg.message));
+                    return;
+                }
+                
+                // Create preview canvas
+                const previewCanvas = document.createElement('canvas');
+                previewCanvas.width = this.width;
+                previewCanvas.height = this.height;
+                const previewData = new ImageData(new Uint8ClampedArray(msg.preview), this.width, this.height);
+                previewCanvas.getContext('2d').putImageData(previewData, 0, 0);
+                
+                resolve({
+                    binaryData: new Uint8Array(msg.binary),
+                    previewCanvas: previewCanvas
+                });
+            };
+            worker.onerror = (e) => {
+                worker.terminate();
+                reject(new Error(e.message || 'Converter worker failed'));
+            };
+            // No dithering, and the image centered horizontally; same as this page has
+            // always done.
+            worker.postMessage({
+                rgba: imageData.data.buffer,
+                width: this.width,
+                height: this.height,
+                dither: false,
+                layout: 'shifted',
+                timestamp: Math.floor(Date.now() / 1000)
+            }, [imageData.data.buffer]);
+        });
+    }
+}
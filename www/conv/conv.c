@@ -15,15 +15,16 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define EPD_W 600
 #define EPD_H 448
 
 #define EPD_UPSIDE_DOWN 1
 
-//This loads a png/jpg file and if needed converts it to truecolor, crops the center to the
-//EPD aspect ratio and scales to EPD_W/EPD_H.
-gdImagePtr load_scaled(char *filename) {
+//This loads a png/jpg file.
+gdImagePtr load_image(char *filename) {
 	FILE *f;
 	f=fopen(filename, "r");
 	if (f==NULL) {
@@ -42,10 +43,13 @@ gdImagePtr load_scaled(char *filename) {
 	} else {
 		oim=gdImageCreateFromJpegEx(f, 1);
 	}
-	if (oim==NULL) {
-		return NULL;
-	}
+	fclose(f);
+	return oim;
+}
 
+//If needed, this converts an image to truecolor, crops the center to the EPD aspect ratio
+//and scales to EPD_W/EPD_H.
+gdImagePtr scale_image(gdImagePtr oim) {
 	gdImagePtr nim=NULL;
 	if (gdImageSY(oim)==EPD_H && gdImageSX(oim)==EPD_W && gdImageTrueColor(oim)) {
 		//no scaling needed
@@ -76,7 +80,13 @@ gdImagePtr load_scaled(char *filename) {
 typedef struct __attribute__((packed)) {
 	uint32_t id;
 	uint64_t timestamp;
-	uint8_t unused[64-12];
+	uint8_t strategy;		//STRATEGY_* used to convert the image
+	uint8_t kernel;			//KERNEL_* it was dithered with, | KERNEL_SERPENTINE
+	uint16_t conv_ms;		//how long the conversion took, up to writing the output
+	uint16_t deadline_ms;	//--deadline it was converted with, 0 if none
+	uint8_t strength;		//percentage of the error that was diffused; 0 in older images, meaning 100
+	uint8_t saturation;		//saturation boost in percent; 0 in older images, meaning 100
+	uint8_t unused[64-20];
 } flash_image_hdr_t;
 
 typedef struct __attribute__((packed)) {
@@ -140,16 +150,6 @@ float clamp(float val, float min, float max) {
 	return val;
 }
 
-//Given an array of [rgb] floats, adds the difference diff to the
-//pixel at [x,y], with i indicating the color (0=r, 1=g, 2=b)
-void dist_diff(float *pixels, int x, int y, int i, float dif) {
-	if (x<0 || x>=EPD_W) return;
-	if (y<0 || y>=EPD_H) return;
-	float new_val=pixels[(x+y*EPD_W)*3+i]+dif;
-	new_val=clamp(new_val, 0, 1);
-	pixels[(x+y*EPD_W)*3+i]=new_val;
-}
-
 static inline float deg2rad(float deg) {
 	return (2 * M_PI * deg) / 360.0;
 }
@@ -219,10 +219,631 @@ float col_diff(float *rgb1, float *rgb2) {
 	return deltaE;
 }
 
+//RGB colors as displayed on the screen
+//These are calculated by grabbing a test pattern which shows all colors, taking a picture,
+//then using an image editor to max out the levels for max contrast & saturation, then taking
+//the linear (not SRGB) RGB values and putting them here.
+float epd_colors[7][3]={ //rgb
+	{0,0,0},
+	{1,1,1},
+	{0.059, 0.329, 0.119},
+	{0.061, 0.147, 0.336},
+	{0.574, 0.066, 0.010},
+	{0.982, 0.756, 0.004},
+	{0.795, 0.255, 0.018},
+};
+float epd_colors_lab[7][3];
+//The same as ints, as they are in the preview png
+int epd_colors_int[7];
+
+//Finds out which palette color an int color is, without searching: a hash table with room to
+//spare, keyed on the color. Entries are the palette index+1; 0 is empty.
+#define COLOR_HASH_SIZE 32
+uint8_t color_hash[COLOR_HASH_SIZE];
+
+static inline int color_hash_slot(int c) {
+	return ((uint32_t)c*2654435761u)>>27;
+}
+
+void init_colors() {
+	for (int i=0; i<7; i++) {
+		rgb_to_lab(epd_colors[i], epd_colors_lab[i]);
+		int c=0;
+		for (int j=0; j<3; j++) {
+			int pc=epd_colors[i][j]*255;
+			c=(c<<8)|pc;
+		}
+		epd_colors_int[i]=c;
+		int slot=color_hash_slot(c);
+		while (color_hash[slot]) slot=(slot+1)%COLOR_HASH_SIZE;
+		color_hash[slot]=i+1;
+	}
+}
+
+//Returns the palette index of int color c, or -1 if it's not a palette color.
+static inline int palette_index(int c) {
+	for (int slot=color_hash_slot(c); color_hash[slot]; slot=(slot+1)%COLOR_HASH_SIZE) {
+		if (epd_colors_int[color_hash[slot]-1]==c) return color_hash[slot]-1;
+	}
+	return -1;
+}
+
+//If the image is EPD_W x EPD_H and only uses the palette colors (say it's a preview, or
+//made for the panel already), this puts the palette index of every pixel in idx and
+//returns 1. It gives up at the first pixel that's something else.
+int palette_indexes(gdImagePtr im, uint8_t *idx) {
+	if (gdImageSX(im)!=EPD_W || gdImageSY(im)!=EPD_H) return 0;
+	for (int y=0; y<EPD_H; y++) {
+		for (int x=0; x<EPD_W; x++) {
+			int i=palette_index(gdImageGetTrueColorPixel(im, x, y)&0xffffff);
+			if (i<0) return 0;
+			idx[x+y*EPD_W]=i;
+		}
+	}
+	return 1;
+}
+
+//Ways to find the closest palette color for a pixel. Each returns the palette index.
+int nearest_de2000(float *rgb) {
+	int best=0;
+	float best_dif=999999999;
+	for (int i=0; i<7; i++) {
+		float d=col_diff(rgb, epd_colors[i]);
+		if (d<best_dif) {
+			best_dif=d;
+			best=i;
+		}
+	}
+	return best;
+}
+
+//Plain distance in CIE-LAB (deltaE76): no trig, and the pixel is converted only once.
+int nearest_de76(float *rgb) {
+	float lab[3];
+	rgb_to_lab(rgb, lab);
+	int best=0;
+	float best_dif=999999999;
+	for (int i=0; i<7; i++) {
+		float d=0;
+		for (int j=0; j<3; j++) d+=(lab[j]-epd_colors_lab[i][j])*(lab[j]-epd_colors_lab[i][j]);
+		if (d<best_dif) {
+			best_dif=d;
+			best=i;
+		}
+	}
+	return best;
+}
+
+//Distance in linear RGB. Cheapest, but it doesn't know what looks alike.
+int nearest_rgb(float *rgb) {
+	int best=0;
+	float best_dif=999999999;
+	for (int i=0; i<7; i++) {
+		float d=0;
+		for (int j=0; j<3; j++) d+=(rgb[j]-epd_colors[i][j])*(rgb[j]-epd_colors[i][j]);
+		if (d<best_dif) {
+			best_dif=d;
+			best=i;
+		}
+	}
+	return best;
+}
+
+//Dithering and color distance combinations. The STRATEGY_* number goes into the image header,
+//so never renumber them; 0 is what conv always did, and what older images have there.
+#define STRATEGY_FS_DE2000 0
+#define STRATEGY_FS_DE76 1
+#define STRATEGY_FS_RGB 2
+#define STRATEGY_NEAREST_RGB 3
+//Not in strategies[]: the input only had palette colors, so it was used as it is.
+#define STRATEGY_PASSTHROUGH 4
+
+typedef struct {
+	int id;
+	const char *name;
+	int dither;				//diffuse the error to the neighbours, using the --kernel (normally Floyd-Steinberg)
+	int (*nearest)(float *rgb);
+} strategy_t;
+
+//Best looking first; --deadline picks the first one that's expected to make it.
+const strategy_t strategies[]={
+	{STRATEGY_FS_DE2000, "fs-de2000", 1, nearest_de2000},
+	{STRATEGY_FS_DE76, "fs-de76", 1, nearest_de76},
+	{STRATEGY_FS_RGB, "fs-rgb", 1, nearest_rgb},
+	{STRATEGY_NEAREST_RGB, "nearest-rgb", 0, nearest_rgb},
+};
+#define STRATEGY_COUNT (sizeof(strategies)/sizeof(strategies[0]))
+
+//Error diffusion kernels, as a list of T(dx, dy, weight) taps. dx is for scanning left to
+//right; going right to left (serpentine scanning) it's mirrored.
+#define FS_TAPS(T) \
+	T( 1,0,7) \
+	T(-1,1,3) T( 0,1,5) T( 1,1,1)
+#define JJN_TAPS(T) \
+	T( 1,0,7) T( 2,0,5) \
+	T(-2,1,3) T(-1,1,5) T( 0,1,7) T( 1,1,5) T( 2,1,3) \
+	T(-2,2,1) T(-1,2,3) T( 0,2,5) T( 1,2,3) T( 2,2,1)
+#define STUCKI_TAPS(T) \
+	T( 1,0,8) T( 2,0,4) \
+	T(-2,1,2) T(-1,1,4) T( 0,1,8) T( 1,1,4) T( 2,1,2) \
+	T(-2,2,1) T(-1,2,2) T( 0,2,4) T( 1,2,2) T( 2,2,1)
+//Atkinson only passes on 6/8 of the error; it keeps more contrast, at the cost of detail in
+//the darks and lights.
+#define ATKINSON_TAPS(T) \
+	T( 1,0,1) T( 2,0,1) \
+	T(-1,1,1) T( 0,1,1) T( 1,1,1) \
+	T( 0,2,1)
+#define SIERRA_LITE_TAPS(T) \
+	T( 1,0,2) \
+	T(-1,1,1) T( 0,1,1)
+
+//K(id, name, taps, divisor, reach, down): reach is the largest |dx|, down the largest dy.
+//The KERNEL_* number goes in the image header; again, don't renumber.
+#define KERNELS(K) \
+	K(0, "floyd-steinberg", FS_TAPS, 16, 1, 1) \
+	K(1, "jarvis", JJN_TAPS, 48, 2, 2) \
+	K(2, "stucki", STUCKI_TAPS, 42, 2, 2) \
+	K(3, "atkinson", ATKINSON_TAPS, 8, 2, 2) \
+	K(4, "sierra-lite", SIERRA_LITE_TAPS, 4, 1, 1)
+//Set in the header's kernel byte for serpentine scanning
+#define KERNEL_SERPENTINE 0x80
+
+//Adds the fraction f of the error to the pixel at p.
+static inline void diffuse_tap(float *p, const float *err, float f) {
+	for (int i=0; i<3; i++) p[i]=clamp(p[i]+err[i]*f, 0, 1);
+}
+
+//The fraction is worked out here, as one float constant, so every tap is a single multiply.
+#define TAP(dx, dy, wt) \
+	diffuse_tap(&pixels[(x+(dx)*dir+(y+(dy))*w)*3], err, (float)((wt)/div));
+#define TAP_CHECKED(dx, dy, wt) \
+	if (x+(dx)*dir>=0 && x+(dx)*dir<w && y+(dy)<h) TAP(dx, dy, wt)
+
+//Picks the color for pixel x and puts what's left over, times strength, in err.
+static inline void quantize(const strategy_t *s, float *pixels, int w, int x, int y, float strength, uint8_t *out, float *err) {
+	float *p=&pixels[(x+y*w)*3];
+	int best=s->nearest(p);
+	out[x+y*w]=best;
+	for (int i=0; i<3; i++) err[i]=(p[i]-epd_colors[best][i])*strength;
+}
+
+//Generates the function that dithers row y of a w*h image with a kernel, going right (dir=1)
+//or left (dir=-1). Every tap is unrolled; only the columns within reach of the edges (and all of
+//the last rows) check if the taps fall inside the image.
+#define KERNEL_ROW(id, name, TAPS, divisor, reach, down) \
+static void dither_row_##id(const strategy_t *s, float *pixels, int w, int h, int y, int dir, float strength, uint8_t *out) { \
+	const double div=(divisor); \
+	float err[3]; \
+	int lo=(reach), hi=w-(reach); \
+	if (y+(down)>=h || hi<lo) lo=hi=0; \
+	int x=(dir>0)?0:w-1; \
+	for (; x>=0 && x<w && (dir>0?x<lo:x>=hi); x+=dir) { \
+		quantize(s, pixels, w, x, y, strength, out, err); \
+		TAPS(TAP_CHECKED) \
+	} \
+	for (; dir>0?x<hi:x>=lo; x+=dir) { \
+		quantize(s, pixels, w, x, y, strength, out, err); \
+		TAPS(TAP) \
+	} \
+	for (; x>=0 && x<w; x+=dir) { \
+		quantize(s, pixels, w, x, y, strength, out, err); \
+		TAPS(TAP_CHECKED) \
+	} \
+}
+KERNELS(KERNEL_ROW)
+
+typedef struct {
+	int id;
+	const char *name;
+	void (*row)(const strategy_t *s, float *pixels, int w, int h, int y, int dir, float strength, uint8_t *out);
+} kernel_t;
+
+#define KERNEL_ENTRY(id, name, TAPS, divisor, reach, down) {id, name, dither_row_##id},
+const kernel_t kernels[]={
+	KERNELS(KERNEL_ENTRY)
+};
+#define KERNEL_COUNT (sizeof(kernels)/sizeof(kernels[0]))
+
+//Converts w*h pixels of [rgb] floats (which get the error diffused into them) to palette indexes.
+//strength is the part of the error that's diffused; 1 is all of it.
+void dither(const strategy_t *s, const kernel_t *k, int serpentine, float strength, float *pixels, int w, int h, uint8_t *out) {
+	for (int y=0; y<h; y++) {
+		if (s->dither) {
+			k->row(s, pixels, w, h, y, (serpentine && (y&1))?-1:1, strength, out);
+		} else {
+			for (int x=0; x<w; x++) out[x+y*w]=s->nearest(&pixels[(x+y*w)*3]);
+		}
+	}
+}
+
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000.0+ts.tv_nsec/1000000.0;
+}
+
+//The calibration profile has the time every strategy takes per pixel on this host, in ns,
+//with Floyd-Steinberg if it dithers. To see what the other kernels cost, they're timed with
+//the fs-rgb color distance, raster and serpentine.
+typedef struct {
+	double strategy_ns[STRATEGY_COUNT];
+	double kernel_ns[KERNEL_COUNT][2];
+} profile_t;
+
+//Time per pixel a strategy is expected to take with a kernel.
+double profile_ns(const profile_t *p, const strategy_t *s, const kernel_t *k, int serpentine) {
+	double ns=p->strategy_ns[s-strategies];
+	if (s->dither) ns+=p->kernel_ns[k-kernels][serpentine]-p->kernel_ns[0][0];
+	return (ns>0)?ns:0;
+}
+
+//Measured on a strip of made-up photo-ish content: gradients with some noise. The best of a
+//few runs counts, so a hiccup doesn't end up in the profile.
+#define CALIB_H 32
+#define CALIB_RUNS 3
+
+double calibrate_one(const strategy_t *s, const kernel_t *k, int serpentine, float *pixels, uint8_t *out) {
+	int npix=EPD_W*CALIB_H;
+	double best=0;
+	for (int run=0; run<CALIB_RUNS; run++) {
+		uint32_t seed=12345;
+		for (int i=0; i<npix; i++) {
+			int x=i%EPD_W, y=i/EPD_W;
+			for (int j=0; j<3; j++) {
+				seed=seed*1103515245+12345;
+				float noise=((seed>>16)&0xff)/2550.0;
+				pixels[i*3+j]=gamma_linear(clamp((float)((x*(j+1))%EPD_W)/EPD_W+(float)y/CALIB_H/4+noise, 0, 1));
+			}
+		}
+		double start=now_ms();
+		dither(s, k, serpentine, 1, pixels, EPD_W, CALIB_H, out);
+		double ns=(now_ms()-start)*1000000.0/npix;
+		if (run==0 || ns<best) best=ns;
+	}
+	return best;
+}
+
+void calibrate(profile_t *p) {
+	float *pixels=malloc(EPD_W*CALIB_H*3*sizeof(float));
+	uint8_t *out=malloc(EPD_W*CALIB_H);
+	assert(pixels && out);
+	for (int s=0; s<STRATEGY_COUNT; s++) {
+		p->strategy_ns[s]=calibrate_one(&strategies[s], &kernels[0], 0, pixels, out);
+	}
+	for (int k=0; k<KERNEL_COUNT; k++) {
+		for (int serp=0; serp<2; serp++) {
+			p->kernel_ns[k][serp]=calibrate_one(&strategies[STRATEGY_FS_RGB], &kernels[k], serp, pixels, out);
+		}
+	}
+	free(pixels);
+	free(out);
+}
+
+//Returns 1 if the profile has numbers for everything.
+int load_profile(const char *file, profile_t *p) {
+	FILE *f=fopen(file, "r");
+	if (!f) return 0;
+	int found=0;
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		char name[64];
+		double ns, ns_serp;
+		int n=sscanf(line, "%63s %lf %lf", name, &ns, &ns_serp);
+		if (line[0]=='#' || n<2 || ns<=0) continue;
+		for (int s=0; s<STRATEGY_COUNT; s++) {
+			if (strcmp(name, strategies[s].name)==0) {
+				p->strategy_ns[s]=ns;
+				found++;
+			}
+		}
+		for (int k=0; k<KERNEL_COUNT; k++) {
+			if (n==3 && strncmp(name, "kernel-", 7)==0 && strcmp(name+7, kernels[k].name)==0) {
+				p->kernel_ns[k][0]=ns;
+				p->kernel_ns[k][1]=ns_serp;
+				found++;
+			}
+		}
+	}
+	fclose(f);
+	return found==STRATEGY_COUNT+KERNEL_COUNT;
+}
+
+void save_profile(const char *file, const profile_t *p) {
+	FILE *f=fopen(file, "w");
+	if (!f) {
+		perror(file);
+		return;
+	}
+	char host[64]="";
+	gethostname(host, sizeof(host)-1);
+	fprintf(f, "# conv calibration for %s, in ns per pixel\n", host);
+	fprintf(f, "# strategy, with floyd-steinberg if it dithers\n");
+	for (int s=0; s<STRATEGY_COUNT; s++) {
+		fprintf(f, "%s %.1f\n", strategies[s].name, p->strategy_ns[s]);
+	}
+	fprintf(f, "# kernel with fs-rgb: raster, serpentine\n");
+	for (int k=0; k<KERNEL_COUNT; k++) {
+		fprintf(f, "kernel-%s %.1f %.1f\n", kernels[k].name, p->kernel_ns[k][0], p->kernel_ns[k][1]);
+	}
+	fclose(f);
+}
+
+void print_profile(const profile_t *p) {
+	for (int s=0; s<STRATEGY_COUNT; s++) {
+		fprintf(stderr, "%-16s %8.1f ns/pixel, %6.0f ms per image\n", strategies[s].name,
+				p->strategy_ns[s], p->strategy_ns[s]*EPD_W*EPD_H/1000000.0);
+	}
+	fprintf(stderr, "Kernels, with fs-rgb:   raster     serpentine\n");
+	for (int k=0; k<KERNEL_COUNT; k++) {
+		fprintf(stderr, "%-16s %8.1f ns/pixel %8.1f ns/pixel\n", kernels[k].name,
+				p->kernel_ns[k][0], p->kernel_ns[k][1]);
+	}
+}
+
+//Default profile: profile-<hostname>.txt, next to the conv binary.
+void default_profile_name(const char *argv0, char *buf, int len) {
+	char host[64]="";
+	gethostname(host, sizeof(host)-1);
+	const char *slash=strrchr(argv0, '/');
+	int dirlen=slash?(slash-argv0+1):0;
+	snprintf(buf, len, "%.*sprofile-%s.txt", dirlen, argv0, host);
+}
+
+//Output takes some time too; keep this much of the budget for it.
+#define OUTPUT_RESERVE_MS 15
+#define PREVIEW_RESERVE_MS 40
+//Predictions are off by some; things like another process on the CPU.
+#define SAFETY_FACTOR 1.25
+
+//Picks the best strategy that's expected to be done within budget_ms using kernel k. If none
+//are, that's the fastest one.
+const strategy_t *pick_strategy(const profile_t *p, const kernel_t *k, int serpentine, double budget_ms, double *predicted_ms) {
+	const strategy_t *fastest=&strategies[0];
+	for (int s=0; s<STRATEGY_COUNT; s++) {
+		double ms=profile_ns(p, &strategies[s], k, serpentine)*EPD_W*EPD_H/1000000.0;
+		if (ms*SAFETY_FACTOR<=budget_ms) {
+			*predicted_ms=ms;
+			return &strategies[s];
+		}
+		if (ms<profile_ns(p, fastest, k, serpentine)*EPD_W*EPD_H/1000000.0) fastest=&strategies[s];
+	}
+	*predicted_ms=profile_ns(p, fastest, k, serpentine)*EPD_W*EPD_H/1000000.0;
+	return fastest;
+}
+
+//Makes the colors more (or less) saturated, by moving every pixel away from its luminance.
+void saturate(float *pixels, int npix, float saturation) {
+	for (int i=0; i<npix; i++) {
+		float *p=&pixels[i*3];
+		float lum=p[0]*0.2126f+p[1]*0.7152f+p[2]*0.0722f;
+		for (int j=0; j<3; j++) p[j]=clamp(lum+(p[j]-lum)*saturation, 0, 1);
+	}
+}
+
+//Gaussian blur of EPD_W*EPD_H [rgb] floats, in place; tmp is scratch space of the same size.
+void blur(float *pixels, float *tmp, float sigma) {
+	if (sigma<=0) return;
+	int r=ceilf(sigma*3);
+	float k[r+1];
+	float sum=0;
+	for (int d=0; d<=r; d++) {
+		k[d]=expf(-(d*d)/(2*sigma*sigma));
+		sum+=(d==0)?k[d]:2*k[d];
+	}
+	for (int d=0; d<=r; d++) k[d]/=sum;
+	//Horizontal into tmp, then vertical back. Past the edges, the edge pixel repeats.
+	for (int y=0; y<EPD_H; y++) {
+		for (int x=0; x<EPD_W; x++) {
+			float acc[3]={0, 0, 0};
+			for (int d=-r; d<=r; d++) {
+				int sx=x+d;
+				if (sx<0) sx=0;
+				if (sx>=EPD_W) sx=EPD_W-1;
+				for (int j=0; j<3; j++) acc[j]+=k[abs(d)]*pixels[(sx+y*EPD_W)*3+j];
+			}
+			for (int j=0; j<3; j++) tmp[(x+y*EPD_W)*3+j]=acc[j];
+		}
+	}
+	for (int y=0; y<EPD_H; y++) {
+		for (int x=0; x<EPD_W; x++) {
+			float acc[3]={0, 0, 0};
+			for (int d=-r; d<=r; d++) {
+				int sy=y+d;
+				if (sy<0) sy=0;
+				if (sy>=EPD_H) sy=EPD_H-1;
+				for (int j=0; j<3; j++) acc[j]+=k[abs(d)]*tmp[(x+sy*EPD_W)*3+j];
+			}
+			for (int j=0; j<3; j++) pixels[(x+y*EPD_W)*3+j]=acc[j];
+		}
+	}
+}
+
+//Converts EPD_W*EPD_H [rgb] floats to Lab, in place.
+void image_to_lab(float *pixels) {
+	for (int i=0; i<EPD_W*EPD_H; i++) {
+		float lab[3];
+		rgb_to_lab(&pixels[i*3], lab);
+		memcpy(&pixels[i*3], lab, sizeof(lab));
+	}
+}
+
+//--best converts the image with a number of candidate settings at the same time, and keeps the
+//one that, seen from a distance (blurred), is closest to the original.
+#define MAX_CANDIDATES 32
+//kernel:strength:saturation[:serp], comma separated
+#define DEFAULT_CANDIDATES "floyd-steinberg:1:1,floyd-steinberg:0.8:1,floyd-steinberg:1:1.2," \
+		"jarvis:1:1,jarvis:1:1.2,stucki:1:1,atkinson:1:1,sierra-lite:1:1"
+//Sigma of the blur, in pixels. At a normal viewing distance, the eye can't make out single
+//pixels of the panel; about two of them blend together.
+#define VIEW_BLUR_SIGMA 1.5
+
+typedef struct {
+	char name[64];
+	const kernel_t *kernel;
+	int serpentine;
+	float strength;
+	float saturation;
+	uint8_t *idx;			//the result
+	double score;			//mean deltaE76 between it and the original, both blurred
+	double ms;
+} candidate_t;
+
+typedef struct {
+	const strategy_t *strategy;
+	const float *pixels;	//the image, as linear rgb
+	const float *ref_lab;	//the image, blurred, as Lab
+	float blur_sigma;
+	candidate_t *cand;
+	int count;
+	int next;
+	pthread_mutex_t mutex;
+} best_job_t;
+
+//Parses a --candidates list. Returns how many there are, or -1 if it doesn't make sense.
+int parse_candidates(const char *list, candidate_t *cand) {
+	char buf[1024];
+	snprintf(buf, sizeof(buf), "%s", list);
+	int count=0;
+	char *save;
+	for (char *t=strtok_r(buf, ",", &save); t; t=strtok_r(NULL, ",", &save)) {
+		if (count==MAX_CANDIDATES) return -1;
+		candidate_t *c=&cand[count];
+		memset(c, 0, sizeof(candidate_t));
+		snprintf(c->name, sizeof(c->name), "%s", t);
+		char kname[64], serp[8]="";
+		c->strength=1;
+		c->saturation=1;
+		int n=sscanf(t, "%63[^:]:%f:%f:%7s", kname, &c->strength, &c->saturation, serp);
+		if (n<1 || c->strength<0 || c->strength>1 || c->saturation<0 || c->saturation>2.5) return -1;
+		if (n==4 && strcmp(serp, "serp")!=0) return -1;
+		c->serpentine=(n==4);
+		for (int k=0; k<KERNEL_COUNT; k++) {
+			if (strcmp(kname, kernels[k].name)==0) c->kernel=&kernels[k];
+		}
+		if (!c->kernel) return -1;
+		count++;
+	}
+	return count;
+}
+
+void *best_worker(void *arg) {
+	best_job_t *job=(best_job_t*)arg;
+	float *work=malloc(EPD_W*EPD_H*3*sizeof(float));
+	float *tmp=malloc(EPD_W*EPD_H*3*sizeof(float));
+	assert(work && tmp);
+	while (1) {
+		pthread_mutex_lock(&job->mutex);
+		int i=job->next++;
+		pthread_mutex_unlock(&job->mutex);
+		if (i>=job->count) break;
+		candidate_t *c=&job->cand[i];
+		double start=now_ms();
+		memcpy(work, job->pixels, EPD_W*EPD_H*3*sizeof(float));
+		if (c->saturation!=1) saturate(work, EPD_W*EPD_H, c->saturation);
+		dither(job->strategy, c->kernel, c->serpentine, c->strength, work, EPD_W, EPD_H, c->idx);
+		//What it looks like on the panel, from a distance
+		for (int p=0; p<EPD_W*EPD_H; p++) {
+			for (int j=0; j<3; j++) work[p*3+j]=epd_colors[c->idx[p]][j];
+		}
+		blur(work, tmp, job->blur_sigma);
+		image_to_lab(work);
+		double sum=0;
+		for (int p=0; p<EPD_W*EPD_H*3; p+=3) {
+			float dl=work[p]-job->ref_lab[p], da=work[p+1]-job->ref_lab[p+1], db=work[p+2]-job->ref_lab[p+2];
+			sum+=sqrtf(dl*dl+da*da+db*db);
+		}
+		c->score=sum/(EPD_W*EPD_H);
+		c->ms=now_ms()-start;
+	}
+	free(work);
+	free(tmp);
+	return NULL;
+}
+
+//Runs all candidates on the image, as many at the same time as there are CPUs. Returns the best.
+candidate_t *run_candidates(const strategy_t *strategy, const float *pixels, candidate_t *cand, int count, float blur_sigma) {
+	//The original, as it should look from a distance
+	float *ref=malloc(EPD_W*EPD_H*3*sizeof(float));
+	float *tmp=malloc(EPD_W*EPD_H*3*sizeof(float));
+	assert(ref && tmp);
+	memcpy(ref, pixels, EPD_W*EPD_H*3*sizeof(float));
+	blur(ref, tmp, blur_sigma);
+	image_to_lab(ref);
+	free(tmp);
+
+	best_job_t job={
+		.strategy=strategy,
+		.pixels=pixels,
+		.ref_lab=ref,
+		.blur_sigma=blur_sigma,
+		.cand=cand,
+		.count=count,
+	};
+	pthread_mutex_init(&job.mutex, NULL);
+	for (int i=0; i<count; i++) {
+		cand[i].idx=malloc(EPD_W*EPD_H);
+		assert(cand[i].idx);
+	}
+	int threads=sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads>count) threads=count;
+	if (threads<1) threads=1;
+	pthread_t tid[threads];
+	for (int i=0; i<threads; i++) pthread_create(&tid[i], NULL, best_worker, &job);
+	for (int i=0; i<threads; i++) pthread_join(tid[i], NULL);
+	pthread_mutex_destroy(&job.mutex);
+	free(ref);
+
+	candidate_t *best=&cand[0];
+	for (int i=1; i<count; i++) {
+		if (cand[i].score<best->score) best=&cand[i];
+	}
+	return best;
+}
+
+//Loads an earlier conv output into bin. Returns 0 if the file isn't one.
+int load_bin(const char *filename, flash_image_t *bin) {
+	FILE *f=fopen(filename, "rb");
+	if (!f) return 0;
+	size_t len=sizeof(flash_image_t)-sizeof(bin->padding);
+	size_t n=fread(bin, 1, len, f);
+	fclose(f);
+	return (n==len && bin->hdr.id==0xfafa1a1a);
+}
+
+//Gets the palette index of every pixel, as seen by the viewer, from EPD binary data.
+//Even pixels are in the high nibble.
+void unpack(const uint8_t *data, uint8_t *idx) {
+	for (int y=0; y<EPD_H; y++) {
+		for (int x=0; x<EPD_W; x++) {
+#if EPD_UPSIDE_DOWN
+			int p=(EPD_H-1-y)*EPD_W+(EPD_W-1-x);
+#else
+			int p=y*EPD_W+x;
+#endif
+			idx[x+y*EPD_W]=(p&1)?(data[p/2]&0xf):(data[p/2]>>4);
+		}
+	}
+}
+
 int main(int argc, char **argv) {
+	double start_ms=now_ms();
 	char *im_in="";
 	char *im_out="";
 	char *bin_out="";
+	char *profile="";
+	int deadline=0;
+	const strategy_t *strategy=&strategies[0];
+	int do_calibrate=0;
+	int do_bench=0;
+	const kernel_t *kernel=&kernels[0];
+	int serpentine=0;
+	int flip=0;
+	float strength=1;
+	float saturation=1;
+	int do_best=0;
+	const char *candidates=DEFAULT_CANDIDATES;
+	float blur_sigma=VIEW_BLUR_SIGMA;
+	int verbose=0;
 	int error=0;
 	//Find & parse command line arguments
 	for (int i=1; i<argc; i++) {
@@ -234,65 +855,238 @@ int main(int argc, char **argv) {
 			if (bin_out[0]!=0) error=1;
 			i++;
 			bin_out=argv[i];
+		} else if (strcmp(argv[i], "--deadline")==0 && i<argc-1) {
+			i++;
+			deadline=atoi(argv[i]);
+			if (deadline<=0 || deadline>65535) error=1;
+		} else if (strcmp(argv[i], "--strategy")==0 && i<argc-1) {
+			i++;
+			strategy=NULL;
+			for (int s=0; s<STRATEGY_COUNT; s++) {
+				if (strcmp(argv[i], strategies[s].name)==0) strategy=&strategies[s];
+			}
+			if (!strategy) error=1;
+		} else if (strcmp(argv[i], "--profile")==0 && i<argc-1) {
+			i++;
+			profile=argv[i];
+		} else if (strcmp(argv[i], "--kernel")==0 && i<argc-1) {
+			i++;
+			kernel=NULL;
+			for (int k=0; k<KERNEL_COUNT; k++) {
+				if (strcmp(argv[i], kernels[k].name)==0) kernel=&kernels[k];
+			}
+			if (!kernel) error=1;
+		} else if (strcmp(argv[i], "--serpentine")==0) {
+			serpentine=1;
+		} else if (strcmp(argv[i], "--calibrate")==0) {
+			do_calibrate=1;
+		} else if (strcmp(argv[i], "--bench")==0) {
+			do_bench=1;
+		} else if (strcmp(argv[i], "--strength")==0 && i<argc-1) {
+			i++;
+			strength=atof(argv[i]);
+			if (strength<0 || strength>1) error=1;
+		} else if (strcmp(argv[i], "--saturation")==0 && i<argc-1) {
+			i++;
+			saturation=atof(argv[i]);
+			if (saturation<0 || saturation>2.5) error=1;
+		} else if (strcmp(argv[i], "--best")==0) {
+			do_best=1;
+		} else if (strcmp(argv[i], "--candidates")==0 && i<argc-1) {
+			i++;
+			candidates=argv[i];
+			do_best=1;
+		} else if (strcmp(argv[i], "--view-blur")==0 && i<argc-1) {
+			i++;
+			blur_sigma=atof(argv[i]);
+		} else if (strcmp(argv[i], "--flip")==0) {
+			flip=1;
+		} else if (strcmp(argv[i], "-v")==0) {
+			verbose=1;
 		} else {
 			if (im_in[0]!=0) error=1;
 			im_in=argv[i];
 		}
 	}
-	if (im_in[0]==0 || error) {
-		printf("Usage: %s [-o outfile.bin] [-p preview.png] infile.[jpg|png]\n", argv[0]);
+	candidate_t cand[MAX_CANDIDATES];
+	int cand_count=0;
+	if (do_best) {
+		cand_count=parse_candidates(candidates, cand);
+		if (cand_count<1 || deadline) error=1;
+	}
+	if (deadline && strategy!=&strategies[0]) error=1;
+	if ((im_in[0]==0 && !do_calibrate) || error) {
+		printf("Usage: %s [-o outfile.bin] [-p preview.png] [--kernel name] [--serpentine]\n", argv[0]);
+		printf("          [--strength 0..1] [--saturation 0..2.5] [--strategy name | --deadline ms]\n");
+		printf("          [--profile file]\n");
+		printf("          [--flip] [-v] infile.[jpg|png|bin]\n");
+		printf("       %s --best [--candidates list] [--view-blur sigma] [-o ...] [-p ...] infile\n", argv[0]);
+		printf("       %s --calibrate [--profile file]\n", argv[0]);
+		printf("       %s --bench infile.[jpg|png]\n", argv[0]);
 		printf("infile can be png or jpeg; if no outfile is given, output will go to stdout\n");
+		printf("infile can also be an earlier output, to make a preview from or to --flip (turn\n");
+		printf("upside down). A 600x448 image in only the preview colors is used without dithering.\n");
+		printf("--kernel sets the error diffusion kernel:");
+		for (int k=0; k<KERNEL_COUNT; k++) printf(" %s", kernels[k].name);
+		printf("\n(default %s); --serpentine scans every other row right to left.\n", kernels[0].name);
+		printf("--strategy sets how colors are picked, best and slowest first:\n");
+		for (int s=0; s<STRATEGY_COUNT; s++) printf("%s%s", s?" ":"", strategies[s].name);
+		printf("\n");
+		printf("--deadline picks the best strategy that should be done in that many ms, using the\n");
+		printf("per-pixel times in the profile (profile-<hostname>.txt next to conv by default).\n");
+		printf("It's measured first if it doesn't exist; --calibrate measures it again.\n");
+		printf("--best converts with all candidates (kernel:strength:saturation[:serp], comma\n");
+		printf("separated) in parallel, and writes the one closest to the original when blurred\n");
+		printf("like seen from a distance. It prints the scores to stderr. Default candidates:\n");
+		printf("%s\n", DEFAULT_CANDIDATES);
 		exit(error);
 	}
 
-	//Load image
-	gdImagePtr im=load_scaled(im_in);
-	if (!im) {
-		fprintf(stderr, "Could not load image %s\n", im_in);
-		exit(1);
+	init_colors();
+
+	char profile_buf[1024];
+	if (profile[0]==0) {
+		default_profile_name(argv[0], profile_buf, sizeof(profile_buf));
+		profile=profile_buf;
+	}
+	profile_t prof;
+	if (do_calibrate || (deadline && !load_profile(profile, &prof))) {
+		calibrate(&prof);
+		save_profile(profile, &prof);
+		if (do_calibrate) {
+			print_profile(&prof);
+			if (im_in[0]==0) exit(0);
+		}
 	}
 
 	flash_image_t *bin=calloc(sizeof(flash_image_t), 1);
 	assert(bin);
-	bin->hdr.id=0xfafa1a1a; //magic header
-	bin->hdr.timestamp=time(NULL);
-	
-	//RGB colors as displayed on the screen
-	//These are calculated by grabbing a test pattern which shows all colors, taking a picture,
-	//then using an image editor to max out the levels for max contrast & saturation, then taking
-	//the linear (not SRGB) RGB values and putting them here.
-	float epd_colors[7][3]={ //rgb
-		{0,0,0},
-		{1,1,1},
-		{0.059, 0.329, 0.119},
-		{0.061, 0.147, 0.336},
-		{0.574, 0.066, 0.010},
-		{0.982, 0.756, 0.004},
-		{0.795, 0.255, 0.018},
-	};
+	uint8_t *idx=malloc(EPD_W*EPD_H);
+	assert(idx);
+	const char *how="";
 
-	//Convert float RGB colors to int colors for putting on the preview png
-	int epd_colors_int[7];
-	for (int i=0; i<7; i++) {
-		int c=0;
-		for (int j=0; j<3; j++) {
-			int pc=epd_colors[i][j]*255;
-			c=(c<<8)|pc;
+	int have_idx=0;
+	if (load_bin(im_in, bin)) {
+		//An earlier output. Keep its header; it says how the image was made.
+		if (do_bench) {
+			fprintf(stderr, "%s: --bench needs an image to dither\n", im_in);
+			exit(1);
 		}
-		epd_colors_int[i]=c;
+		unpack(bin->data, idx);
+		how="an earlier output";
+		have_idx=1;
+	} else {
+		memset(bin, 0, sizeof(flash_image_t));
+		bin->hdr.id=0xfafa1a1a; //magic header
+		bin->hdr.timestamp=time(NULL);
 	}
 
-	//Convert image to an array of floats so we can Floyd-Steinberg without limiting ourselves
-	//to the range of ints
-	float *pixels=calloc(EPD_W*EPD_H*3, sizeof(float));
-	assert(pixels);
-	float *pixelp=pixels;
-	for (int y=0; y<EPD_H; y++) {
-		for (int x=0; x<EPD_W; x++) {
-			int c=gdImageGetPixel(im,x,y);
-			*pixelp++=gamma_linear(((c>>16)&0xff)/255.0);
-			*pixelp++=gamma_linear(((c>>8)&0xff)/255.0);
-			*pixelp++=gamma_linear(((c>>0)&0xff)/255.0);
+	//Load image
+	gdImagePtr im=NULL;
+	if (!have_idx) {
+		im=load_image(im_in);
+		if (im && !do_bench && palette_indexes(im, idx)) {
+			bin->hdr.strategy=STRATEGY_PASSTHROUGH;
+			how="palette colors as they are";
+			have_idx=1;
+		} else if (im) {
+			im=scale_image(im);
+		}
+		if (!im) {
+			fprintf(stderr, "Could not load image %s\n", im_in);
+			exit(1);
+		}
+	}
+
+	if (!have_idx) {
+		//Convert image to an array of floats so we can Floyd-Steinberg without limiting ourselves
+		//to the range of ints
+		float *pixels=calloc(EPD_W*EPD_H*3, sizeof(float));
+		assert(pixels);
+		float *pixelp=pixels;
+		for (int y=0; y<EPD_H; y++) {
+			for (int x=0; x<EPD_W; x++) {
+				int c=gdImageGetPixel(im,x,y);
+				*pixelp++=gamma_linear(((c>>16)&0xff)/255.0);
+				*pixelp++=gamma_linear(((c>>8)&0xff)/255.0);
+				*pixelp++=gamma_linear(((c>>0)&0xff)/255.0);
+			}
+		}
+
+		if (do_bench) {
+			//Time every kernel on this image, with all the strategies that dither
+			float *work=malloc(EPD_W*EPD_H*3*sizeof(float));
+			uint8_t *out=malloc(EPD_W*EPD_H);
+			assert(work && out);
+			fprintf(stderr, "%-28s", "");
+			for (int s=0; s<STRATEGY_COUNT; s++) {
+				if (strategies[s].dither) fprintf(stderr, " %12s", strategies[s].name);
+			}
+			fprintf(stderr, "\n");
+			for (int k=0; k<KERNEL_COUNT; k++) {
+				for (int serp=0; serp<2; serp++) {
+					char name[64];
+					snprintf(name, sizeof(name), "%s%s", kernels[k].name, serp?" serpentine":"");
+					fprintf(stderr, "%-28s", name);
+					for (int s=0; s<STRATEGY_COUNT; s++) {
+						if (!strategies[s].dither) continue;
+						memcpy(work, pixels, EPD_W*EPD_H*3*sizeof(float));
+						double t=now_ms();
+						dither(&strategies[s], &kernels[k], serp, 1, work, EPD_W, EPD_H, out);
+						fprintf(stderr, " %9.1f ms", now_ms()-t);
+					}
+					fprintf(stderr, "\n");
+				}
+			}
+			exit(0);
+		}
+
+		if (deadline) {
+			//Decoding and scaling are done; see what's left for the dithering.
+			double elapsed=now_ms()-start_ms;
+			double budget=deadline-elapsed-OUTPUT_RESERVE_MS-(im_out[0]?PREVIEW_RESERVE_MS:0);
+			double predicted;
+			strategy=pick_strategy(&prof, kernel, serpentine, budget, &predicted);
+			if (verbose) {
+				fprintf(stderr, "%.0f ms used for loading, %.0f ms left; %s should take %.0f ms\n",
+						elapsed, budget, strategy->name, predicted);
+			}
+		}
+		how=strategy->name;
+		if (do_best) {
+			candidate_t *win=run_candidates(strategy, pixels, cand, cand_count, blur_sigma);
+			fprintf(stderr, "   score       time  candidate (score: mean deltaE76 seen from a distance, lower is better)\n");
+			for (int i=0; i<cand_count; i++) {
+				fprintf(stderr, "%8.3f %7.0f ms  %s%s\n", cand[i].score, cand[i].ms, cand[i].name,
+						(&cand[i]==win)?"  <- best":"");
+			}
+			kernel=win->kernel;
+			serpentine=win->serpentine;
+			strength=win->strength;
+			saturation=win->saturation;
+			memcpy(idx, win->idx, EPD_W*EPD_H);
+			how=win->name;
+		} else {
+			if (saturation!=1) saturate(pixels, EPD_W*EPD_H, saturation);
+			dither(strategy, kernel, serpentine, strength, pixels, EPD_W, EPD_H, idx);
+		}
+		bin->hdr.strategy=strategy->id;
+		if (strategy->dither) {
+			bin->hdr.kernel=kernel->id|(serpentine?KERNEL_SERPENTINE:0);
+			bin->hdr.strength=lrintf(strength*100);
+		}
+		bin->hdr.saturation=lrintf(saturation*100);
+		bin->hdr.deadline_ms=deadline;
+		free(pixels);
+	}
+	if (im) gdImageDestroy(im);
+
+	if (flip) {
+		//Turning it upside down is reversing the order of the pixels
+		for (int i=0; i<EPD_W*EPD_H/2; i++) {
+			uint8_t t=idx[i];
+			idx[i]=idx[EPD_W*EPD_H-1-i];
+			idx[EPD_W*EPD_H-1-i]=t;
 		}
 	}
 
@@ -302,25 +1096,7 @@ int main(int argc, char **argv) {
 	for (int y=0; y<EPD_H; y++) {
 		int ob=0;
 		for (int x=0; x<EPD_W; x++) {
-			//Find closest color for this pixel from the palette the epd can display
-			int best=0;
-			float best_dif=999999999;
-			for (int i=0; i<7; i++) {
-				float d=col_diff(&pixels[(x+y*EPD_W)*3], epd_colors[i]);
-				if (d<best_dif) {
-					best_dif=d;
-					best=i;
-				}
-			}
-			
-			//Distribute difference between chosen and ideal color using Floyd-Steinberg
-			for (int i=0; i<3; i++) {
-				float dif=pixels[(x+y*EPD_W)*3+i] - epd_colors[best][i];
-				dist_diff(pixels, x+1, y, i, (dif/16.0)*7.0);
-				dist_diff(pixels, x-1, y+1, i, (dif/16.0)*3.0);
-				dist_diff(pixels, x, y+1, i, (dif/16.0)*5.0);
-				dist_diff(pixels, x+1, y+1, i, (dif/16.0)*1.0);
-			}
+			int best=idx[x+y*EPD_W];
 //			best=((x*14)/448)%7; //uncomment for test image
 			//Set byte in output EPD binary data
 #if EPD_UPSIDE_DOWN
@@ -352,6 +1128,9 @@ int main(int argc, char **argv) {
 		fclose(of);
 	}
 	gdImageDestroy(tim);
+	double conv_ms=now_ms()-start_ms;
+	if (bin->hdr.conv_ms==0) bin->hdr.conv_ms=(conv_ms>65535)?65535:conv_ms;
+	if (verbose) fprintf(stderr, "Converted with %s in %.0f ms\n", how, conv_ms);
 	if (bin_out[0]) {
 		//Write binary output to file
 		FILE *of=fopen(bin_out, "wb");
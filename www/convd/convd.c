@@ -0,0 +1,511 @@
+/*
+convd: converts uploads in the background, so upload.php doesn't have to sit on a conv
+process and a MySQL connection for as long as the conversion takes. An upload comes in as
+a job; it gets a quick preview (plain nearest-color, no dithering) and a job id right away,
+and a worker converts it properly and stores it in the database when it gets to it.
+
+Jobs go in one of two lanes: interactive (someone is waiting on the web page) and bulk
+(batch imports). Workers always take interactive jobs first and bulk jobs can't take the
+last worker. When a lane has as many jobs waiting as it takes, new uploads for it get a 503
+with a Retry-After instead of piling up. See README.md for how to run it.
+
+Usage: convd [-p port] [-c config.php] [-d docroot] [-H dbhost] [-s spooldir] [-C conv]
+             [-w workers per core] [-q interactive queue] [-Q bulk queue]
+             [-I "interactive conv options"] [-B "bulk conv options"]
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "convd.h"
+
+#define HDR_MAX 8192
+//Biggest upload we take. Phone photos are a few MB.
+#define MAX_UPLOAD (32*1024*1024)
+//Connections handled at the same time; more get a 503.
+#define MAX_CONNS 64
+//Seconds to wait for a client before giving up on it
+#define CLIENT_TIMEOUT 30
+//What a full lane tells clients to wait before trying again, in seconds
+#define RETRY_AFTER 10
+
+config_t cfg;
+
+static const char *lane_names[LANES]={"interactive", "bulk"};
+static const char *state_names[]={"queued", "converting", "done", "failed"};
+static int conn_count;
+static pthread_mutex_t conn_lock=PTHREAD_MUTEX_INITIALIZER;
+//Previews are made by the connection threads, but no more at a time than there are workers.
+static sem_t preview_sem;
+
+typedef struct {
+	int fd;
+	char buf[HDR_MAX];
+	int len;				//bytes in buf
+	int body;				//where the body starts in buf
+} conn_t;
+
+static int write_all(int fd, const char *p, size_t len) {
+	while (len) {
+		ssize_t n=write(fd, p, len);
+		if (n<=0) return 0;
+		p+=n;
+		len-=n;
+	}
+	return 1;
+}
+
+//Sends a whole response, with optional extra header lines (each ending in \r\n).
+static void respond_hdrs(int fd, int code, const char *type, const char *hdrs, const char *body, int body_len) {
+	const char *status=(code==200)?"OK":(code==202)?"Accepted":(code==404)?"Not Found":
+			(code==413)?"Payload Too Large":(code==503)?"Service Unavailable":"Bad Request";
+	char hdr[512];
+	int len=snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %d\r\n"
+			"%s"
+			"Connection: close\r\n"
+			"\r\n", code, status, type, body_len, hdrs);
+	if (write_all(fd, hdr, len) && body_len) write_all(fd, body, body_len);
+}
+
+static void respond(int fd, int code, const char *type, const char *body, int body_len) {
+	respond_hdrs(fd, code, type, "", body, body_len);
+}
+
+static void error_response(int fd, int code) {
+	respond(fd, code, "text/plain", "", 0);
+}
+
+static void busy_response(int fd) {
+	char hdrs[64];
+	snprintf(hdrs, sizeof(hdrs), "Retry-After: %d\r\n", RETRY_AFTER);
+	respond_hdrs(fd, 503, "text/plain", hdrs, "", 0);
+}
+
+//Finds a query parameter and URL-decodes it.
+static int get_param(const char *query, const char *name, char *val, int len) {
+	int nlen=strlen(name);
+	const char *p=query;
+	while (p && *p) {
+		if (strncmp(p, name, nlen)==0 && p[nlen]=='=') {
+			p+=nlen+1;
+			int i=0;
+			while (*p && *p!='&' && i<len-1) {
+				if (*p=='%' && p[1] && p[2]) {
+					char hex[3]={p[1], p[2], 0};
+					val[i++]=strtol(hex, NULL, 16);
+					p+=3;
+				} else {
+					val[i++]=(*p=='+')?' ':*p;
+					p++;
+				}
+			}
+			val[i]=0;
+			return 1;
+		}
+		p=strchr(p, '&');
+		if (p) p++;
+	}
+	return 0;
+}
+
+static char *base64(const uint8_t *in, size_t len, size_t *out_len) {
+	static const char tab[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char *out=malloc((len+2)/3*4+1);
+	if (!out) return NULL;
+	char *p=out;
+	for (size_t i=0; i<len; i+=3) {
+		uint32_t v=in[i]<<16;
+		if (i+1<len) v|=in[i+1]<<8;
+		if (i+2<len) v|=in[i+2];
+		*p++=tab[(v>>18)&63];
+		*p++=tab[(v>>12)&63];
+		*p++=(i+1<len)?tab[(v>>6)&63]:'=';
+		*p++=(i+2<len)?tab[v&63]:'=';
+	}
+	*p=0;
+	*out_len=p-out;
+	return out;
+}
+
+//Reads a whole (small) file. Returns NULL if it can't.
+static uint8_t *read_file(const char *name, size_t *len) {
+	FILE *f=fopen(name, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	long size=ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *buf=(size>0)?malloc(size):NULL;
+	if (buf && fread(buf, 1, size, f)!=(size_t)size) {
+		free(buf);
+		buf=NULL;
+	}
+	fclose(f);
+	*len=size;
+	return buf;
+}
+
+//Writes the request body to the spool file of a job.
+static int spool_body(conn_t *c, const char *name, long len) {
+	int fd=open(name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd<0) {
+		perror(name);
+		return 0;
+	}
+	long have=c->len-c->body;
+	if (have>len) have=len;
+	int ok=write_all(fd, c->buf+c->body, have);
+	char buf[65536];
+	while (ok && have<len) {
+		long want=len-have;
+		if (want>(long)sizeof(buf)) want=sizeof(buf);
+		ssize_t n=read(c->fd, buf, want);
+		if (n<=0) break;
+		ok=write_all(fd, buf, n);
+		have+=n;
+	}
+	close(fd);
+	return ok && have==len;
+}
+
+static void handle_post_job(conn_t *c, const char *query, long content_len) {
+	char val[128]="";
+	int lane=LANE_INTERACTIVE;
+	if (get_param(query, "lane", val, sizeof(val))) {
+		if (strcmp(val, "bulk")==0) {
+			lane=LANE_BULK;
+		} else if (strcmp(val, "interactive")!=0) {
+			error_response(c->fd, 400);
+			return;
+		}
+	}
+	char name[128]="";
+	get_param(query, "name", name, sizeof(name));
+	if (content_len<=0) {
+		error_response(c->fd, 400);
+		return;
+	}
+	if (content_len>MAX_UPLOAD) {
+		error_response(c->fd, 413);
+		return;
+	}
+	//Say no before taking the upload, not after
+	if (!queue_has_room(lane)) {
+		busy_response(c->fd);
+		return;
+	}
+
+	int id=queue_new_id();
+	char in[512], png[512];
+	spool_path(in, sizeof(in), id, "in");
+	spool_path(png, sizeof(png), id, "png");
+	if (!spool_body(c, in, content_len)) {
+		unlink(in);
+		error_response(c->fd, 400);
+		return;
+	}
+
+	sem_wait(&preview_sem);
+	int ok=run_conv(cfg.preview_args, in, "/dev/null", png);
+	sem_post(&preview_sem);
+	size_t png_len=0, b64_len=0;
+	uint8_t *png_data=ok?read_file(png, &png_len):NULL;
+	unlink(png);
+	char *b64=png_data?base64(png_data, png_len, &b64_len):NULL;
+	free(png_data);
+	char resp[256];
+	int len;
+	if (!b64) {
+		//Not an image conv can read; it won't do any better in a worker.
+		unlink(in);
+		len=snprintf(resp, sizeof(resp), "{\"job\":%d,\"state\":\"failed\"}", id);
+		respond(c->fd, 400, "text/json", resp, len);
+		return;
+	}
+	int position=0;
+	job_t j;
+	if (!queue_add(id, lane, name) || !queue_get(id, &j, &position)) {
+		//Filled up while we were making the preview
+		unlink(in);
+		free(b64);
+		busy_response(c->fd);
+		return;
+	}
+	len=snprintf(resp, sizeof(resp), "{\"job\":%d,\"lane\":\"%s\",\"state\":\"%s\",\"position\":%d,\"preview\":\"",
+			id, lane_names[lane], state_names[j.state], position);
+	char *body=malloc(len+b64_len+2);
+	if (body) {
+		memcpy(body, resp, len);
+		memcpy(body+len, b64, b64_len);
+		memcpy(body+len+b64_len, "\"}", 2);
+		respond(c->fd, 202, "text/json", body, len+b64_len+2);
+	}
+	free(body);
+	free(b64);
+}
+
+static void handle_get_job(conn_t *c, const char *id_str) {
+	job_t j;
+	int position;
+	if (!queue_get(atoi(id_str), &j, &position)) {
+		error_response(c->fd, 404);
+		return;
+	}
+	char resp[256];
+	int len=snprintf(resp, sizeof(resp), "{\"job\":%d,\"lane\":\"%s\",\"state\":\"%s\",\"position\":%d,\"image_id\":%d}",
+			j.id, lane_names[j.lane], state_names[j.state], position, j.image_id);
+	respond(c->fd, 200, "text/json", resp, len);
+}
+
+static void handle_status(conn_t *c) {
+	int queued[LANES], busy[LANES];
+	queue_stats(queued, busy);
+	char resp[256];
+	int len=snprintf(resp, sizeof(resp), "{\"workers\":%d,\"interactive\":{\"queued\":%d,\"converting\":%d},"
+			"\"bulk\":{\"queued\":%d,\"converting\":%d}}", cfg.workers,
+			queued[LANE_INTERACTIVE], busy[LANE_INTERACTIVE], queued[LANE_BULK], busy[LANE_BULK]);
+	respond(c->fd, 200, "text/json", resp, len);
+}
+
+static void handle_request(conn_t *c) {
+	//Read until we have the whole header
+	char *end=NULL;
+	while (!end) {
+		if (c->len==HDR_MAX-1) {
+			error_response(c->fd, 400);
+			return;
+		}
+		ssize_t n=read(c->fd, c->buf+c->len, HDR_MAX-1-c->len);
+		if (n<=0) return;
+		c->len+=n;
+		c->buf[c->len]=0;
+		end=strstr(c->buf, "\r\n\r\n");
+	}
+	*end=0;
+	c->body=end+4-c->buf;
+
+	char *hdrs=strstr(c->buf, "\r\n");
+	if (hdrs) *hdrs++=0;
+	char *method=c->buf;
+	char *path=strchr(method, ' ');
+	if (!path) {
+		error_response(c->fd, 400);
+		return;
+	}
+	*path++=0;
+	char *sp=strchr(path, ' ');
+	if (sp) *sp=0;
+	char *query=strchr(path, '?');
+	if (query) *query++=0;
+	long content_len=-1;
+	for (char *h=hdrs; h && *h; ) {
+		char *next=strstr(h, "\r\n");
+		if (next) *next=0;
+		if (strncasecmp(h, "Content-Length:", 15)==0) content_len=atol(h+15);
+		h=next?next+2:NULL;
+	}
+
+	if (strcmp(method, "POST")==0 && strcmp(path, "/jobs")==0) {
+		handle_post_job(c, query?query:"", content_len);
+	} else if (strcmp(method, "GET")==0 && strncmp(path, "/jobs/", 6)==0) {
+		handle_get_job(c, path+6);
+	} else if (strcmp(method, "GET")==0 && strcmp(path, "/status")==0) {
+		handle_status(c);
+	} else {
+		error_response(c->fd, 404);
+	}
+}
+
+static void *conn_thread(void *arg) {
+	conn_t *c=arg;
+	handle_request(c);
+	close(c->fd);
+	free(c);
+	pthread_mutex_lock(&conn_lock);
+	conn_count--;
+	pthread_mutex_unlock(&conn_lock);
+	return NULL;
+}
+
+//Grabs the value of a PHP variable assignment like $pass="secret"; or $ms=800; out of config.php.
+static char *php_var(const char *conf, const char *name) {
+	char pat[64];
+	snprintf(pat, sizeof(pat), "$%s", name);
+	const char *p=conf;
+	while ((p=strstr(p, pat))) {
+		p+=strlen(pat);
+		while (*p==' ' || *p=='\t') p++;
+		if (*p!='=') continue;
+		p++;
+		while (*p==' ' || *p=='\t') p++;
+		if (*p!='"' && *p!='\'') return strndup(p, strcspn(p, "; \t\r\n"));
+		char q=*p++;
+		const char *e=strchr(p, q);
+		if (!e) return NULL;
+		return strndup(p, e-p);
+	}
+	return NULL;
+}
+
+//Splits conv options on spaces into a NULL-terminated list.
+static char **split_args(const char *s) {
+	char *copy=strdup(s);
+	int n=0;
+	char **args=calloc(strlen(s)/2+2, sizeof(char*));
+	for (char *t=strtok(copy, " "); t; t=strtok(NULL, " ")) args[n++]=t;
+	return args;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-p port] [-c config.php] [-d docroot] [-H dbhost] [-s spooldir] [-C conv]\n", name);
+	fprintf(stderr, "         [-w workers per core] [-q interactive queue] [-Q bulk queue]\n");
+	fprintf(stderr, "         [-I \"interactive conv options\"] [-B \"bulk conv options\"]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int port=8081;
+	int per_core=1;
+	const char *config_file=NULL;
+	const char *lane_opts[LANES]={NULL, ""};
+	cfg.docroot=".";
+	cfg.host="localhost";
+	cfg.spool="/tmp/convd";
+	cfg.conv="";
+	cfg.lane_max[LANE_INTERACTIVE]=32;
+	cfg.lane_max[LANE_BULK]=512;
+	int opt;
+	while ((opt=getopt(argc, argv, "p:c:d:H:s:C:w:q:Q:I:B:"))!=-1) {
+		if (opt=='p') port=atoi(optarg);
+		else if (opt=='c') config_file=optarg;
+		else if (opt=='d') cfg.docroot=optarg;
+		else if (opt=='H') cfg.host=optarg;
+		else if (opt=='s') cfg.spool=optarg;
+		else if (opt=='C') cfg.conv=optarg;
+		else if (opt=='w') per_core=atoi(optarg);
+		else if (opt=='q') cfg.lane_max[LANE_INTERACTIVE]=atoi(optarg);
+		else if (opt=='Q') cfg.lane_max[LANE_BULK]=atoi(optarg);
+		else if (opt=='I') lane_opts[LANE_INTERACTIVE]=optarg;
+		else if (opt=='B') lane_opts[LANE_BULK]=optarg;
+		else usage(argv[0]);
+	}
+	if (per_core<1 || cfg.lane_max[LANE_INTERACTIVE]<1 || cfg.lane_max[LANE_BULK]<1) usage(argv[0]);
+	char conf_path[512];
+	if (!config_file) {
+		snprintf(conf_path, sizeof(conf_path), "%s/config.php", cfg.docroot);
+		config_file=conf_path;
+	}
+	FILE *f=fopen(config_file, "r");
+	if (!f) {
+		perror(config_file);
+		exit(1);
+	}
+	char conf[4096];
+	size_t n=fread(conf, 1, sizeof(conf)-1, f);
+	conf[n]=0;
+	fclose(f);
+	cfg.db=php_var(conf, "db");
+	cfg.user=php_var(conf, "username");
+	cfg.pass=php_var(conf, "pass");
+	if (!cfg.db || !cfg.user || !cfg.pass) {
+		fprintf(stderr, "%s: need $db, $username and $pass\n", config_file);
+		exit(1);
+	}
+	//Interactive uploads get the same time budget upload.php gives conv
+	char deadline_opt[64]="";
+	if (!lane_opts[LANE_INTERACTIVE]) {
+		char *ms=php_var(conf, "conv_deadline_ms");
+		if (ms && atoi(ms)>0) snprintf(deadline_opt, sizeof(deadline_opt), "--deadline %d", atoi(ms));
+		lane_opts[LANE_INTERACTIVE]=deadline_opt;
+		free(ms);
+	}
+	for (int l=0; l<LANES; l++) cfg.lane_args[l]=split_args(lane_opts[l]);
+	cfg.preview_args[0]="--strategy";
+	cfg.preview_args[1]="nearest-rgb";
+	cfg.preview_args[2]=NULL;
+	//By default, conv is where it is in this tree: ../conv/conv from here.
+	char conv_buf[1024];
+	if (cfg.conv[0]==0) {
+		const char *slash=strrchr(argv[0], '/');
+		int dirlen=slash?(slash-argv[0]+1):0;
+		snprintf(conv_buf, sizeof(conv_buf), "%.*s../conv/conv", dirlen, argv[0]);
+		cfg.conv=conv_buf;
+	}
+	if (mkdir(cfg.spool, 0700)<0 && errno!=EEXIST) {
+		perror(cfg.spool);
+		exit(1);
+	}
+	cfg.workers=sysconf(_SC_NPROCESSORS_ONLN)*per_core;
+	//Bulk jobs never get the last worker, so there have to be at least two, even on one
+	//core: an interactive upload then shares the CPU instead of waiting for a bulk one.
+	if (cfg.workers<2) cfg.workers=2;
+	sem_init(&preview_sem, 0, cfg.workers);
+
+	signal(SIGPIPE, SIG_IGN);
+	//Only upload.php talks to us, so only listen locally.
+	int lfd=socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	int one=1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr={.sin_family=AF_INET, .sin_port=htons(port), .sin_addr.s_addr=htonl(INADDR_LOOPBACK)};
+	if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(lfd, 128)<0) {
+		perror("listen");
+		exit(1);
+	}
+	publish_init();
+	queue_start();
+	printf("convd listening on port %d, %d workers, conv %s\n", port, cfg.workers, cfg.conv);
+	fflush(stdout);
+
+	while (1) {
+		int fd=accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd<0) {
+			if (errno!=EINTR && errno!=ECONNABORTED) perror("accept");
+			continue;
+		}
+		struct timeval tv={.tv_sec=CLIENT_TIMEOUT};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		pthread_mutex_lock(&conn_lock);
+		int full=(conn_count>=MAX_CONNS);
+		if (!full) conn_count++;
+		pthread_mutex_unlock(&conn_lock);
+		if (full) {
+			busy_response(fd);
+			close(fd);
+			continue;
+		}
+		conn_t *c=calloc(1, sizeof(conn_t));
+		c->fd=fd;
+		pthread_t t;
+		if (!c || pthread_create(&t, NULL, conn_thread, c)!=0) {
+			free(c);
+			close(fd);
+			pthread_mutex_lock(&conn_lock);
+			conn_count--;
+			pthread_mutex_unlock(&conn_lock);
+			continue;
+		}
+		pthread_detach(t);
+	}
+	return 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+//Lanes, in the order the workers look at them.
+#define LANE_INTERACTIVE 0
+#define LANE_BULK 1
+#define LANES 2
+
+#define JOB_QUEUED 0
+#define JOB_CONVERTING 1
+#define JOB_DONE 2
+#define JOB_FAILED 3
+
+typedef struct job_t job_t;
+struct job_t {
+	int id;
+	int lane;
+	int state;
+	char name[128];			//orig_name in the images table
+	int image_id;			//once it's in the database
+	time_t finished;
+	job_t *qnext;			//next in its lane
+	job_t *next;			//all jobs we know about
+};
+
+typedef struct {
+	const char *conv;
+	char **lane_args[LANES];	//extra conv options per lane, NULL terminated
+	char *preview_args[4];
+	const char *spool;			//where uploads and conv output live until they're stored
+	const char *docroot;		//for syncd.stamp
+	int workers;
+	int lane_max[LANES];		//queued jobs a lane takes before new ones get a 503
+	const char *host;
+	const char *user;
+	const char *pass;
+	const char *db;
+} config_t;
+
+extern config_t cfg;
+
+//Starts the workers.
+void queue_start();
+//Hands out a job id, to name the spool files with before the job is queued.
+int queue_new_id();
+//True if the lane takes another job.
+int queue_has_room(int lane);
+//Queues a job for conversion. Returns NULL if the lane is full.
+job_t *queue_add(int id, int lane, const char *name);
+//Copies what we know about a job, and how many jobs are in front of it in its lane.
+//Returns 0 if there's no such job (anymore).
+int queue_get(int id, job_t *out, int *position);
+//How many jobs are waiting and being converted, per lane.
+void queue_stats(int *queued, int *busy);
+
+//Spool file of a job: <spool>/<id>.<ext>
+void spool_path(char *buf, int len, int id, const char *ext);
+//Runs conv with the given options, then the input and output files. Returns 1 if it worked.
+int run_conv(char *const *args, const char *in, const char *bin_out, const char *png_out);
+
+//Sets up the MySQL library. Has to be called before any of the threads that publish start.
+void publish_init();
+//Stores a converted image in the database, with block deltas from the images before it,
+//and touches syncd.stamp. Returns the image id, or 0 if it couldn't. Every thread that
+//calls this gets a database connection of its own.
+int publish(const char *name, const uint8_t *bin, size_t len);
@@ -0,0 +1,143 @@
+/*
+Stores finished conversions in the database, the same way upload.php does: the image in
+the images table, and block deltas from the images before it (see imgdelta.inc.php).
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <mysql.h>
+#include "epd_flash_image.h"
+#include "convd.h"
+
+//Same as IMG_DELTA_BASES in imgdelta.inc.php: how many earlier images to compare to.
+#define DELTA_BASES 20
+#define IMG_HDR_LEN sizeof(flash_image_hdr_t)
+#define IMG_DATA_LEN (600*448/2)
+
+//One connection per worker thread
+static __thread MYSQL *mysql;
+
+void publish_init() {
+	if (mysql_library_init(0, NULL, NULL)) {
+		fprintf(stderr, "db: could not initialize the MySQL library\n");
+		exit(1);
+	}
+}
+
+static int db_connect() {
+	if (mysql) return 1;
+	mysql=mysql_init(NULL);
+	if (!mysql_real_connect(mysql, cfg.host, cfg.user, cfg.pass, cfg.db, 0, NULL, 0)) {
+		fprintf(stderr, "db: connect failed: %s\n", mysql_error(mysql));
+		mysql_close(mysql);
+		mysql=NULL;
+		return 0;
+	}
+	return 1;
+}
+
+//Drops the connection after an error; the next db_connect() makes a new one.
+static void db_error(const char *what) {
+	fprintf(stderr, "db: %s: %s\n", what, mysql_error(mysql));
+	mysql_close(mysql);
+	mysql=NULL;
+}
+
+//Makes the delta from base to bin, like make_image_delta() in imgdelta.inc.php. Returns
+//its length, or 0 if it's not worth it (more than half the size of the image).
+static size_t make_delta(int id, const uint8_t *bin, int base_id, const uint8_t *base, uint8_t *out) {
+	img_delta_hdr_t hdr={
+		.magic=htole32(IMG_DELTA_MAGIC),
+		.id=htole32(id),
+		.base_id=htole32(base_id),
+		.block_size=htole32(IMG_DELTA_BLOCK)
+	};
+	memcpy(out, &hdr, sizeof(hdr));
+	memcpy(out+sizeof(hdr), bin, IMG_HDR_LEN);
+	uint8_t *bitmap=out+sizeof(hdr)+IMG_HDR_LEN;
+	memset(bitmap, 0, (IMG_DELTA_BLOCKS+7)/8);
+	size_t len=sizeof(hdr)+IMG_HDR_LEN+(IMG_DELTA_BLOCKS+7)/8;
+	size_t max=(IMG_HDR_LEN+IMG_DATA_LEN)/2;
+	for (int i=0; i<IMG_DELTA_BLOCKS; i++) {
+		const uint8_t *blk=bin+IMG_HDR_LEN+i*IMG_DELTA_BLOCK;
+		if (memcmp(blk, base+IMG_HDR_LEN+i*IMG_DELTA_BLOCK, IMG_DELTA_BLOCK)==0) continue;
+		bitmap[i>>3]|=1<<(i&7);
+		memcpy(out+len, blk, IMG_DELTA_BLOCK);
+		len+=IMG_DELTA_BLOCK;
+		if (len>max) return 0;
+	}
+	return len;
+}
+
+static void store_deltas(int id, const uint8_t *bin) {
+	char q[128];
+	snprintf(q, sizeof(q), "SELECT id,epd_bin FROM images WHERE `id`<>%d ORDER BY timestamp DESC LIMIT %d", id, DELTA_BASES);
+	if (mysql_query(mysql, q)) {
+		db_error("delta query");
+		return;
+	}
+	MYSQL_RES *res=mysql_store_result(mysql);
+	if (!res) return;
+	size_t max=(IMG_HDR_LEN+IMG_DATA_LEN)/2;
+	uint8_t *delta=malloc(max+IMG_DELTA_BLOCK+sizeof(img_delta_hdr_t)+IMG_HDR_LEN+(IMG_DELTA_BLOCKS+7)/8);
+	char *query=malloc(128+(max+IMG_DELTA_BLOCK+1024)*2);
+	MYSQL_ROW row;
+	while (delta && query && (row=mysql_fetch_row(res))) {
+		unsigned long *lengths=mysql_fetch_lengths(res);
+		if (!row[0] || !row[1] || lengths[1]<IMG_HDR_LEN+IMG_DATA_LEN) continue;
+		int base_id=atoi(row[0]);
+		size_t len=make_delta(id, bin, base_id, (const uint8_t*)row[1], delta);
+		if (!len) continue;
+		int qlen=sprintf(query, "INSERT INTO image_deltas (id,base_id,delta) VALUES (%d,%d,'", id, base_id);
+		qlen+=mysql_real_escape_string(mysql, query+qlen, (const char*)delta, len);
+		qlen+=sprintf(query+qlen, "')");
+		//No image_deltas table is fine; we just don't do deltas then.
+		if (mysql_real_query(mysql, query, qlen)) break;
+	}
+	free(delta);
+	free(query);
+	mysql_free_result(res);
+}
+
+int publish(const char *name, const uint8_t *bin, size_t len) {
+	if (!db_connect()) return 0;
+	size_t name_len=strlen(name);
+	char *query=malloc(128+name_len*2+len*2);
+	if (!query) return 0;
+	int qlen=sprintf(query, "INSERT INTO images (orig_name,epd_bin) VALUES ('");
+	qlen+=mysql_real_escape_string(mysql, query+qlen, name, name_len);
+	qlen+=sprintf(query+qlen, "','");
+	qlen+=mysql_real_escape_string(mysql, query+qlen, (const char*)bin, len);
+	qlen+=sprintf(query+qlen, "')");
+	int err=mysql_real_query(mysql, query, qlen);
+	free(query);
+	if (err) {
+		db_error("insert image");
+		return 0;
+	}
+	int id=mysql_insert_id(mysql);
+	store_deltas(id, bin);
+	//Tell syncd (if it runs) there is a new image
+	char stamp[512];
+	snprintf(stamp, sizeof(stamp), "%s/syncd.stamp", cfg.docroot);
+	int fd=open(stamp, O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+	if (fd>=0) {
+		futimens(fd, NULL);
+		close(fd);
+	}
+	return id;
+}
@@ -0,0 +1,235 @@
+/*
+The job queue and its workers. Jobs wait in their lane until a worker is free; workers
+take interactive jobs before bulk ones, and bulk jobs never get the last free worker, so an
+interactive upload never waits for a batch import to finish.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "epd_flash_image.h"
+#include "convd.h"
+
+extern char **environ;
+
+//Finished jobs are forgotten after this long; their state is only there to be looked up.
+#define JOB_KEEP 3600
+#define MAX_ARGS 32
+
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond=PTHREAD_COND_INITIALIZER;
+static job_t *lane_head[LANES], *lane_tail[LANES];
+static int lane_len[LANES];
+static int busy[LANES];
+static job_t *jobs;
+static int next_id=1;
+
+void spool_path(char *buf, int len, int id, const char *ext) {
+	snprintf(buf, len, "%s/%d.%s", cfg.spool, id, ext);
+}
+
+int run_conv(char *const *args, const char *in, const char *bin_out, const char *png_out) {
+	char *argv[MAX_ARGS+6];
+	int argc=0;
+	argv[argc++]=(char*)cfg.conv;
+	for (int i=0; args && args[i] && argc<MAX_ARGS; i++) argv[argc++]=args[i];
+	argv[argc++]="-o";
+	argv[argc++]=(char*)bin_out;
+	if (png_out) {
+		argv[argc++]="-p";
+		argv[argc++]=(char*)png_out;
+	}
+	argv[argc++]=(char*)in;
+	argv[argc]=NULL;
+	pid_t pid;
+	int err=posix_spawn(&pid, cfg.conv, NULL, NULL, argv, environ);
+	if (err!=0) {
+		fprintf(stderr, "%s: %s\n", cfg.conv, strerror(err));
+		return 0;
+	}
+	int status;
+	if (waitpid(pid, &status, 0)<0) return 0;
+	return WIFEXITED(status) && WEXITSTATUS(status)==0;
+}
+
+//Converts the image of a job and stores it. Returns the image id, or 0.
+static int convert(const job_t *j) {
+	char in[512], bin_out[512];
+	spool_path(in, sizeof(in), j->id, "in");
+	spool_path(bin_out, sizeof(bin_out), j->id, "bin");
+	int image_id=0;
+	if (run_conv(cfg.lane_args[j->lane], in, bin_out, NULL)) {
+		size_t len=sizeof(flash_image_t)-sizeof(((flash_image_t*)0)->padding);
+		uint8_t *bin=malloc(len);
+		FILE *f=fopen(bin_out, "rb");
+		if (bin && f && fread(bin, 1, len, f)==len && img_valid((flash_image_hdr_t*)bin)) {
+			image_id=publish(j->name, bin, len);
+		}
+		if (f) fclose(f);
+		free(bin);
+	} else {
+		fprintf(stderr, "job %d: conversion failed\n", j->id);
+	}
+	unlink(in);
+	unlink(bin_out);
+	return image_id;
+}
+
+//Next job for a free worker, or NULL. Called with the lock held.
+static job_t *take(int *lane) {
+	for (int l=0; l<LANES; l++) {
+		if (!lane_head[l]) continue;
+		//Keep one worker for interactive jobs
+		if (l==LANE_BULK && busy[LANE_BULK]>=cfg.workers-1) continue;
+		job_t *j=lane_head[l];
+		lane_head[l]=j->qnext;
+		if (!lane_head[l]) lane_tail[l]=NULL;
+		j->qnext=NULL;
+		lane_len[l]--;
+		*lane=l;
+		return j;
+	}
+	return NULL;
+}
+
+static void *worker(void *arg) {
+	pthread_mutex_lock(&lock);
+	while (1) {
+		job_t *j;
+		int lane;
+		while (!(j=take(&lane))) pthread_cond_wait(&work_cond, &lock);
+		busy[lane]++;
+		j->state=JOB_CONVERTING;
+		job_t copy=*j;
+		pthread_mutex_unlock(&lock);
+
+		int image_id=convert(&copy);
+
+		pthread_mutex_lock(&lock);
+		busy[lane]--;
+		j->image_id=image_id;
+		j->state=image_id?JOB_DONE:JOB_FAILED;
+		j->finished=time(NULL);
+		//A bulk job may have been waiting for a worker to free up
+		pthread_cond_broadcast(&work_cond);
+	}
+	return NULL;
+}
+
+//Where the next job id is kept, so ids aren't handed out again after a restart while
+//upload-status.php may still ask about the old jobs.
+static void id_path(char *buf, int len) {
+	snprintf(buf, len, "%s/next_id", cfg.spool);
+}
+
+void queue_start() {
+	//Go on from the last run. If the spool dir got cleared (it's in /tmp by default), start
+	//at the current time: that's past the ids of any run that did less than a job a second.
+	char path[512];
+	id_path(path, sizeof(path));
+	FILE *f=fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%d", &next_id)!=1) next_id=1;
+		fclose(f);
+	}
+	if (next_id<(int)time(NULL)) next_id=time(NULL);
+	for (int i=0; i<cfg.workers; i++) {
+		pthread_t t;
+		pthread_create(&t, NULL, worker, NULL);
+		pthread_detach(t);
+	}
+}
+
+int queue_new_id() {
+	pthread_mutex_lock(&lock);
+	int id=next_id++;
+	char path[512];
+	id_path(path, sizeof(path));
+	FILE *f=fopen(path, "w");
+	if (f) {
+		fprintf(f, "%d\n", next_id);
+		fclose(f);
+	}
+	pthread_mutex_unlock(&lock);
+	return id;
+}
+
+int queue_has_room(int lane) {
+	pthread_mutex_lock(&lock);
+	int room=lane_len[lane]<cfg.lane_max[lane];
+	pthread_mutex_unlock(&lock);
+	return room;
+}
+
+//Drops finished jobs nobody is going to ask about anymore. Called with the lock held.
+static void expire_jobs() {
+	time_t now=time(NULL);
+	for (job_t **p=&jobs; *p; ) {
+		job_t *j=*p;
+		if ((j->state==JOB_DONE || j->state==JOB_FAILED) && now-j->finished>JOB_KEEP) {
+			*p=j->next;
+			free(j);
+		} else {
+			p=&j->next;
+		}
+	}
+}
+
+job_t *queue_add(int id, int lane, const char *name) {
+	pthread_mutex_lock(&lock);
+	expire_jobs();
+	if (lane_len[lane]>=cfg.lane_max[lane]) {
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	job_t *j=calloc(1, sizeof(job_t));
+	j->id=id;
+	j->lane=lane;
+	j->state=JOB_QUEUED;
+	snprintf(j->name, sizeof(j->name), "%s", name);
+	j->next=jobs;
+	jobs=j;
+	if (lane_tail[lane]) lane_tail[lane]->qnext=j; else lane_head[lane]=j;
+	lane_tail[lane]=j;
+	lane_len[lane]++;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+	return j;
+}
+
+int queue_get(int id, job_t *out, int *position) {
+	pthread_mutex_lock(&lock);
+	job_t *j=jobs;
+	while (j && j->id!=id) j=j->next;
+	if (j) {
+		*out=*j;
+		*position=0;
+		if (j->state==JOB_QUEUED) {
+			for (job_t *q=lane_head[j->lane]; q && q!=j; q=q->qnext) (*position)++;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return j!=NULL;
+}
+
+void queue_stats(int *queued, int *busy_out) {
+	pthread_mutex_lock(&lock);
+	for (int l=0; l<LANES; l++) {
+		queued[l]=lane_len[l];
+		busy_out[l]=busy[l];
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -66,6 +66,51 @@ CREATE TABLE `images` (
   PRIMARY KEY (`id`)
 ) ENGINE=InnoDB AUTO_INCREMENT=88 DEFAULT CHARSET=utf8mb4;
 /*!40101 SET character_set_client = @saved_cs_client */;
+
+--
+-- Table structure for table `image_deltas`
+--
+
+DROP TABLE IF EXISTS `image_deltas`;
+/*!40101 SET @saved_cs_client     = @@character_set_client */;
+/*!40101 SET character_set_client = utf8 */;
+CREATE TABLE `image_deltas` (
+  `id` int(11) NOT NULL,
+  `base_id` int(11) NOT NULL,
+  `delta` mediumblob NOT NULL,
+  PRIMARY KEY (`id`,`base_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+/*!40101 SET character_set_client = @saved_cs_client */;
+
+--
+-- Table structure for table `wake_telemetry`
+--
+
+DROP TABLE IF EXISTS `wake_telemetry`;
+/*!40101 SET @saved_cs_client     = @@character_set_client */;
+/*!40101 SET character_set_client = utf8 */;
+CREATE TABLE `wake_telemetry` (
+  `id` int(11) NOT NULL AUTO_INCREMENT,
+  `device_id` int(11) NOT NULL,
+  `received` timestamp NOT NULL DEFAULT current_timestamp(),
+  `seq` int(11) NOT NULL,
+  `kind` char(1) NOT NULL,
+  `battery_mv` int(11) NOT NULL,
+  `images` int(11) NOT NULL,
+  `boot_ms` int(11) NOT NULL,
+  `wifi_ms` int(11) NOT NULL,
+  `manifest_ms` int(11) NOT NULL,
+  `download_ms` int(11) NOT NULL,
+  `image_max_ms` int(11) NOT NULL,
+  `flash_erase_ms` int(11) NOT NULL,
+  `flash_write_ms` int(11) NOT NULL,
+  `spi_ms` int(11) NOT NULL,
+  `refresh_ms` int(11) NOT NULL,
+  `awake_ms` int(11) NOT NULL,
+  PRIMARY KEY (`id`),
+  KEY `device_id` (`device_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+/*!40101 SET character_set_client = @saved_cs_client */;
 /*!40103 SET TIME_ZONE=@OLD_TIME_ZONE */;
 
 /*!40101 SET SQL_MODE=@OLD_SQL_MODE */;
@@ -0,0 +1,48 @@
+<?php
+/*
+Return several EPD binaries in one response, so the frame can fetch all the images it's
+missing over one connection. Called using GET: epd-bundle.php?ids=12,13,14
+
+The response is a sequence of frames, one per requested id, in the order asked for. Each
+frame is the id and the length of the data as little-endian uint32s, followed by the data.
+An image we don't have gets a length of 0. A frame with id 0 and length 0 ends it.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+require("config.php");
+
+$mysqli = mysqli_connect("localhost",$username, $pass, $db);
+
+$ids=array();
+if (isset($_GET["ids"])) {
+	foreach (explode(",", $_GET["ids"]) as $id) {
+		if (intval($id)>0) $ids[]=intval($id);
+	}
+}
+//No frame has more slots than this
+$ids=array_slice($ids, 0, 10);
+
+$bins=array();
+if (count($ids)>0) {
+	$result = $mysqli->query("SELECT id,epd_bin FROM images WHERE `id` IN (".implode(",", $ids).")");
+	while ($row=$result->fetch_assoc()) $bins[intval($row["id"])]=$row["epd_bin"];
+}
+
+//Send the length up front, so the connection can be kept alive afterwards.
+$len=8;
+foreach ($ids as $id) $len+=8+(isset($bins[$id])?strlen($bins[$id]):0);
+header("Content-Type: application/x-epd-bundle");
+header("Content-Length: ".$len);
+foreach ($ids as $id) {
+	$bin=isset($bins[$id])?$bins[$id]:"";
+	echo pack("VV", $id, strlen($bin));
+	echo $bin;
+}
+echo pack("VV", 0, 0);
+
+?>
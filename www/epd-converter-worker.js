@@ -0,0 +1,252 @@
+/**
+ * EPD Image Converter - Web Worker
+ * Does the actual conversion off the UI thread. The palette is converted to Lab once,
+ * every pixel is converted to Lab once (instead of once per palette entry) and the
+ * nearest palette entry is cached per input color. The math is the same as it always
+ * was, so the output is byte for byte what the old in-page converter produced.
+ *
+ * Message in:  {rgba: ArrayBuffer, width, height, dither, layout, timestamp}
+ *              layout is 'upsidedown' (the flash_image_t layout the frame expects),
+ *              'normal' (not rotated) or 'shifted' (what the old firmware web UI did).
+ * Messages out: {type: 'progress', done, total}
+ *               {type: 'done', binary: ArrayBuffer, preview: ArrayBuffer}
+ *               {type: 'error', message}
+ */
+
+// RGB colors as displayed on the EPD screen (linear RGB values)
+const EPD_COLORS = [
+    [0, 0, 0],           // Black
+    [1, 1, 1],           // White
+    [0.059, 0.329, 0.119], // Green
+    [0.061, 0.147, 0.336], // Blue
+    [0.574, 0.066, 0.010], // Red
+    [0.982, 0.756, 0.004], // Yellow
+    [0.795, 0.255, 0.018], // Orange
+];
+const NCOLORS = EPD_COLORS.length;
+const HDR_SIZE = 64;
+const PROGRESS_ROWS = 16;
+
+function gammaLinear(srgb) {
+    return srgb > 0.04045 ? Math.pow((srgb + 0.055) / 1.055, 2.4) : srgb / 12.92;
+}
+
+// Linear RGB [0..1] to CIE-LAB, written into out[o..o+2]
+function rgbToLab(r, g, b, out, o) {
+    r = Math.max(0, Math.min(100, r * 100));
+    g = Math.max(0, Math.min(100, g * 100));
+    b = Math.max(0, Math.min(100, b * 100));
+
+    // Observer = 2°, Illuminant = D65
+    let x = r * 0.4124 + g * 0.3576 + b * 0.1805;
+    let y = r * 0.2126 + g * 0.7152 + b * 0.0722;
+    let z = r * 0.0193 + g * 0.1192 + b * 0.9505;
+
+    x = x / 95.047;
+    y = y / 100.0;
+    z = z / 108.883;
+
+    x = x > 0.008856 ? Math.pow(x, 1/3) : (7.787 * x) + (16/116);
+    y = y > 0.008856 ? Math.pow(y, 1/3) : (7.787 * y) + (16/116);
+    z = z > 0.008856 ? Math.pow(z, 1/3) : (7.787 * z) + (16/116);
+
+    out[o] = (116 * y) - 16;
+    out[o + 1] = 500 * (x - y);
+    out[o + 2] = 200 * (y - z);
+}
+
+// DeltaE 2000 between two Lab colors
+function deltaE00(l1, a1, b1, l2, a2, b2) {
+    const avgL = (l1 + l2) / 2;
+    const c1 = Math.sqrt(a1 * a1 + b1 * b1);
+    const c2 = Math.sqrt(a2 * a2 + b2 * b2);
+    const avgC = (c1 + c2) / 2;
+    const g = (1 - Math.sqrt(Math.pow(avgC, 7) / (Math.pow(avgC, 7) + Math.pow(25, 7)))) / 2;
+
+    const a1p = a1 * (1 + g);
+    const a2p = a2 * (1 + g);
+    const c1p = Math.sqrt(a1p * a1p + b1 * b1);
+    const c2p = Math.sqrt(a2p * a2p + b2 * b2);
+    const avgCp = (c1p + c2p) / 2;
+
+    let h1p = Math.atan2(b1, a1p) * 180 / Math.PI;
+    if (h1p < 0) h1p += 360;
+    let h2p = Math.atan2(b2, a2p) * 180 / Math.PI;
+    if (h2p < 0) h2p += 360;
+
+    const avghp = Math.abs(h1p - h2p) > 180 ? (h1p + h2p + 360) / 2 : (h1p + h2p) / 2;
+    const t = 1 - 0.17 * Math.cos((avghp - 30) * Math.PI / 180) +
+                 0.24 * Math.cos(2 * avghp * Math.PI / 180) +
+                 0.32 * Math.cos((3 * avghp + 6) * Math.PI / 180) -
+                 0.2 * Math.cos((4 * avghp - 63) * Math.PI / 180);
+
+    let deltahp = h2p - h1p;
+    if (Math.abs(deltahp) > 180) {
+        if (h2p <= h1p) {
+            deltahp += 360;
+        } else {
+            deltahp -= 360;
+        }
+    }
+
+    const deltalp = l2 - l1;
+    const deltacp = c2p - c1p;
+    deltahp = 2 * Math.sqrt(c1p * c2p) * Math.sin(deltahp * Math.PI / 360);
+
+    const sl = 1 + ((0.015 * Math.pow(avgL - 50, 2)) / Math.sqrt(20 + Math.pow(avgL - 50, 2)));
+    const sc = 1 + 0.045 * avgCp;
+    const sh = 1 + 0.015 * avgCp * t;
+
+    const deltaro = 30 * Math.exp(-Math.pow((avghp - 275) / 25, 2));
+    const rc = 2 * Math.sqrt(Math.pow(avgCp, 7) / (Math.pow(avgCp, 7) + Math.pow(25, 7)));
+    const rt = -rc * Math.sin(2 * deltaro * Math.PI / 180);
+
+    return Math.sqrt(
+        Math.pow(deltalp / sl, 2) +
+        Math.pow(deltacp / sc, 2) +
+        Math.pow(deltahp / sh, 2) +
+        rt * (deltacp / sc) * (deltahp / sh)
+    );
+}
+
+// Palette in Lab, computed once
+const PALETTE_LAB = new Float64Array(NCOLORS * 3);
+for (let i = 0; i < NCOLORS; i++) {
+    rgbToLab(EPD_COLORS[i][0], EPD_COLORS[i][1], EPD_COLORS[i][2], PALETTE_LAB, i * 3);
+}
+const PALETTE_RGB = new Float64Array(EPD_COLORS.flat());
+
+// sRGB byte to linear, computed once
+const GAMMA_LUT = new Float64Array(256);
+for (let i = 0; i < 256; i++) GAMMA_LUT[i] = gammaLinear(i / 255);
+
+// Nearest-color cache. Direct-mapped and keyed on all the bits of the input color, so a
+// hit gives exactly the answer the full search would have.
+const CACHE_BITS = 16;
+const CACHE_SIZE = 1 << CACHE_BITS;
+const cacheKeys = new Uint32Array(CACHE_SIZE * 6);
+const cacheVals = new Uint8Array(CACHE_SIZE);
+const keyBuf = new Float64Array(3);
+const keyBits = new Uint32Array(keyBuf.buffer);
+const lab = new Float64Array(3);
+
+function nearestSearch(r, g, b) {
+    rgbToLab(r, g, b, lab, 0);
+    let best = 0;
+    let bestDiff = Infinity;
+    for (let i = 0; i < NCOLORS; i++) {
+        const d = deltaE00(lab[0], lab[1], lab[2], PALETTE_LAB[i * 3], PALETTE_LAB[i * 3 + 1], PALETTE_LAB[i * 3 + 2]);
+        if (d < bestDiff) {
+            bestDiff = d;
+            best = i;
+        }
+    }
+    return best;
+}
+
+function nearest(r, g, b) {
+    keyBuf[0] = r;
+    keyBuf[1] = g;
+    keyBuf[2] = b;
+    let h = 0;
+    for (let i = 0; i < 6; i++) h = Math.imul(h ^ keyBits[i], 0x9e3779b1);
+    h = (h ^ (h >>> 16)) & (CACHE_SIZE - 1);
+    const k = h * 6;
+    if (cacheVals[h] !== 0xff && cacheKeys[k] === keyBits[0] && cacheKeys[k + 1] === keyBits[1] &&
+            cacheKeys[k + 2] === keyBits[2] && cacheKeys[k + 3] === keyBits[3] &&
+            cacheKeys[k + 4] === keyBits[4] && cacheKeys[k + 5] === keyBits[5]) {
+        return cacheVals[h];
+    }
+    const best = nearestSearch(r, g, b);
+    cacheKeys.set(keyBits, k);
+    cacheVals[h] = best;
+    return best;
+}
+
+function convert(msg) {
+    const w = msg.width, h = msg.height;
+    const rgba = new Uint8ClampedArray(msg.rgba);
+    const binary = new Uint8Array(HDR_SIZE + w * h / 2);
+    const view = new DataView(binary.buffer);
+    view.setUint32(0, 0xfafa1a1a, true); // Magic number (little endian)
+    view.setBigUint64(4, BigInt(msg.timestamp), true); // Timestamp
+    const preview = new Uint8ClampedArray(w * h * 4);
+    cacheVals.fill(0xff);
+
+    // With dithering, the working image is linear RGB in float32, as it always was.
+    let pixels = null;
+    if (msg.dither) {
+        pixels = new Float32Array(w * h * 3);
+        for (let i = 0, j = 0; i < rgba.length; i += 4, j += 3) {
+            pixels[j] = GAMMA_LUT[rgba[i]];
+            pixels[j + 1] = GAMMA_LUT[rgba[i + 1]];
+            pixels[j + 2] = GAMMA_LUT[rgba[i + 2]];
+        }
+    }
+
+    const row = new Uint8Array(w);
+    for (let y = 0; y < h; y++) {
+        for (let x = 0; x < w; x++) {
+            let best;
+            if (msg.dither) {
+                const p = (x + y * w) * 3;
+                const r = pixels[p], g = pixels[p + 1], b = pixels[p + 2];
+                best = nearest(r, g, b);
+                // Floyd-Steinberg; error is clamped per pixel, like before
+                for (let c = 0; c < 3; c++) {
+                    const error = pixels[p + c] - PALETTE_RGB[best * 3 + c];
+                    const e7 = (error / 16) * 7, e3 = (error / 16) * 3, e5 = (error / 16) * 5, e1 = (error / 16) * 1;
+                    if (x + 1 < w) pixels[p + 3 + c] = Math.max(0, Math.min(1, pixels[p + 3 + c] + e7));
+                    if (y + 1 < h) {
+                        const q = p + w * 3 + c;
+                        if (x > 0) pixels[q - 3] = Math.max(0, Math.min(1, pixels[q - 3] + e3));
+                        pixels[q] = Math.max(0, Math.min(1, pixels[q] + e5));
+                        if (x + 1 < w) pixels[q + 3] = Math.max(0, Math.min(1, pixels[q + 3] + e1));
+                    }
+                }
+            } else {
+                const i = (x + y * w) * 4;
+                best = nearest(GAMMA_LUT[rgba[i]], GAMMA_LUT[rgba[i + 1]], GAMMA_LUT[rgba[i + 2]]);
+            }
+            row[x] = best;
+
+            const pi = (x + y * w) * 4;
+            preview[pi] = Math.round(EPD_COLORS[best][0] * 255);
+            preview[pi + 1] = Math.round(EPD_COLORS[best][1] * 255);
+            preview[pi + 2] = Math.round(EPD_COLORS[best][2] * 255);
+            preview[pi + 3] = 255;
+        }
+
+        // Pack the row, two pixels per byte
+        if (msg.layout === 'shifted') {
+            for (let x = 0; x < w; x += 2) {
+                const epdX = (x + w / 2) % w;
+                binary[HDR_SIZE + (y * w + epdX) / 2] = (row[x + 1] << 4) | row[x];
+            }
+        } else if (msg.layout === 'normal') {
+            const base = HDR_SIZE + (y * w) / 2;
+            for (let x = 0; x < w; x += 2) {
+                binary[base + x / 2] = (row[x] << 4) | row[x + 1];
+            }
+        } else {
+            const base = HDR_SIZE + ((h - 1 - y) * w) / 2;
+            for (let x = 0; x < w; x += 2) {
+                binary[base + (w - 2 - x) / 2] = row[x] | (row[x + 1] << 4);
+            }
+        }
+
+        if ((y % PROGRESS_ROWS) === PROGRESS_ROWS - 1) {
+            self.postMessage({ type: 'progress', done: y + 1, total: h });
+        }
+    }
+    self.postMessage({ type: 'done', binary: binary.buffer, preview: preview.buffer },
+                     [binary.buffer, preview.buffer]);
+}
+
+self.onmessage = (e) => {
+    try {
+        convert(e.data);
+    } catch (error) {
+        self.postMessage({ type: 'error', message: error.message });
+    }
+};
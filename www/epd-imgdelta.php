@@ -0,0 +1,30 @@
+<?php
+/*
+Return an image as a delta from another one the frame already has, as made by
+imgdelta.inc.php when the image was uploaded. epd-info.php tells the frame which ones exist.
+Called using GET: epd-imgdelta.php?id=14&base=12
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+*/
+require("config.php");
+
+$mysqli = mysqli_connect("localhost",$username, $pass, $db); 
+
+$id=isset($_GET["id"])?intval($_GET["id"]):0;
+$base=isset($_GET["base"])?intval($_GET["base"]):0;
+$result = $mysqli->query("SELECT delta FROM image_deltas WHERE `id`='$id' AND `base_id`='$base'");
+$row=$result?$result->fetch_assoc():null;
+if (!$row) {
+	http_response_code(404);
+	exit;
+}
+header("Content-Type: application/x-epd-delta");
+header("Content-Length: ".strlen($row["delta"]));
+echo $row["delta"];
+
+?>
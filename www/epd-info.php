@@ -4,6 +4,15 @@ Return JSON with the state we expect the EPD controller to be in: what firmware
 to have and what images are supposed to be in its memory. We also record the battery voltage.
 
 Called using GET: epd-info.php?mac=01234567&bat=2901
+Optionally with &have=12,13,14: the ids of the images the device has now. For each image in
+the list we return, 'deltas' then gives the id of one of those it can be made from with
+epd-imgdelta.php, or 0 if there isn't one.
+Optionally with &tel=...: phase timings of the wakes since the last check-in, which go into
+the wake_telemetry table. Wakes are separated by '.', and each is a comma-separated
+seq,kind,battery_mv,images followed by the milliseconds of every phase (empty for 0).
+
+If the request has an If-None-Match header with the ETag we sent last time and nothing
+changed since, the answer is a 304 with only the time, in an X-Time header.
 
  * ----------------------------------------------------------------------------
  * "THE BEER-WARE LICENSE" (Revision 42):
@@ -66,6 +75,19 @@ if (isset($_SERVER['REMOTE_ADDR'])) $ip=$_SERVER['REMOTE_ADDR'];
 $stmt->bind_param("iiss", $dev_info["id"], $battery_mv, $ip, $fw);
 $stmt->execute() || die($stmt->error);
 
+//Store the wake telemetry. It's only statistics, so anything wrong with it is ignored.
+if (isset($_GET["tel"])) {
+	$stmt = $mysqli->prepare("INSERT INTO wake_telemetry (device_id,seq,kind,battery_mv,images,boot_ms,wifi_ms,manifest_ms,download_ms,image_max_ms,flash_erase_ms,flash_write_ms,spi_ms,refresh_ms,awake_ms) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)");
+	foreach (array_slice(explode(".", $_GET["tel"]), 0, 64) as $wake) {
+		$f=explode(",", $wake);
+		if (!$stmt || count($f)!=14 || !preg_match("/^[a-z]$/", $f[1])) continue;
+		$kind=$f[1];
+		$v=array_map("intval", $f);
+		$stmt->bind_param("iisiiiiiiiiiiii", $dev_info["id"], $v[0], $kind, $v[2], $v[3], $v[4], $v[5], $v[6], $v[7], $v[8], $v[9], $v[10], $v[11], $v[12], $v[13]);
+		$stmt->execute();
+	}
+}
+
 //Grab latest 10 images
 $image_ids=array();
 $result = $mysqli->query("SELECT id FROM images ORDER BY timestamp DESC LIMIT 10");
@@ -76,15 +98,51 @@ for ($i=0; $i<10; $i++) {
 	$image_ids[$i]=intval($row["id"]);
 }
 
+//Find the smallest delta for each image from one the device already has
+$have=array();
+if (isset($_GET["have"])) {
+	foreach (explode(",", $_GET["have"]) as $id) {
+		if (intval($id)>0) $have[]=intval($id);
+	}
+}
+$deltas=array_fill(0, count($image_ids), 0);
+if (count($have)>0) {
+	$result = $mysqli->query("SELECT id,base_id FROM image_deltas WHERE `id` IN (".implode(",", $image_ids).") AND `base_id` IN (".implode(",", array_slice($have, 0, 10)).") ORDER BY LENGTH(delta) DESC");
+	//No image_deltas table is fine too
+	while ($result && $row=$result->fetch_assoc()) {
+		$i=array_search(intval($row["id"]), $image_ids);
+		if ($i!==false) $deltas[$i]=intval($row["base_id"]);
+	}
+}
+
 //Dump all info in json
 $ret=array();
-$ret["time"]=time();
 $ret["fw_sha"]=get_app_image_data($dev_info["fw_upd"]);
 $ret["fw_upd"]=$dev_info["fw_upd"];
+//If otadiff made a patch from what the device runs now to the new firmware, offer that.
+//The device sends the first 8 bytes of its app SHA in hex; patches are named after those.
+$new_fw=strtoupper(bin2hex(substr(base64_decode($ret["fw_sha"]),0,8)));
+$cur_fw=strtoupper($fw);
+if (preg_match("/^[0-9A-F]{16}$/", $cur_fw) && $new_fw!="" && $cur_fw!=$new_fw) {
+	$patch=$cur_fw."-".$new_fw.".patch";
+	if (file_exists(__DIR__."/".$patch)) $ret["fw_patch"]=$patch;
+}
 $ret["tz"]=$dev_info["tz"];
 $ret["update_hour"]=intval($dev_info["update_hour"]);
 $ret["images"]=$image_ids;
 
+//The ETag covers everything but the time and the deltas; those only matter if the images
+//changed anyway. syncd makes the same one.
+$etag=sprintf("\"%08x\"", crc32(json_encode($ret)));
+$ret["deltas"]=$deltas;
+header("ETag: ".$etag);
+if (isset($_SERVER["HTTP_IF_NONE_MATCH"]) && trim($_SERVER["HTTP_IF_NONE_MATCH"])==$etag) {
+	http_response_code(304);
+	header("X-Time: ".time());
+	exit;
+}
+$ret=array("time"=>time())+$ret;
+
 //send
 header("Content-Type: text/json");
 echo json_encode($ret);
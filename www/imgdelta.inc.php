@@ -0,0 +1,62 @@
+<?php
+/*
+Block deltas between images. When a new image comes in, we compare it to the images
+before it in 64-byte blocks of 4bpp data. If it's close to one of them (a re-crop or
+re-dither of the same picture, say), we store which blocks changed. Frames that still have
+that older image then only need to download the changed blocks. See img_delta_hdr_t in
+firmware/main/epd_flash_image.h for the format.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+define("IMG_HDR_LEN", 64);
+define("IMG_DATA_LEN", 600*448/2);
+define("IMG_DELTA_MAGIC", 0x44445045);
+define("IMG_DELTA_BLOCK", 64);
+//How many earlier images to compare a new one to
+define("IMG_DELTA_BASES", 20);
+
+//Returns the delta from $base to $bin, or false if they can't be compared.
+function make_image_delta($id, $bin, $base_id, $base) {
+	if (strlen($bin)<IMG_HDR_LEN+IMG_DATA_LEN || strlen($base)<IMG_HDR_LEN+IMG_DATA_LEN) return false;
+	$blocks=IMG_DATA_LEN/IMG_DELTA_BLOCK;
+	$bitmap=str_repeat("\0", intdiv($blocks+7, 8));
+	$changed="";
+	for ($i=0; $i<$blocks; $i++) {
+		$pos=IMG_HDR_LEN+$i*IMG_DELTA_BLOCK;
+		$blk=substr($bin, $pos, IMG_DELTA_BLOCK);
+		if ($blk!==substr($base, $pos, IMG_DELTA_BLOCK)) {
+			$bitmap[$i>>3]=chr(ord($bitmap[$i>>3])|(1<<($i&7)));
+			$changed.=$blk;
+		}
+	}
+	return pack("VVVV", IMG_DELTA_MAGIC, $id, $base_id, IMG_DELTA_BLOCK).substr($bin, 0, IMG_HDR_LEN).$bitmap.$changed;
+}
+
+//Stores deltas to image $id from the images before it, where that saves at least half.
+function store_image_deltas($mysqli, $id) {
+	$id=intval($id);
+	$result=$mysqli->query("SELECT epd_bin FROM images WHERE `id`=$id");
+	$row=$result?$result->fetch_assoc():null;
+	if (!$row) return;
+	$bin=$row["epd_bin"];
+	$stmt=$mysqli->prepare("INSERT INTO image_deltas (id,base_id,delta) VALUES (?,?,?)");
+	if (!$stmt) return; //no image_deltas table; that's fine, we just won't do deltas
+	$result=$mysqli->query("SELECT id,epd_bin FROM images WHERE `id`<>$id ORDER BY timestamp DESC LIMIT ".IMG_DELTA_BASES);
+	while ($row=$result->fetch_assoc()) {
+		$delta=make_image_delta($id, $bin, intval($row["id"]), $row["epd_bin"]);
+		if ($delta===false || strlen($delta)>strlen($bin)/2) continue;
+		$base_id=intval($row["id"]);
+		$null=NULL;
+		$stmt->bind_param("iib", $id, $base_id, $null);
+		$stmt->send_long_data(2, $delta);
+		$stmt->execute();
+	}
+}
+
+?>
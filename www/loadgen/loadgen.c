@@ -0,0 +1,837 @@
+/*
+Load generator for the sync server. It simulates a fleet of picture frames checking in:
+every simulated frame has its own MAC and schedule and does what picframe_sync() in
+firmware/main/sync.c.disabled does (fetch epd-info.php, parse it, do a firmware update
+if the SHA differs, download every image it doesn't have yet), and at the end we report
+latency percentiles, throughput and error rates per request type.
+
+Usage: loadgen [options] http://host:port/path/
+       loadgen [options] -S              (against a built-in stand-in server)
+       loadgen -s port [-r secs]         (only run the stand-in server)
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <endian.h>
+#include "loadgen.h"
+
+//The firmware gives up on a request after this long (timeout_ms in picframe_sync())
+#define REQ_TIMEOUT_US 16000000ULL
+//...and reads the info response into a buffer this big; anything longer won't parse.
+#define INFO_BUF 512
+#define PROGRESS_US 5000000ULL
+
+typedef enum {REQ_INFO=0, REQ_IMG, REQ_BUNDLE, REQ_FW, REQ_SESSION, REQ_TYPES} req_type_t;
+static const char *req_names[REQ_TYPES]={"info", "img", "bundle", "fw", "session"};
+
+typedef enum {ERR_CONNECT=0, ERR_TIMEOUT, ERR_IO, ERR_HTTP, ERR_PARSE, ERR_SHORT, ERR_TYPES} err_type_t;
+static const char *err_names[ERR_TYPES]={"connect", "timeout", "io", "http", "parse", "short"};
+
+typedef enum {S_CONNECTING, S_SENDING, S_RECEIVING} sess_state_t;
+
+typedef struct {
+	uint32_t *v;			//latency in us
+	size_t n, cap;
+	uint64_t bytes;
+} samples_t;
+
+typedef struct session_t session_t;
+
+//A simulated frame. This is all the state it keeps between check-ins.
+typedef struct {
+	uint64_t mac;
+	char fw_sha[48];		//what it's running, as the server would encode it; empty if it doesn't know yet
+	int outdated;			//starts out with old firmware
+	int curr_img[IMG_SLOT_COUNT];
+	char etag[24];			//with -e: ETag of the last info it fully acted on
+	uint64_t due;
+	session_t *sess;
+} device_t;
+
+//A check-in in progress. Only as many of these exist as we have sessions in flight.
+struct session_t {
+	device_t *dev;
+	int fd;
+	sess_state_t state;
+	req_type_t req;
+	uint64_t start, req_start, last_io;
+	char out[512];
+	int out_len, out_pos;
+	char in[4096];
+	int in_len;
+	int hdr_done, status, conn_close;
+	long content_len, body_len;
+	char info[INFO_BUF];
+	int info_len;
+	char fw_sha[48], fw_upd[64];
+	char etag[24];
+	int incomplete;			//some image didn't come in right
+	int server_img[IMG_SLOT_COUNT];
+	int dl_index, dl_slot, dl_id;
+	//With -b: the downloads planned up front, and the state of the bundle parser
+	int dl_ids[IMG_SLOT_COUNT], dl_slots[IMG_SLOT_COUNT];
+	int dl_count;
+	uint8_t frame_hdr[8];
+	int frame_hdr_len, frame_done;
+	uint32_t frame_left, frame_len;
+	int delayed;			//waiting for the simulated round trip
+	uint64_t send_at;
+	session_t *next;		//in-flight list
+};
+
+static struct {
+	int devices;
+	double interval_s;
+	double jitter;
+	double duration_s;
+	int concurrency;
+	double churn;
+	double outdated;
+	int keepalive;
+	int bundle;
+	uint64_t rtt_us;
+	int etag;
+} opt={100, 60, 0.1, 60, 256, 0, 0, 0, 0, 0, 0};
+
+static struct sockaddr_storage srv_addr;
+static socklen_t srv_addr_len;
+static char host_hdr[128];
+static char base_path[128]="/";
+
+static int epfd;
+static device_t *devs;
+static device_t **heap;		//devices not in a session, by due time
+static int heap_len;
+static session_t *in_flight;
+static int in_flight_count;
+static uint64_t next_mac;
+static samples_t samples[REQ_TYPES];
+static samples_t lag;
+static uint64_t errors[ERR_TYPES];
+static uint64_t sessions_ok, sessions_failed, sessions_unchanged, fw_updates, images_downloaded, churned;
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000ULL+ts.tv_nsec/1000;
+}
+
+static double frand() {
+	return rand()/(RAND_MAX+1.0);
+}
+
+static void sample_add(samples_t *s, uint64_t us, uint64_t bytes) {
+	if (s->n==s->cap) {
+		s->cap=s->cap?s->cap*2:4096;
+		s->v=realloc(s->v, s->cap*sizeof(uint32_t));
+	}
+	s->v[s->n++]=(us>UINT32_MAX)?UINT32_MAX:us;
+	s->bytes+=bytes;
+}
+
+static void heap_swap(int a, int b) {
+	device_t *t=heap[a];
+	heap[a]=heap[b];
+	heap[b]=t;
+}
+
+static void heap_push(device_t *d) {
+	int i=heap_len++;
+	heap[i]=d;
+	while (i>0 && heap[(i-1)/2]->due>heap[i]->due) {
+		heap_swap(i, (i-1)/2);
+		i=(i-1)/2;
+	}
+}
+
+static device_t *heap_pop() {
+	device_t *top=heap[0];
+	heap[0]=heap[--heap_len];
+	int i=0;
+	while (1) {
+		int l=i*2+1, r=l+1, m=i;
+		if (l<heap_len && heap[l]->due<heap[m]->due) m=l;
+		if (r<heap_len && heap[r]->due<heap[m]->due) m=r;
+		if (m==i) break;
+		heap_swap(i, m);
+		i=m;
+	}
+	return top;
+}
+
+static void device_reset(device_t *d) {
+	d->mac=next_mac++;
+	d->fw_sha[0]=0;
+	d->etag[0]=0;
+	d->outdated=(frand()<opt.outdated);
+	for (int i=0; i<IMG_SLOT_COUNT; i++) d->curr_img[i]=-1;
+}
+
+static void next_request(session_t *s);
+static void send_request(session_t *s);
+
+//Ends the check-in and puts the frame to sleep until its next one.
+static void session_end(session_t *s, int ok, int reboot) {
+	device_t *d=s->dev;
+	uint64_t now=now_us();
+	if (ok) {
+		sessions_ok++;
+		sample_add(&samples[REQ_SESSION], now-s->start, 0);
+		//Like the firmware, only remember the ETag if we got everything it stands for.
+		if (opt.etag && !reboot && !s->incomplete) strcpy(d->etag, s->etag);
+	} else {
+		sessions_failed++;
+	}
+	if (s->fd>=0) close(s->fd);
+	session_t **p=&in_flight;
+	while (*p!=s) p=&(*p)->next;
+	*p=s->next;
+	in_flight_count--;
+	if (reboot) {
+		//After an OTA the firmware restarts and syncs again right away.
+		d->due=now;
+	} else {
+		d->due=s->start+opt.interval_s*1e6*(1.0+opt.jitter*(2*frand()-1));
+	}
+	d->sess=NULL;
+	free(s);
+	heap_push(d);
+}
+
+static void session_fail(session_t *s, err_type_t err) {
+	errors[err]++;
+	session_end(s, 0, 0);
+}
+
+static void start_request(session_t *s, req_type_t type, const char *path_query) {
+	s->req=type;
+	s->req_start=now_us();
+	s->last_io=s->req_start;
+	char inm[48]="";
+	if (type==REQ_INFO && s->dev->etag[0]) snprintf(inm, sizeof(inm), "If-None-Match: %s\r\n", s->dev->etag);
+	s->out_len=snprintf(s->out, sizeof(s->out),
+			"GET %s%s HTTP/1.1\r\nHost: %s\r\nUser-Agent: ESP32 HTTP Client/1.0\r\n%s%s\r\n",
+			base_path, path_query, host_hdr, inm, opt.keepalive?"":"Connection: close\r\n");
+	s->out_pos=0;
+	s->in_len=0;
+	s->hdr_done=0;
+	s->status=0;
+	s->conn_close=!opt.keepalive;
+	s->content_len=-1;
+	s->body_len=0;
+	s->info_len=0;
+	s->frame_hdr_len=0;
+	s->frame_left=0;
+	s->frame_done=0;
+	if (opt.rtt_us) {
+		//Connecting costs a round trip, and so does every request.
+		s->delayed=1;
+		s->send_at=s->req_start+opt.rtt_us*((s->fd>=0)?1:2);
+		return;
+	}
+	send_request(s);
+}
+
+static void send_request(session_t *s) {
+	s->delayed=0;
+	if (s->fd>=0) {
+		s->state=S_SENDING;
+		struct epoll_event ev={.events=EPOLLOUT, .data.ptr=s};
+		epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+		return;
+	}
+	s->fd=socket(srv_addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (s->fd<0) {
+		session_fail(s, ERR_CONNECT);
+		return;
+	}
+	int one=1;
+	setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(s->fd, (struct sockaddr*)&srv_addr, srv_addr_len)<0 && errno!=EINPROGRESS) {
+		session_fail(s, ERR_CONNECT);
+		return;
+	}
+	s->state=S_CONNECTING;
+	struct epoll_event ev={.events=EPOLLOUT, .data.ptr=s};
+	epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+}
+
+static void session_begin(device_t *d) {
+	if (opt.churn>0 && frand()<opt.churn) {
+		//This frame got replaced by a new one: new MAC, nothing in flash.
+		device_reset(d);
+		churned++;
+	}
+	session_t *s=calloc(1, sizeof(session_t));
+	s->dev=d;
+	s->fd=-1;
+	s->start=now_us();
+	d->sess=s;
+	s->next=in_flight;
+	in_flight=s;
+	in_flight_count++;
+	//The firmware sends the first 8 bytes of its app SHA as hex; anything unique will do.
+	uint64_t h=14695981039346656037ULL;
+	for (const char *p=d->fw_sha; *p; p++) h=(h^*p)*1099511628211ULL;
+	char q[160];
+	snprintf(q, sizeof(q), "epd-info.php?mac=%012llX&bat=%d&fw=%016llX",
+			(unsigned long long)d->mac, 2700+rand()%600, (unsigned long long)h);
+	start_request(s, REQ_INFO, q);
+}
+
+//Finds a JSON string value. Only as much JSON as epd-info.php produces.
+static int json_string(const char *js, const char *key, char *out, int len) {
+	char pat[32];
+	snprintf(pat, sizeof(pat), "\"%s\":\"", key);
+	const char *p=strstr(js, pat);
+	if (!p) return 0;
+	p+=strlen(pat);
+	int i=0;
+	while (*p && *p!='"' && i<len-1) {
+		if (*p=='\\' && p[1]) p++;
+		out[i++]=*p++;
+	}
+	out[i]=0;
+	return *p=='"';
+}
+
+static int parse_info(session_t *s) {
+	if (s->info_len>=INFO_BUF) return 0;
+	s->info[s->info_len]=0;
+	if (!json_string(s->info, "fw_sha", s->fw_sha, sizeof(s->fw_sha))) return 0;
+	if (!json_string(s->info, "fw_upd", s->fw_upd, sizeof(s->fw_upd))) s->fw_upd[0]=0;
+	const char *p=strstr(s->info, "\"images\":[");
+	if (!p) return 0;
+	p+=10;
+	for (int i=0; i<IMG_SLOT_COUNT; i++) {
+		s->server_img[i]=-1;
+		if (*p==']') continue;
+		char *e;
+		s->server_img[i]=strtol(p, &e, 10);
+		if (e==p) return 0;
+		p=e;
+		if (*p==',') p++;
+	}
+	return 1;
+}
+
+//Decides what to fetch next, the same way picframe_sync() does.
+static void next_request(session_t *s) {
+	device_t *d=s->dev;
+	while (s->dl_index<IMG_SLOT_COUNT) {
+		int id=s->server_img[s->dl_index++];
+		int found=0;
+		for (int j=0; j<IMG_SLOT_COUNT; j++) {
+			if (d->curr_img[j]==id) found=1;
+		}
+		if (found) continue;
+		s->dl_slot=-1;
+		for (int j=0; j<IMG_SLOT_COUNT && s->dl_slot<0; j++) {
+			int available=1;
+			for (int k=0; k<IMG_SLOT_COUNT; k++) {
+				if (d->curr_img[j]==s->server_img[k]) available=0;
+			}
+			if (available) s->dl_slot=j;
+		}
+		//The firmware doesn't check this (and would write to slot -1); we just skip it.
+		if (s->dl_slot<0) continue;
+		s->dl_id=id;
+		d->curr_img[s->dl_slot]=-1;
+		char q[64];
+		snprintf(q, sizeof(q), "epd-img.php?id=%d", id);
+		start_request(s, REQ_IMG, q);
+		return;
+	}
+	session_end(s, 1, 0);
+}
+
+//What the firmware does with -b: work out all downloads first, then get them in one
+//bundle request.
+static void plan_downloads(session_t *s) {
+	device_t *d=s->dev;
+	int taken[IMG_SLOT_COUNT]={0};
+	s->dl_count=0;
+	for (int i=0; i<IMG_SLOT_COUNT; i++) {
+		int id=s->server_img[i];
+		if (id<=0) continue;
+		int found=0;
+		for (int j=0; j<IMG_SLOT_COUNT; j++) {
+			if (d->curr_img[j]==id) found=1;
+		}
+		if (found) continue;
+		int slot=-1;
+		for (int j=0; j<IMG_SLOT_COUNT && slot<0; j++) {
+			int available=!taken[j];
+			for (int k=0; k<IMG_SLOT_COUNT; k++) {
+				if (d->curr_img[j]==s->server_img[k]) available=0;
+			}
+			if (available) slot=j;
+		}
+		if (slot<0) continue;
+		taken[slot]=1;
+		s->dl_ids[s->dl_count]=id;
+		s->dl_slots[s->dl_count]=slot;
+		s->dl_count++;
+	}
+	for (int i=0; i<s->dl_count; i++) d->curr_img[s->dl_slots[i]]=-1;
+	if (s->dl_count==0) {
+		session_end(s, 1, 0);
+		return;
+	}
+	char q[160];
+	int n=snprintf(q, sizeof(q), "epd-bundle.php?ids=");
+	for (int i=0; i<s->dl_count; i++) n+=snprintf(q+n, sizeof(q)-n, "%s%d", i?",":"", s->dl_ids[i]);
+	start_request(s, REQ_BUNDLE, q);
+}
+
+//Fallback for -b when the server has no bundle endpoint: the planned images one by one.
+static void next_planned(session_t *s) {
+	if (s->dl_index>=s->dl_count) {
+		session_end(s, 1, 0);
+		return;
+	}
+	s->dl_id=s->dl_ids[s->dl_index];
+	s->dl_slot=s->dl_slots[s->dl_index];
+	s->dl_index++;
+	char q[64];
+	snprintf(q, sizeof(q), "epd-img.php?id=%d", s->dl_id);
+	start_request(s, REQ_IMG, q);
+}
+
+//Walks the frames of a bundle response as they come in.
+static void parse_bundle(session_t *s, const uint8_t *p, int len) {
+	device_t *d=s->dev;
+	while (len>0 && !s->frame_done) {
+		if (s->frame_left==0 && s->frame_hdr_len<8) {
+			int c=(len<8-s->frame_hdr_len)?len:8-s->frame_hdr_len;
+			memcpy(s->frame_hdr+s->frame_hdr_len, p, c);
+			s->frame_hdr_len+=c;
+			p+=c;
+			len-=c;
+			if (s->frame_hdr_len<8) return;
+			uint32_t id, flen;
+			memcpy(&id, s->frame_hdr, 4);
+			memcpy(&flen, s->frame_hdr+4, 4);
+			s->dl_id=le32toh(id);
+			s->frame_left=s->frame_len=le32toh(flen);
+			if (s->dl_id==0) {
+				s->frame_done=1;
+				return;
+			}
+		}
+		int c=(len<(int)s->frame_left)?len:(int)s->frame_left;
+		s->frame_left-=c;
+		p+=c;
+		len-=c;
+		if (s->frame_left==0) {
+			for (int i=0; i<s->dl_count; i++) {
+				if (s->dl_ids[i]!=s->dl_id) continue;
+				if (s->frame_len>=IMG_BYTES) {
+					d->curr_img[s->dl_slots[i]]=s->dl_id;
+					images_downloaded++;
+				} else {
+					errors[ERR_SHORT]++;
+					s->incomplete=1;
+				}
+			}
+			s->frame_hdr_len=0;
+		}
+	}
+}
+
+static void request_done(session_t *s) {
+	device_t *d=s->dev;
+	uint64_t now=now_us();
+	sample_add(&samples[s->req], now-s->req_start, s->body_len);
+	if (s->conn_close) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+		close(s->fd);
+		s->fd=-1;
+	}
+	//A 304 to a check-in, or a 404 to a bundle from a server without bundles, is no error
+	int expected=(s->status==200 || (s->req==REQ_INFO && s->status==304) ||
+			(s->req==REQ_BUNDLE && s->status==404));
+	if (!expected) errors[ERR_HTTP]++;
+	if (s->req==REQ_INFO) {
+		if (s->status==304) {
+			//Nothing changed since the last check-in; the firmware goes back to sleep.
+			sessions_unchanged++;
+			session_end(s, 1, 0);
+			return;
+		}
+		d->etag[0]=0;
+		if (s->status!=200 || !parse_info(s)) {
+			if (s->status==200) errors[ERR_PARSE]++;
+			session_end(s, 0, 0);
+			return;
+		}
+		//A frame that's up to date knows the SHA the server hands out.
+		if (!d->fw_sha[0] && !d->outdated) strcpy(d->fw_sha, s->fw_sha);
+		if (s->fw_sha[0] && strcmp(s->fw_sha, d->fw_sha)!=0 && s->fw_upd[0]) {
+			start_request(s, REQ_FW, s->fw_upd);
+			return;
+		}
+		s->dl_index=0;
+		if (opt.bundle) plan_downloads(s); else next_request(s);
+	} else if (s->req==REQ_FW) {
+		if (s->status==200) {
+			//Flashed; the frame reboots into the new firmware.
+			fw_updates++;
+			strcpy(d->fw_sha, s->fw_sha);
+			d->outdated=0;
+			session_end(s, 1, 1);
+			return;
+		}
+		s->incomplete=1;
+		s->dl_index=0;
+		if (opt.bundle) plan_downloads(s); else next_request(s);
+	} else if (s->req==REQ_BUNDLE) {
+		if (s->status==404) {
+			//Server doesn't do bundles; the firmware falls back to one request per image.
+			s->dl_index=0;
+			next_planned(s);
+		} else if (s->status!=200 || !s->frame_done) {
+			if (s->status==200) errors[ERR_SHORT]++;
+			session_end(s, 0, 0);
+		} else {
+			session_end(s, 1, 0);
+		}
+	} else {
+		if (s->status==200 && s->body_len>=IMG_BYTES) {
+			d->curr_img[s->dl_slot]=s->dl_id;
+			images_downloaded++;
+		} else {
+			if (s->status==200) errors[ERR_SHORT]++;
+			s->incomplete=1;
+		}
+		if (opt.bundle) next_planned(s); else next_request(s);
+	}
+}
+
+//Takes what's in the input buffer as response header and body.
+static int process_input(session_t *s) {
+	if (!s->hdr_done) {
+		char *end=memmem(s->in, s->in_len, "\r\n\r\n", 4);
+		if (!end) return (s->in_len==sizeof(s->in))?-1:0;
+		*end=0;
+		if (sscanf(s->in, "HTTP/1.%*d %d", &s->status)!=1) return -1;
+		const char *cl=strcasestr(s->in, "\r\nContent-Length:");
+		if (cl) s->content_len=atol(cl+17);
+		//A 304 never has a body, whatever the headers say
+		if (s->status==304) s->content_len=0;
+		const char *etag=strcasestr(s->in, "\r\nETag:");
+		if (etag && s->req==REQ_INFO) {
+			etag+=7+strspn(etag+7, " ");
+			int n=strcspn(etag, "\r");
+			snprintf(s->etag, sizeof(s->etag), "%.*s", n, etag);
+		}
+		const char *conn=strcasestr(s->in, "\r\nConnection:");
+		if (conn && strncasecmp(conn+13+strspn(conn+13, " "), "close", 5)==0) s->conn_close=1;
+		if (strncmp(s->in, "HTTP/1.0", 8)==0 && !(conn && strcasestr(conn, "keep-alive"))) s->conn_close=1;
+		//Without a length, the end of the body is the end of the connection.
+		if (s->content_len<0) s->conn_close=1;
+		s->hdr_done=1;
+		int hdr_len=end-s->in+4;
+		memmove(s->in, s->in+hdr_len, s->in_len-hdr_len);
+		s->in_len-=hdr_len;
+	}
+	if (s->req==REQ_INFO) {
+		int n=s->in_len;
+		if (s->info_len+n>INFO_BUF) n=INFO_BUF-s->info_len;
+		memcpy(s->info+s->info_len, s->in, n);
+		s->info_len+=n;
+	} else if (s->req==REQ_BUNDLE && s->status==200) {
+		parse_bundle(s, (uint8_t*)s->in, s->in_len);
+	}
+	s->body_len+=s->in_len;
+	s->in_len=0;
+	if (s->content_len>=0 && s->body_len>=s->content_len) return 1;
+	return 0;
+}
+
+static void handle_event(session_t *s, uint32_t events) {
+	s->last_io=now_us();
+	if (s->delayed) {
+		//The server closed the kept-alive connection; the next request gets a new one.
+		epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+		close(s->fd);
+		s->fd=-1;
+		return;
+	}
+	if (s->state==S_CONNECTING) {
+		int err=0;
+		socklen_t len=sizeof(err);
+		getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err || (events&EPOLLERR)) {
+			session_fail(s, ERR_CONNECT);
+			return;
+		}
+		s->state=S_SENDING;
+	}
+	if (s->state==S_SENDING) {
+		while (s->out_pos<s->out_len) {
+			ssize_t r=send(s->fd, s->out+s->out_pos, s->out_len-s->out_pos, MSG_NOSIGNAL);
+			if (r<0 && errno==EAGAIN) return;
+			if (r<0) {
+				session_fail(s, ERR_IO);
+				return;
+			}
+			s->out_pos+=r;
+		}
+		s->state=S_RECEIVING;
+		struct epoll_event ev={.events=EPOLLIN, .data.ptr=s};
+		epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+		return;
+	}
+	while (1) {
+		ssize_t r=recv(s->fd, s->in+s->in_len, sizeof(s->in)-s->in_len, 0);
+		if (r<0 && errno==EAGAIN) return;
+		if (r<0) {
+			session_fail(s, ERR_IO);
+			return;
+		}
+		if (r==0) {
+			//Fine if that's how the body ends; otherwise the server hung up on us.
+			if (s->hdr_done && s->content_len<0) {
+				request_done(s);
+			} else {
+				session_fail(s, ERR_IO);
+			}
+			return;
+		}
+		s->in_len+=r;
+		int res=process_input(s);
+		if (res<0) {
+			session_fail(s, ERR_PARSE);
+			return;
+		}
+		if (res>0) {
+			request_done(s);
+			return;
+		}
+	}
+}
+
+static void check_timeouts(uint64_t now) {
+	session_t *s=in_flight;
+	while (s) {
+		session_t *next=s->next;
+		if (!s->delayed && now-s->last_io>REQ_TIMEOUT_US) session_fail(s, ERR_TIMEOUT);
+		s=next;
+	}
+}
+
+//Sends the requests whose simulated round trip is over. Returns how long until the next
+//one is, in ms.
+static int send_delayed(uint64_t now) {
+	int wait=100;
+	session_t *s=in_flight;
+	while (s) {
+		session_t *next=s->next;
+		if (s->delayed) {
+			if (s->send_at<=now) {
+				send_request(s);
+			} else if ((s->send_at-now+999)/1000<(uint64_t)wait) {
+				wait=(s->send_at-now+999)/1000;
+			}
+		}
+		s=next;
+	}
+	return wait;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x=*(const uint32_t*)a, y=*(const uint32_t*)b;
+	return (x<y)?-1:(x>y);
+}
+
+static double percentile(samples_t *s, double p) {
+	if (!s->n) return 0;
+	size_t i=p*(s->n-1)+0.5;
+	return s->v[i]/1000.0;
+}
+
+static void report(double secs) {
+	printf("\n%d frames, %.0f s check-in interval, %.1f s run, %d max in flight%s%s%s, %.0f ms RTT\n",
+			opt.devices, opt.interval_s, secs, opt.concurrency, opt.keepalive?", keep-alive":"",
+			opt.bundle?", bundles":"", opt.etag?", ETags":"", opt.rtt_us/1000.0);
+	printf("check-ins: %llu ok (%llu unchanged), %llu failed (%.2f%%), %.1f/s; %llu images, %llu firmware updates, %llu frames replaced\n",
+			(unsigned long long)sessions_ok, (unsigned long long)sessions_unchanged, (unsigned long long)sessions_failed,
+			100.0*sessions_failed/((sessions_ok+sessions_failed)?(sessions_ok+sessions_failed):1),
+			sessions_ok/secs, (unsigned long long)images_downloaded, (unsigned long long)fw_updates, (unsigned long long)churned);
+	printf("\n%-8s %9s %9s %8s %8s %8s %8s %8s %8s\n", "", "count", "req/s", "MB/s", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+	for (int i=0; i<REQ_TYPES; i++) {
+		samples_t *s=&samples[i];
+		qsort(s->v, s->n, sizeof(uint32_t), cmp_u32);
+		printf("%-8s %9zu %9.1f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n", req_names[i], s->n, s->n/secs,
+				s->bytes/secs/1e6, percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99),
+				percentile(s, 0.999), percentile(s, 1));
+	}
+	qsort(lag.v, lag.n, sizeof(uint32_t), cmp_u32);
+	printf("%-8s %9zu %9s %8s %8.2f %8.2f %8.2f %8.2f %8.2f\n", "lag", lag.n, "", "",
+			percentile(&lag, 0.5), percentile(&lag, 0.9), percentile(&lag, 0.99), percentile(&lag, 0.999), percentile(&lag, 1));
+	printf("\nerrors:");
+	for (int i=0; i<ERR_TYPES; i++) printf(" %s %llu", err_names[i], (unsigned long long)errors[i]);
+	printf("\n(lag is how late check-ins started because too many were in flight)\n");
+}
+
+static int parse_url(const char *url) {
+	if (strncmp(url, "http://", 7)!=0) return 0;
+	const char *h=url+7;
+	const char *slash=strchr(h, '/');
+	int hlen=slash?slash-h:(int)strlen(h);
+	snprintf(host_hdr, sizeof(host_hdr), "%.*s", hlen, h);
+	if (slash) snprintf(base_path, sizeof(base_path), "%s", slash);
+	if (base_path[strlen(base_path)-1]!='/') strcat(base_path, "/");
+	char host[128], port[8]="80";
+	snprintf(host, sizeof(host), "%s", host_hdr);
+	char *colon=strrchr(host, ':');
+	if (colon) {
+		*colon=0;
+		snprintf(port, sizeof(port), "%s", colon+1);
+	}
+	struct addrinfo hints={.ai_socktype=SOCK_STREAM}, *ai;
+	if (getaddrinfo(host, port, &hints, &ai)!=0) return 0;
+	memcpy(&srv_addr, ai->ai_addr, ai->ai_addrlen);
+	srv_addr_len=ai->ai_addrlen;
+	freeaddrinfo(ai);
+	return 1;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [options] http://host:port/path/\n", name);
+	fprintf(stderr, "       %s [options] -S       (run against a built-in stand-in server)\n", name);
+	fprintf(stderr, "       %s -s port [-r secs] (only run the stand-in server)\n", name);
+	fprintf(stderr, "  -n frames    number of simulated frames (%d)\n", opt.devices);
+	fprintf(stderr, "  -i secs      check-in interval per frame (%.0f)\n", opt.interval_s);
+	fprintf(stderr, "  -j frac      random jitter on the interval (%.2f)\n", opt.jitter);
+	fprintf(stderr, "  -t secs      how long to run (%.0f)\n", opt.duration_s);
+	fprintf(stderr, "  -c n         max check-ins in flight (%d)\n", opt.concurrency);
+	fprintf(stderr, "  -C frac      chance a check-in comes from a new frame with empty flash (%.2f)\n", opt.churn);
+	fprintf(stderr, "  -u frac      fraction of frames that start with outdated firmware (%.2f)\n", opt.outdated);
+	fprintf(stderr, "  -k           keep connections open between requests of a check-in\n");
+	fprintf(stderr, "  -b           get all missing images in one epd-bundle.php request\n");
+	fprintf(stderr, "  -e           send the ETag of the last info, like newer firmware does\n");
+	fprintf(stderr, "  -l ms        simulated network round-trip time (0)\n");
+	fprintf(stderr, "  -r secs      stand-in server: new image every secs seconds (10)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int standin=0, standin_port=-1, churn_s=10;
+	int c;
+	while ((c=getopt(argc, argv, "n:i:j:t:c:C:u:kbel:Ss:r:"))!=-1) {
+		switch (c) {
+			case 'n': opt.devices=atoi(optarg); break;
+			case 'i': opt.interval_s=atof(optarg); break;
+			case 'j': opt.jitter=atof(optarg); break;
+			case 't': opt.duration_s=atof(optarg); break;
+			case 'c': opt.concurrency=atoi(optarg); break;
+			case 'C': opt.churn=atof(optarg); break;
+			case 'u': opt.outdated=atof(optarg); break;
+			case 'k': opt.keepalive=1; break;
+			case 'b': opt.bundle=1; break;
+			case 'e': opt.etag=1; break;
+			case 'l': opt.rtt_us=atof(optarg)*1000; break;
+			case 'S': standin=1; break;
+			case 's': standin_port=atoi(optarg); break;
+			case 'r': churn_s=atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	//Every in-flight check-in needs a socket.
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur=rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	if (standin_port>=0) {
+		int port=standin_start(standin_port, churn_s);
+		if (port<0) exit(1);
+		printf("Stand-in server on 127.0.0.1:%d, new image every %d s\n", port, churn_s);
+		while (1) pause();
+	}
+	char url[64];
+	if (standin) {
+		int port=standin_start(0, churn_s);
+		if (port<0) exit(1);
+		snprintf(url, sizeof(url), "http://127.0.0.1:%d/", port);
+		if (!parse_url(url)) exit(1);
+	} else if (optind<argc) {
+		if (!parse_url(argv[optind])) {
+			fprintf(stderr, "Can't use URL %s\n", argv[optind]);
+			exit(1);
+		}
+	} else {
+		usage(argv[0]);
+	}
+
+	srand(time(NULL));
+	epfd=epoll_create1(EPOLL_CLOEXEC);
+	devs=calloc(opt.devices, sizeof(device_t));
+	heap=calloc(opt.devices, sizeof(device_t*));
+	//Locally administered MACs, so they won't collide with real frames in the database.
+	next_mac=0x02AA00000000ULL;
+	uint64_t start=now_us();
+	for (int i=0; i<opt.devices; i++) {
+		device_reset(&devs[i]);
+		//Spread the first check-ins over one interval
+		devs[i].due=start+frand()*opt.interval_s*1e6;
+		heap_push(&devs[i]);
+	}
+
+	uint64_t end=start+opt.duration_s*1e6;
+	uint64_t next_progress=start+PROGRESS_US, next_timeout_check=start;
+	struct epoll_event events[256];
+	while (1) {
+		uint64_t now=now_us();
+		if (now>=end) break;
+		while (heap_len && heap[0]->due<=now && in_flight_count<opt.concurrency) {
+			device_t *d=heap_pop();
+			sample_add(&lag, now-d->due, 0);
+			session_begin(d);
+		}
+		int timeout=opt.rtt_us?send_delayed(now):100;
+		if (heap_len && in_flight_count<opt.concurrency && heap[0]->due>now) {
+			uint64_t wait=(heap[0]->due-now+999)/1000;
+			if (wait<(uint64_t)timeout) timeout=wait;
+		}
+		int n=epoll_wait(epfd, events, 256, timeout);
+		for (int i=0; i<n; i++) handle_event(events[i].data.ptr, events[i].events);
+		now=now_us();
+		if (now>=next_timeout_check) {
+			check_timeouts(now);
+			next_timeout_check=now+100000;
+		}
+		if (now>=next_progress) {
+			printf("%5.0f s: %llu check-ins, %llu failed, %d in flight\n", (now-start)/1e6,
+					(unsigned long long)sessions_ok, (unsigned long long)sessions_failed, in_flight_count);
+			fflush(stdout);
+			next_progress+=PROGRESS_US;
+		}
+	}
+	//Check-ins still in flight when time's up are left out.
+	report((now_us()-start)/1e6);
+	return 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+//Same as the firmware (epd_flash_image.h)
+#define IMG_SLOT_COUNT 10
+#define IMG_HDR_BYTES 64
+#define IMG_BYTES (IMG_HDR_BYTES+600*448/2)
+
+//base64 of the app SHA the stand-in server claims picframe.bin has
+#define STANDIN_FW_SHA "c3RhbmQtaW4gZmlybXdhcmUgaW1hZ2Ugc2hhMjU2ISE="
+
+//Starts the stand-in sync server on 127.0.0.1 in a thread of its own. Port 0 picks a
+//free port. A new image appears every image_churn_s seconds (never if 0). Returns the
+//port, or -1 on error.
+int standin_start(int port, int image_churn_s);
@@ -0,0 +1,263 @@
+/*
+A stand-in for the sync server, so loadgen can be run without a web server and database.
+It speaks the same protocol as epd-info.php (including the ETags), epd-img.php and
+epd-bundle.php, with made-up images, and adds a new image every so often so the simulated frames have something to
+download.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <endian.h>
+#include "loadgen.h"
+
+#define REQ_MAX 2048
+#define FW_SIZE (1024*1024)
+
+typedef struct {
+	char in[REQ_MAX];
+	int in_len;
+	char hdr[1024];
+	int hdr_len, hdr_pos;
+	const uint8_t *body;
+	size_t body_len, body_pos;
+	uint8_t *bundle;		//body of a bundle response, if that's what we're sending
+	int keepalive;
+} sconn_t;
+
+static int lfd, epfd;
+static int churn_s;
+static time_t start_time;
+static uint8_t *image_data, *fw_data;
+static sconn_t **sconns;
+static int sconns_size;
+
+//The server's image list: the newest MANIFEST_IMAGES ids, newest first. A new one
+//appears every churn_s seconds.
+static void current_images(int *ids) {
+	int newest=IMG_SLOT_COUNT;
+	if (churn_s>0) newest+=(time(NULL)-start_time)/churn_s;
+	for (int i=0; i<IMG_SLOT_COUNT; i++) ids[i]=newest-i;
+}
+
+static void sconn_close(int fd) {
+	free(sconns[fd]->bundle);
+	free(sconns[fd]);
+	sconns[fd]=NULL;
+	close(fd);
+}
+
+static void respond_hdrs(sconn_t *c, int code, const char *type, const char *hdrs, const void *body, size_t len) {
+	if (c->bundle!=body) {
+		free(c->bundle);
+		c->bundle=NULL;
+	}
+	c->hdr_len=snprintf(c->hdr, sizeof(c->hdr), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sConnection: %s\r\n\r\n",
+			code, (code==200)?"OK":(code==304)?"Not Modified":"Not Found", type, len, hdrs, c->keepalive?"keep-alive":"close");
+	c->hdr_pos=0;
+	c->body=body;
+	c->body_len=len;
+	c->body_pos=0;
+}
+
+static void respond(sconn_t *c, int code, const char *type, const void *body, size_t len) {
+	respond_hdrs(c, code, type, "", body, len);
+}
+
+static void handle(sconn_t *c, char *target, const char *if_none_match) {
+	static char json[512];
+	char hdrs[96];
+	char *query=strchr(target, '?');
+	if (query) *query++=0; else query="";
+	char *base=strrchr(target, '/');
+	base=base?base+1:target;
+	if (strcmp(base, "epd-info.php")==0) {
+		int ids[IMG_SLOT_COUNT];
+		current_images(ids);
+		//Only the images change, so the newest one will do as ETag.
+		char etag[16];
+		snprintf(etag, sizeof(etag), "\"%d\"", ids[0]);
+		if (strcmp(if_none_match, etag)==0) {
+			snprintf(hdrs, sizeof(hdrs), "ETag: %s\r\nX-Time: %lld\r\n", etag, (long long)time(NULL));
+			respond_hdrs(c, 304, "text/json", hdrs, "", 0);
+			return;
+		}
+		char *p=json+sprintf(json, "{\"time\":%lld,\"fw_sha\":\"%s\",\"fw_upd\":\"picframe.bin\",\"tz\":\"CST-8\",\"update_hour\":3,\"images\":[",
+				(long long)time(NULL), STANDIN_FW_SHA);
+		for (int i=0; i<IMG_SLOT_COUNT; i++) p+=sprintf(p, "%s%d", i?",":"", ids[i]);
+		p+=sprintf(p, "]}");
+		snprintf(hdrs, sizeof(hdrs), "ETag: %s\r\n", etag);
+		respond_hdrs(c, 200, "text/json", hdrs, json, p-json);
+	} else if (strcmp(base, "epd-img.php")==0) {
+		char *idp=strstr(query, "id=");
+		int id=idp?atoi(idp+3):0;
+		int ids[IMG_SLOT_COUNT];
+		current_images(ids);
+		if (id>0 && id<=ids[0]) {
+			respond(c, 200, "image/epd", image_data, IMG_BYTES);
+		} else {
+			respond(c, 404, "text/plain", "", 0);
+		}
+	} else if (strcmp(base, "epd-bundle.php")==0) {
+		//Frames of id and length (little-endian uint32s) plus data; id 0 ends it.
+		int ids[IMG_SLOT_COUNT];
+		current_images(ids);
+		free(c->bundle);
+		c->bundle=malloc(8+IMG_SLOT_COUNT*(8+IMG_BYTES));
+		size_t len=0;
+		char *p=strstr(query, "ids=");
+		p=p?p+4:"";
+		for (int n=0; *p && n<IMG_SLOT_COUNT; n++) {
+			uint32_t id=strtoul(p, &p, 10);
+			uint32_t ilen=(id>0 && (int)id<=ids[0])?IMG_BYTES:0;
+			uint32_t hdr[2]={htole32(id), htole32(ilen)};
+			memcpy(c->bundle+len, hdr, 8);
+			memcpy(c->bundle+len+8, image_data, ilen);
+			len+=8+ilen;
+			if (*p!=',') break;
+			p++;
+		}
+		memset(c->bundle+len, 0, 8);
+		len+=8;
+		respond(c, 200, "application/x-epd-bundle", c->bundle, len);
+	} else if (strcmp(base, "picframe.bin")==0) {
+		respond(c, 200, "application/octet-stream", fw_data, FW_SIZE);
+	} else {
+		respond(c, 404, "text/plain", "", 0);
+	}
+}
+
+//Returns 0 to keep the connection, -1 to close it.
+static int sconn_run(int fd, sconn_t *c) {
+	while (1) {
+		//Send whatever is pending
+		while (c->hdr_pos<c->hdr_len || c->body_pos<c->body_len) {
+			ssize_t r;
+			if (c->hdr_pos<c->hdr_len) {
+				r=send(fd, c->hdr+c->hdr_pos, c->hdr_len-c->hdr_pos, MSG_NOSIGNAL|(c->body_len?MSG_MORE:0));
+				if (r>0) c->hdr_pos+=r;
+			} else {
+				r=send(fd, c->body+c->body_pos, c->body_len-c->body_pos, MSG_NOSIGNAL);
+				if (r>0) c->body_pos+=r;
+			}
+			if (r<0) {
+				if (errno!=EAGAIN) return -1;
+				struct epoll_event ev={.events=EPOLLOUT, .data.fd=fd};
+				epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+				return 0;
+			}
+			if (c->hdr_pos==c->hdr_len && c->body_pos==c->body_len) {
+				c->hdr_len=c->hdr_pos=0;
+				c->body_len=c->body_pos=0;
+				if (!c->keepalive) return -1;
+			}
+		}
+		//Take the next request, if there's a complete one
+		char *end=memmem(c->in, c->in_len, "\r\n\r\n", 4);
+		if (!end) {
+			if (c->in_len==REQ_MAX) return -1;
+			struct epoll_event ev={.events=EPOLLIN, .data.fd=fd};
+			epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+			return 0;
+		}
+		*end=0;
+		char target[512], version[16];
+		if (sscanf(c->in, "GET %511s %15s", target, version)!=2) return -1;
+		const char *conn=strcasestr(c->in, "\r\nConnection:");
+		c->keepalive=(strcmp(version, "HTTP/1.1")==0);
+		if (conn) c->keepalive=(strcasestr(conn, "keep-alive")!=NULL);
+		char inm[24]="";
+		const char *h=strcasestr(c->in, "\r\nIf-None-Match:");
+		if (h) sscanf(h+16, " %23s", inm);
+		int req_len=end-c->in+4;
+		memmove(c->in, c->in+req_len, c->in_len-req_len);
+		c->in_len-=req_len;
+		handle(c, target, inm);
+	}
+}
+
+static void *standin_thread(void *arg) {
+	struct epoll_event events[64];
+	while (1) {
+		int n=epoll_wait(epfd, events, 64, -1);
+		for (int i=0; i<n; i++) {
+			int fd=events[i].data.fd;
+			if (fd==lfd) {
+				int cfd;
+				while ((cfd=accept4(lfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC))>=0) {
+					if (cfd>=sconns_size) {
+						int ns=cfd*2;
+						sconns=realloc(sconns, ns*sizeof(sconn_t*));
+						memset(sconns+sconns_size, 0, (ns-sconns_size)*sizeof(sconn_t*));
+						sconns_size=ns;
+					}
+					int one=1;
+					setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+					sconns[cfd]=calloc(1, sizeof(sconn_t));
+					struct epoll_event ev={.events=EPOLLIN, .data.fd=cfd};
+					epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev);
+				}
+				continue;
+			}
+			sconn_t *c=sconns[fd];
+			if (!c) continue;
+			if (events[i].events&EPOLLIN) {
+				ssize_t r=recv(fd, c->in+c->in_len, REQ_MAX-c->in_len, 0);
+				if (r==0 || (r<0 && errno!=EAGAIN)) {
+					sconn_close(fd);
+					continue;
+				}
+				if (r>0) c->in_len+=r;
+			} else if (events[i].events&(EPOLLERR|EPOLLHUP)) {
+				sconn_close(fd);
+				continue;
+			}
+			if (sconn_run(fd, c)<0) sconn_close(fd);
+		}
+	}
+	return NULL;
+}
+
+int standin_start(int port, int image_churn_s) {
+	churn_s=image_churn_s;
+	start_time=time(NULL);
+	//Contents don't matter, only the sizes do.
+	image_data=malloc(IMG_BYTES);
+	memset(image_data, 0x11, IMG_BYTES);
+	fw_data=malloc(FW_SIZE);
+	memset(fw_data, 0xff, FW_SIZE);
+
+	lfd=socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	int one=1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr={.sin_family=AF_INET, .sin_port=htons(port), .sin_addr.s_addr=htonl(INADDR_LOOPBACK)};
+	if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(lfd, 4096)<0) {
+		perror("stand-in server");
+		return -1;
+	}
+	socklen_t alen=sizeof(addr);
+	getsockname(lfd, (struct sockaddr*)&addr, &alen);
+	epfd=epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev={.events=EPOLLIN, .data.fd=lfd};
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+	pthread_t t;
+	pthread_create(&t, NULL, standin_thread, NULL);
+	return ntohs(addr.sin_port);
+}
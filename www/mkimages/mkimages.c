@@ -0,0 +1,239 @@
+/*
+Builds the contents of the images partition on the host, so a new frame can get all its
+images written at the factory in one go instead of uploading them one by one. Images are
+converted with conv, a few at a time, and put in the slots the way the firmware writes
+them: every image at a multiple of IMG_SIZE_BYTES, the rest of the partition erased (0xFF).
+The firmware finds out which slots hold an image from their headers, so nothing needs to go
+in NVS.
+
+Usage: mkimages [-o images.bin] [-j jobs] [-c conv] [-a "conv options"] [-P partitions.csv]
+          image1.[jpg|png|bin] [image2 ...]
+       Images go in slot 0, 1, ... in the order given. .bin files (conv output) are used as
+       they are.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "epd_flash_image.h"
+
+extern char **environ;
+
+//Size of the images partition in firmware/partitions.csv; -P reads it from there instead.
+#define IMAGES_PART_SIZE 0x150000
+//What conv writes: the header and the image data, but not the padding.
+#define IMAGE_LEN (sizeof(flash_image_t)-sizeof(((flash_image_t*)0)->padding))
+#define MAX_CONV_ARGS 16
+
+static const char *conv="";
+static char *conv_args[MAX_CONV_ARGS];
+static int conv_argc;
+static char **inputs;
+static int input_count;
+static uint8_t *part;
+
+static pthread_mutex_t mutex=PTHREAD_MUTEX_INITIALIZER;
+static int next_input;
+static int failed;
+
+//Reads an earlier conv output. Returns 0 if the file isn't one.
+static int read_bin(const char *name, uint8_t *slot) {
+	FILE *f=fopen(name, "rb");
+	if (!f) return 0;
+	size_t n=fread(slot, 1, IMAGE_LEN, f);
+	fclose(f);
+	return (n==IMAGE_LEN && img_valid((flash_image_hdr_t*)slot));
+}
+
+//Runs conv on an image, with the output going into the slot.
+static int convert(const char *name, uint8_t *slot) {
+	char *argv[MAX_CONV_ARGS+3];
+	int argc=0;
+	argv[argc++]=(char*)conv;
+	for (int i=0; i<conv_argc; i++) argv[argc++]=conv_args[i];
+	argv[argc++]=(char*)name;
+	argv[argc]=NULL;
+
+	int fds[2];
+	if (pipe(fds)!=0) {
+		perror("pipe");
+		return 0;
+	}
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addclose(&fa, fds[0]);
+	posix_spawn_file_actions_addclose(&fa, fds[1]);
+	pid_t pid;
+	int err=posix_spawn(&pid, conv, &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	close(fds[1]);
+	if (err!=0) {
+		fprintf(stderr, "%s: %s\n", conv, strerror(err));
+		close(fds[0]);
+		return 0;
+	}
+	size_t pos=0;
+	while (pos<IMAGE_LEN) {
+		ssize_t n=read(fds[0], slot+pos, IMAGE_LEN-pos);
+		if (n<=0) break;
+		pos+=n;
+	}
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)!=0 || pos!=IMAGE_LEN ||
+			!img_valid((flash_image_hdr_t*)slot)) {
+		fprintf(stderr, "%s: conversion failed\n", name);
+		//Leave the slot empty rather than half written
+		memset(slot, 0xff, IMG_SIZE_BYTES);
+		return 0;
+	}
+	return 1;
+}
+
+static void *worker(void *arg) {
+	while (1) {
+		pthread_mutex_lock(&mutex);
+		int i=next_input++;
+		pthread_mutex_unlock(&mutex);
+		if (i>=input_count) break;
+		uint8_t *slot=&part[i*IMG_SIZE_BYTES];
+		const char *how="as it is";
+		int ok=read_bin(inputs[i], slot);
+		if (!ok) {
+			memset(slot, 0xff, IMAGE_LEN);
+			ok=convert(inputs[i], slot);
+			how="converted";
+		}
+		pthread_mutex_lock(&mutex);
+		if (ok) {
+			printf("slot %d: %s (%s)\n", i, inputs[i], how);
+		} else {
+			failed++;
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+//Finds the size of the images partition in an ESP-IDF partition table csv.
+static long part_size_from_csv(const char *name) {
+	FILE *f=fopen(name, "r");
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	char line[256];
+	long size=-1;
+	while (fgets(line, sizeof(line), f)) {
+		//name, type, subtype, offset, size, flags
+		char *field[6]={0};
+		int n=0;
+		char *p=line;
+		while (n<6) {
+			while (isspace((unsigned char)*p)) p++;
+			field[n++]=p;
+			p=strchr(p, ',');
+			if (!p) break;
+			*p++=0;
+		}
+		if (n<5 || strncmp(field[0], "images", 6)!=0 || (field[0][6]!=0 && !isspace((unsigned char)field[0][6]))) continue;
+		char *end;
+		size=strtol(field[4], &end, 0);
+		if (*end=='K' || *end=='k') size*=1024;
+		if (*end=='M' || *end=='m') size*=1024*1024;
+	}
+	fclose(f);
+	if (size<0) fprintf(stderr, "%s: no images partition\n", name);
+	return size;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-o images.bin] [-j jobs] [-c conv] [-a \"conv options\"] [-P partitions.csv]\n", name);
+	fprintf(stderr, "          image1.[jpg|png|bin] [image2 ...]\n");
+	fprintf(stderr, "Up to %d images; .bin files are used as they are, the rest go through conv.\n", IMG_SLOT_COUNT);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *outfile="images.bin";
+	int jobs=sysconf(_SC_NPROCESSORS_ONLN);
+	long part_size=IMAGES_PART_SIZE;
+	int c;
+	while ((c=getopt(argc, argv, "o:j:c:a:P:"))!=-1) {
+		if (c=='o') {
+			outfile=optarg;
+		} else if (c=='j') {
+			jobs=atoi(optarg);
+		} else if (c=='c') {
+			conv=optarg;
+		} else if (c=='a') {
+			for (char *t=strtok(optarg, " "); t; t=strtok(NULL, " ")) {
+				if (conv_argc==MAX_CONV_ARGS) usage(argv[0]);
+				conv_args[conv_argc++]=t;
+			}
+		} else if (c=='P') {
+			part_size=part_size_from_csv(optarg);
+			if (part_size<0) exit(1);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	inputs=&argv[optind];
+	input_count=argc-optind;
+	if (input_count<1 || input_count>IMG_SLOT_COUNT) usage(argv[0]);
+	if (jobs<1) jobs=1;
+	if (part_size<IMG_SLOT_COUNT*IMG_SIZE_BYTES) {
+		fprintf(stderr, "Images partition is 0x%lx bytes; %d slots need 0x%x\n",
+				part_size, IMG_SLOT_COUNT, IMG_SLOT_COUNT*IMG_SIZE_BYTES);
+		exit(1);
+	}
+	//By default, conv is where it is in this tree: ../conv/conv from here.
+	char conv_buf[1024];
+	if (conv[0]==0) {
+		const char *slash=strrchr(argv[0], '/');
+		int dirlen=slash?(slash-argv[0]+1):0;
+		snprintf(conv_buf, sizeof(conv_buf), "%.*s../conv/conv", dirlen, argv[0]);
+		conv=conv_buf;
+	}
+
+	//Whatever isn't written is what erased flash looks like.
+	part=malloc(part_size);
+	if (!part) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(part, 0xff, part_size);
+
+	if (jobs>input_count) jobs=input_count;
+	pthread_t threads[jobs];
+	for (int i=0; i<jobs; i++) pthread_create(&threads[i], NULL, worker, NULL);
+	for (int i=0; i<jobs; i++) pthread_join(threads[i], NULL);
+	if (failed) {
+		fprintf(stderr, "%d image(s) failed, not writing %s\n", failed, outfile);
+		exit(1);
+	}
+
+	FILE *f=fopen(outfile, "wb");
+	if (!f || fwrite(part, 1, part_size, f)!=part_size) {
+		perror(outfile);
+		exit(1);
+	}
+	fclose(f);
+	printf("Wrote %s: %d image(s), 0x%lx bytes\n", outfile, input_count, part_size);
+	return 0;
+}
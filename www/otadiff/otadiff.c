@@ -0,0 +1,299 @@
+/*
+Makes delta firmware updates. Given the firmware image frames are running now and the new
+one, this writes a patch the frame can apply while downloading it: a list of COPY (take
+bytes from the running image) and ADD (take these bytes from the patch) operations. See
+otapatch.h for the format.
+
+Usage: otadiff [-o dir] new.bin old1.bin [old2.bin ...]
+          Writes a patch from each old image to the new one, named like the frames ask
+          for them (<old sha>-<new sha>.patch), and prints how much smaller they are.
+       otadiff -a old.bin x.patch out.bin
+          Applies a patch, to check it.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "otapatch.h"
+
+//Matches are found by hashing this many bytes
+#define HASH_LEN 8
+#define HASH_BITS 20
+//How many earlier positions with the same hash we look at
+#define MAX_CHAIN 64
+//A COPY in the middle of an ADD costs two op headers; shorter matches aren't worth it.
+#define MIN_MATCH (2*PATCH_OP_HDR_LEN+4)
+
+typedef struct {
+	uint8_t *data;
+	size_t len;
+	uint8_t sha[32];
+} image_t;
+
+static int load_image(const char *name, image_t *img) {
+	FILE *f=fopen(name, "rb");
+	if (!f) {
+		perror(name);
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	img->len=ftell(f);
+	rewind(f);
+	img->data=malloc(img->len);
+	if (fread(img->data, 1, img->len, f)!=img->len) {
+		perror(name);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	//Same as get_app_image_data() in epd-info.php: the app SHA is in the app description,
+	//which is somewhere in the first 4K.
+	const uint8_t magic[4]={0x32, 0x54, 0xCD, 0xAB};
+	size_t search=(img->len<4096)?img->len:4096;
+	uint8_t *p=memmem(img->data, search, magic, 4);
+	size_t shapos=p?(p-img->data)+4+4+8+32+32+16+16+32:0;
+	if (!p || p==img->data || shapos+32>img->len) {
+		fprintf(stderr, "%s: can't find the app description; is this an app image?\n", name);
+		return 0;
+	}
+	memcpy(img->sha, img->data+shapos, 32);
+	return 1;
+}
+
+static void sha_hex(const uint8_t *sha, char *hex) {
+	for (int i=0; i<PATCH_NAME_SHA_BYTES; i++) sprintf(hex+i*2, "%02X", sha[i]);
+}
+
+static uint32_t hash(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return (v*0x9E3779B97F4A7C15ULL)>>(64-HASH_BITS);
+}
+
+static void put32(FILE *f, uint32_t v) {
+	uint8_t b[4]={v, v>>8, v>>16, v>>24};
+	fwrite(b, 4, 1, f);
+}
+
+typedef struct {
+	FILE *f;
+	size_t copy_bytes, add_bytes, ops;
+} out_t;
+
+static void emit_add(out_t *o, const uint8_t *data, size_t len) {
+	while (len>0) {
+		uint32_t n=(len>0x7fffffff)?0x7fffffff:len;
+		fputc(PATCH_OP_ADD, o->f);
+		put32(o->f, n);
+		put32(o->f, 0);
+		fwrite(data, n, 1, o->f);
+		o->add_bytes+=n;
+		o->ops++;
+		data+=n;
+		len-=n;
+	}
+}
+
+static void emit_copy(out_t *o, size_t src, size_t len) {
+	fputc(PATCH_OP_COPY, o->f);
+	put32(o->f, len);
+	put32(o->f, src);
+	o->copy_bytes+=len;
+	o->ops++;
+}
+
+//Greedy matching: at every position in the new image, find the longest run that's also
+//in the old one (trying the spot right after the previous match first, as code that
+//didn't change tends to stay in the same order). Returns the patch size.
+static long make_patch(const image_t *src, const image_t *dst, const char *fname, out_t *o) {
+	o->f=fopen(fname, "wb");
+	if (!o->f) {
+		perror(fname);
+		return -1;
+	}
+	patch_hdr_t hdr={.magic=PATCH_MAGIC, .version=PATCH_VERSION, .dst_len=dst->len};
+	memcpy(hdr.src_sha, src->sha, 32);
+	memcpy(hdr.dst_sha, dst->sha, 32);
+	fwrite(&hdr, sizeof(hdr), 1, o->f);
+
+	int32_t *head=malloc(sizeof(int32_t)<<HASH_BITS);
+	memset(head, 0xff, sizeof(int32_t)<<HASH_BITS);
+	int32_t *chain=malloc(src->len*sizeof(int32_t));
+	for (size_t i=0; i+HASH_LEN<=src->len; i++) {
+		uint32_t h=hash(src->data+i);
+		chain[i]=head[h];
+		head[h]=i;
+	}
+
+	size_t pos=0, add_start=0, next_src=0;
+	while (pos<dst->len) {
+		size_t best_len=0, best_src=0;
+		size_t maxlen=dst->len-pos;
+		//Right after the previous match
+		if (next_src<src->len) {
+			size_t l=0;
+			while (l<maxlen && next_src+l<src->len && src->data[next_src+l]==dst->data[pos+l]) l++;
+			best_len=l;
+			best_src=next_src;
+		}
+		if (best_len<MIN_MATCH && pos+HASH_LEN<=dst->len) {
+			int32_t cand=head[hash(dst->data+pos)];
+			for (int n=0; cand>=0 && n<MAX_CHAIN; n++, cand=chain[cand]) {
+				size_t l=0;
+				while (l<maxlen && cand+l<src->len && src->data[cand+l]==dst->data[pos+l]) l++;
+				if (l>best_len) {
+					best_len=l;
+					best_src=cand;
+				}
+			}
+		}
+		if (best_len<MIN_MATCH) {
+			pos++;
+			continue;
+		}
+		//Grow the match backwards into bytes we'd otherwise ADD
+		while (pos>add_start && best_src>0 && src->data[best_src-1]==dst->data[pos-1]) {
+			pos--;
+			best_src--;
+			best_len++;
+		}
+		if (pos>add_start) emit_add(o, dst->data+add_start, pos-add_start);
+		emit_copy(o, best_src, best_len);
+		pos+=best_len;
+		add_start=pos;
+		next_src=best_src+best_len;
+	}
+	if (pos>add_start) emit_add(o, dst->data+add_start, pos-add_start);
+	fputc(PATCH_OP_END, o->f);
+	long size=ftell(o->f);
+	fclose(o->f);
+	free(head);
+	free(chain);
+	return size;
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+//Applies a patch the way the firmware does, as a check.
+static int apply_patch(const char *srcname, const char *patchname, const char *outname) {
+	image_t src, patch={0};
+	if (!load_image(srcname, &src)) return 0;
+	FILE *f=fopen(patchname, "rb");
+	if (!f) {
+		perror(patchname);
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	patch.len=ftell(f);
+	rewind(f);
+	patch.data=malloc(patch.len);
+	if (fread(patch.data, 1, patch.len, f)!=patch.len) patch.len=0;
+	fclose(f);
+	patch_hdr_t hdr;
+	if (patch.len<sizeof(hdr)) goto bad;
+	memcpy(&hdr, patch.data, sizeof(hdr));
+	if (hdr.magic!=PATCH_MAGIC || hdr.version!=PATCH_VERSION) goto bad;
+	if (memcmp(hdr.src_sha, src.sha, 32)!=0) {
+		fprintf(stderr, "%s isn't a patch for %s\n", patchname, srcname);
+		return 0;
+	}
+	uint8_t *out=malloc(hdr.dst_len);
+	size_t outpos=0, p=sizeof(hdr);
+	while (p+1<=patch.len) {
+		uint8_t op=patch.data[p++];
+		if (op==PATCH_OP_END) break;
+		if (p+8>patch.len) goto bad;
+		uint32_t len=get32(patch.data+p), arg=get32(patch.data+p+4);
+		p+=8;
+		if (outpos+len>hdr.dst_len) goto bad;
+		if (op==PATCH_OP_COPY) {
+			if ((size_t)arg+len>src.len) goto bad;
+			memcpy(out+outpos, src.data+arg, len);
+		} else if (op==PATCH_OP_ADD) {
+			if (p+len>patch.len) goto bad;
+			memcpy(out+outpos, patch.data+p, len);
+			p+=len;
+		} else {
+			goto bad;
+		}
+		outpos+=len;
+	}
+	if (outpos!=hdr.dst_len) goto bad;
+	f=fopen(outname, "wb");
+	if (!f) {
+		perror(outname);
+		return 0;
+	}
+	fwrite(out, outpos, 1, f);
+	fclose(f);
+	printf("%s: %zu bytes\n", outname, outpos);
+	return 1;
+bad:
+	fprintf(stderr, "%s: corrupt patch\n", patchname);
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-o dir] new.bin old1.bin [old2.bin ...]\n", name);
+	fprintf(stderr, "       %s -a old.bin x.patch out.bin\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *outdir=".";
+	int apply=0;
+	int c;
+	while ((c=getopt(argc, argv, "o:a"))!=-1) {
+		if (c=='o') outdir=optarg;
+		else if (c=='a') apply=1;
+		else usage(argv[0]);
+	}
+	if (apply) {
+		if (argc-optind!=3) usage(argv[0]);
+		return apply_patch(argv[optind], argv[optind+1], argv[optind+2])?0:1;
+	}
+	if (argc-optind<2) usage(argv[0]);
+
+	image_t dst;
+	if (!load_image(argv[optind], &dst)) exit(1);
+	char dst_hex[PATCH_NAME_SHA_BYTES*2+1];
+	sha_hex(dst.sha, dst_hex);
+	printf("%s: %zu bytes, app SHA %s...\n", argv[optind], dst.len, dst_hex);
+	int ret=0;
+	for (int i=optind+1; i<argc; i++) {
+		image_t src;
+		if (!load_image(argv[i], &src)) {
+			ret=1;
+			continue;
+		}
+		if (memcmp(src.sha, dst.sha, 32)==0) {
+			printf("%s: same firmware, no patch needed\n", argv[i]);
+			continue;
+		}
+		char src_hex[PATCH_NAME_SHA_BYTES*2+1], fname[1024];
+		sha_hex(src.sha, src_hex);
+		snprintf(fname, sizeof(fname), "%s/%s-%s.patch", outdir, src_hex, dst_hex);
+		out_t o={0};
+		long size=make_patch(&src, &dst, fname, &o);
+		if (size<0) {
+			ret=1;
+			continue;
+		}
+		printf("%s -> %s: %ld bytes, %.1f%% of the full image (%zu ops, %zu bytes copied, %zu added)\n",
+				argv[i], fname, size, 100.0*size/dst.len, o.ops, o.copy_bytes, o.add_bytes);
+		free(src.data);
+	}
+	return ret;
+}
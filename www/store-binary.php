@@ -1,6 +1,7 @@
 <?php
 
 require("config.php");
+require("imgdelta.inc.php");
 
 // Check if binary data was uploaded
 if (!isset($_FILES["binary_data"])) {
@@ -38,6 +39,9 @@ try {
     }
     
     $imageId = $mysqli->insert_id;
+    store_image_deltas($mysqli, $imageId);
+    // Tell syncd (if it runs) there is a new image
+    @touch(__DIR__ . "/syncd.stamp");
     
     $stmt->close();
     $mysqli->close();
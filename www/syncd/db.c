@@ -0,0 +1,563 @@
+/*
+Database side of syncd. Everything that talks to MySQL lives in one thread, so the event
+loop never waits on the database: this thread builds the caches the event loop answers
+check-ins from, and writes the check-ins back in batches.
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <mysql.h>
+#include "syncd.h"
+
+//Flush check-ins after this many, or after FLUSH_INTERVAL seconds, whichever comes first.
+#define BATCH_MAX 512
+#define FLUSH_INTERVAL 1
+//Rebuild the cache this often even if nobody asked, to pick up device settings that
+//were changed directly in the database.
+#define RELOAD_INTERVAL 300
+//If the database can't keep up, drop check-ins rather than eat all memory.
+#define QUEUE_MAX 65536
+//seq,kind,battery_mv,images and 10 phases
+#define TEL_FIELDS 14
+
+static db_config_t cfg;
+static int notify_fd;
+static MYSQL *mysql;
+
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond=PTHREAD_COND_INITIALIZER;
+static checkin_t *queue;
+static int queue_len, queue_cap;
+static int reload_requested=1;
+static cache_t *pending_cache;
+static long dropped_checkins;
+
+//Images we've already pulled out of the database. The fds are ours; every cache gets
+//its own dup()s, so it doesn't matter which one is freed first.
+static image_t loaded_images[MANIFEST_IMAGES];
+static int loaded_image_count;
+//Same for image deltas.
+static image_t *loaded_deltas;
+static int loaded_delta_count;
+
+static const char b64chars[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void base64(const uint8_t *in, int len, char *out) {
+	for (int i=0; i<len; i+=3) {
+		uint32_t v=in[i]<<16;
+		if (i+1<len) v|=in[i+1]<<8;
+		if (i+2<len) v|=in[i+2];
+		*out++=b64chars[(v>>18)&63];
+		*out++=b64chars[(v>>12)&63];
+		*out++=(i+1<len)?b64chars[(v>>6)&63]:'=';
+		*out++=(i+2<len)?b64chars[v&63]:'=';
+	}
+	*out=0;
+}
+
+void firmware_sha(const char *path, firmware_t *fw) {
+	fw->sha[0]=0;
+	fw->sha_hex[0]=0;
+	FILE *f=fopen(path, "r");
+	if (!f) return;
+	uint8_t data[4096];
+	size_t n=fread(data, 1, sizeof(data), f);
+	fclose(f);
+	const uint8_t magic[4]={0x32, 0x54, 0xCD, 0xAB}; //0xABCD5432 little-endian
+	uint8_t *p=memmem(data, n, magic, 4);
+	//Same as the PHP: a magic at position 0 counts as not found.
+	if (p==NULL || p==data) return;
+	size_t shapos=(p-data)+4+4+8+32+32+16+16+32;
+	if (shapos+32>n) return;
+	base64(data+shapos, 32, fw->sha);
+	for (int i=0; i<8; i++) sprintf(fw->sha_hex+i*2, "%02X", data[shapos+i]);
+}
+
+void cache_free(cache_t *c) {
+	for (int i=0; i<c->image_count; i++) close(c->images[i].fd);
+	for (int i=0; i<c->delta_count; i++) close(c->deltas[i].fd);
+	free(c->deltas);
+	free(c->devices);
+	free(c->firmware);
+	free(c);
+}
+
+const device_t *cache_find_device(const cache_t *c, uint64_t mac) {
+	int lo=0, hi=c->device_count-1;
+	while (lo<=hi) {
+		int mid=(lo+hi)/2;
+		if (c->devices[mid].mac==mac) return &c->devices[mid];
+		if (c->devices[mid].mac<mac) lo=mid+1; else hi=mid-1;
+	}
+	return NULL;
+}
+
+const image_t *cache_find_image(const cache_t *c, int id) {
+	for (int i=0; i<c->image_count; i++) {
+		if (c->images[i].id==id) return &c->images[i];
+	}
+	return NULL;
+}
+
+const image_t *cache_find_delta(const cache_t *c, int id, const int *have, int have_count) {
+	for (int i=0; i<c->delta_count; i++) {
+		if (c->deltas[i].id!=id) continue;
+		for (int j=0; j<have_count; j++) {
+			if (c->deltas[i].base_id==have[j]) return &c->deltas[i];
+		}
+	}
+	return NULL;
+}
+
+const image_t *cache_get_delta(const cache_t *c, int id, int base_id) {
+	for (int i=0; i<c->delta_count; i++) {
+		if (c->deltas[i].id==id && c->deltas[i].base_id==base_id) return &c->deltas[i];
+	}
+	return NULL;
+}
+
+const firmware_t *cache_find_fw(const cache_t *c, const char *name) {
+	static const firmware_t none;
+	for (int i=0; i<c->firmware_count; i++) {
+		if (strcmp(c->firmware[i].name, name)==0) return &c->firmware[i];
+	}
+	return &none;
+}
+
+static int db_connect() {
+	if (mysql) return 1;
+	mysql=mysql_init(NULL);
+	if (!mysql_real_connect(mysql, cfg.host, cfg.user, cfg.pass, cfg.db, 0, NULL, 0)) {
+		fprintf(stderr, "db: connect failed: %s\n", mysql_error(mysql));
+		mysql_close(mysql);
+		mysql=NULL;
+		return 0;
+	}
+	return 1;
+}
+
+//Drops the connection after an error; the next db_connect() makes a new one.
+static void db_error(const char *what) {
+	fprintf(stderr, "db: %s: %s\n", what, mysql_error(mysql));
+	mysql_close(mysql);
+	mysql=NULL;
+}
+
+//Runs a query that returns one blob and puts it in a memfd.
+static int load_blob(const char *q, const char *name, image_t *img) {
+	if (mysql_query(mysql, q)) {
+		db_error("image query");
+		return 0;
+	}
+	MYSQL_RES *res=mysql_store_result(mysql);
+	MYSQL_ROW row=res?mysql_fetch_row(res):NULL;
+	unsigned long *lengths=row?mysql_fetch_lengths(res):NULL;
+	int ok=0;
+	if (row && row[0]) {
+		img->fd=memfd_create(name, MFD_CLOEXEC);
+		img->len=lengths[0];
+		if (img->fd>=0 && write(img->fd, row[0], img->len)==(ssize_t)img->len) {
+			ok=1;
+		} else {
+			perror("memfd");
+			if (img->fd>=0) close(img->fd);
+		}
+	}
+	if (res) mysql_free_result(res);
+	return ok;
+}
+
+//Gets an image from the database into a memfd, or reuses the one we already have.
+static int load_image(int id, image_t *img) {
+	for (int i=0; i<loaded_image_count; i++) {
+		if (loaded_images[i].id==id) {
+			*img=loaded_images[i];
+			return 1;
+		}
+	}
+	char q[128], name[32];
+	snprintf(q, sizeof(q), "SELECT epd_bin FROM images WHERE `id`=%d", id);
+	snprintf(name, sizeof(name), "epd-img-%d", id);
+	*img=(image_t){.id=id};
+	return load_blob(q, name, img);
+}
+
+//Same for a delta.
+static int load_delta(int id, int base_id, image_t *img) {
+	for (int i=0; i<loaded_delta_count; i++) {
+		if (loaded_deltas[i].id==id && loaded_deltas[i].base_id==base_id) {
+			*img=loaded_deltas[i];
+			return 1;
+		}
+	}
+	char q[128], name[48];
+	snprintf(q, sizeof(q), "SELECT delta FROM image_deltas WHERE `id`=%d AND `base_id`=%d", id, base_id);
+	snprintf(name, sizeof(name), "epd-delta-%d-%d", id, base_id);
+	*img=(image_t){.id=id, .base_id=base_id};
+	return load_blob(q, name, img);
+}
+
+//Loads the deltas to the images in the manifest, smallest first. Returns 0 if the database
+//connection failed; a missing image_deltas table just means there are none.
+static int load_deltas(cache_t *c) {
+	char q[256];
+	char *p=q+sprintf(q, "SELECT id,base_id FROM image_deltas WHERE `id` IN (");
+	for (int i=0; i<MANIFEST_IMAGES; i++) p+=sprintf(p, "%s%d", i?",":"", c->image_ids[i]);
+	sprintf(p, ") ORDER BY LENGTH(delta)");
+	MYSQL_RES *res=NULL;
+	if (mysql_query(mysql, q)==0) res=mysql_store_result(mysql);
+	int n=res?mysql_num_rows(res):0;
+	image_t *new_loaded=calloc(n+1, sizeof(image_t));
+	int new_loaded_count=0;
+	MYSQL_ROW row;
+	while (res && (row=mysql_fetch_row(res))) {
+		if (load_delta(atoi(row[0]), atoi(row[1]), &new_loaded[new_loaded_count])) {
+			new_loaded_count++;
+		} else if (!mysql) {
+			break;
+		}
+	}
+	if (res) mysql_free_result(res);
+	if (!mysql) {
+		//Keep what we had; only drop what we just loaded.
+		for (int j=0; j<new_loaded_count; j++) {
+			int old=0;
+			for (int i=0; i<loaded_delta_count; i++) {
+				if (new_loaded[j].fd==loaded_deltas[i].fd) old=1;
+			}
+			if (!old) close(new_loaded[j].fd);
+		}
+		free(new_loaded);
+		return 0;
+	}
+	//Close deltas to images that dropped off the list
+	for (int i=0; i<loaded_delta_count; i++) {
+		int keep=0;
+		for (int j=0; j<new_loaded_count; j++) {
+			if (new_loaded[j].fd==loaded_deltas[i].fd) keep=1;
+		}
+		if (!keep) close(loaded_deltas[i].fd);
+	}
+	free(loaded_deltas);
+	loaded_deltas=new_loaded;
+	loaded_delta_count=new_loaded_count;
+	c->deltas=calloc(loaded_delta_count+1, sizeof(image_t));
+	for (int i=0; i<loaded_delta_count; i++) {
+		c->deltas[i]=loaded_deltas[i];
+		c->deltas[i].fd=dup(loaded_deltas[i].fd);
+	}
+	c->delta_count=loaded_delta_count;
+	return 1;
+}
+
+static int cmp_device(const void *a, const void *b) {
+	uint64_t ma=((const device_t*)a)->mac, mb=((const device_t*)b)->mac;
+	return (ma<mb)?-1:(ma>mb);
+}
+
+static cache_t *build_cache() {
+	cache_t *c=calloc(1, sizeof(cache_t));
+	c->loaded=time(NULL);
+
+	//Latest images. Like the PHP, we always list MANIFEST_IMAGES ids and pad with 0.
+	char q[128];
+	snprintf(q, sizeof(q), "SELECT id FROM images ORDER BY timestamp DESC LIMIT %d", MANIFEST_IMAGES);
+	if (mysql_query(mysql, q)) goto err;
+	MYSQL_RES *res=mysql_store_result(mysql);
+	if (!res) goto err;
+	MYSQL_ROW row;
+	int n=0;
+	while ((row=mysql_fetch_row(res)) && n<MANIFEST_IMAGES) c->image_ids[n++]=atoi(row[0]);
+	mysql_free_result(res);
+
+	image_t new_loaded[MANIFEST_IMAGES];
+	int new_loaded_count=0;
+	for (int i=0; i<n; i++) {
+		if (!load_image(c->image_ids[i], &new_loaded[new_loaded_count])) {
+			if (!mysql) goto err;
+			continue; //no data; the device will be told there's nothing there
+		}
+		new_loaded_count++;
+	}
+	//Close images that dropped off the list
+	for (int i=0; i<loaded_image_count; i++) {
+		int keep=0;
+		for (int j=0; j<new_loaded_count; j++) {
+			if (new_loaded[j].fd==loaded_images[i].fd) keep=1;
+		}
+		if (!keep) close(loaded_images[i].fd);
+	}
+	memcpy(loaded_images, new_loaded, new_loaded_count*sizeof(image_t));
+	loaded_image_count=new_loaded_count;
+	for (int i=0; i<loaded_image_count; i++) {
+		c->images[i]=loaded_images[i];
+		c->images[i].fd=dup(loaded_images[i].fd);
+	}
+	c->image_count=loaded_image_count;
+
+	char *p=c->images_json;
+	*p++='[';
+	for (int i=0; i<MANIFEST_IMAGES; i++) p+=sprintf(p, "%s%d", i?",":"", c->image_ids[i]);
+	*p++=']';
+	*p=0;
+
+	if (!load_deltas(c)) goto err;
+
+	//Devices
+	if (mysql_query(mysql, "SELECT id,mac,tz,fw_upd,update_hour FROM devices")) goto err;
+	res=mysql_store_result(mysql);
+	if (!res) goto err;
+	c->devices=calloc(mysql_num_rows(res)+1, sizeof(device_t));
+	c->firmware=calloc(mysql_num_rows(res)+1, sizeof(firmware_t));
+	while ((row=mysql_fetch_row(res))) {
+		device_t *d=&c->devices[c->device_count++];
+		d->id=atoi(row[0]);
+		d->mac=strtoull(row[1], NULL, 16);
+		snprintf(d->tz, sizeof(d->tz), "%s", row[2]);
+		snprintf(d->fw_upd, sizeof(d->fw_upd), "%s", row[3]);
+		d->update_hour=atoi(row[4]);
+	}
+	mysql_free_result(res);
+	qsort(c->devices, c->device_count, sizeof(device_t), cmp_device);
+
+	//Firmware SHAs, one per distinct firmware file
+	for (int i=0; i<=c->device_count; i++) {
+		const char *name=(i<c->device_count)?c->devices[i].fw_upd:DEF_FW_UPD;
+		int found=0;
+		for (int j=0; j<c->firmware_count; j++) {
+			if (strcmp(c->firmware[j].name, name)==0) found=1;
+		}
+		if (found) continue;
+		firmware_t *fw=&c->firmware[c->firmware_count++];
+		snprintf(fw->name, sizeof(fw->name), "%s", name);
+		//The name comes out of the database, but let's not serve /etc/passwd's SHA.
+		if (strchr(name, '/')==NULL) {
+			char path[512];
+			snprintf(path, sizeof(path), "%s/%s", cfg.docroot, name);
+			firmware_sha(path, fw);
+		}
+	}
+	for (int i=0; i<c->device_count; i++) {
+		c->devices[i].fw=cache_find_fw(c, c->devices[i].fw_upd);
+	}
+	return c;
+err:
+	if (mysql) db_error("cache query");
+	cache_free(c);
+	return NULL;
+}
+
+//Finds the id of a device that wasn't in the cache, creating it if it's new.
+static int resolve_device(uint64_t mac) {
+	char q[256];
+	snprintf(q, sizeof(q), "SELECT id FROM devices WHERE `mac`='%012llX'", (unsigned long long)mac);
+	if (mysql_query(mysql, q)) return 0;
+	MYSQL_RES *res=mysql_store_result(mysql);
+	MYSQL_ROW row=res?mysql_fetch_row(res):NULL;
+	int id=row?atoi(row[0]):0;
+	if (res) mysql_free_result(res);
+	if (id) return id;
+	snprintf(q, sizeof(q), "INSERT INTO devices (mac,tz,fw_upd,update_hour) VALUES ('%012llX','%s','%s',%d)",
+			(unsigned long long)mac, DEF_TZ, DEF_FW_UPD, DEF_UPDATE_HOUR);
+	if (mysql_query(mysql, q)) return 0;
+	return mysql_insert_id(mysql);
+}
+
+//Writes a batch of check-ins with one multi-row INSERT. Returns 0 if the database
+//failed; the caller keeps the batch and retries.
+static int write_checkins(checkin_t *batch, int n) {
+	int new_devices=0;
+	for (int i=0; i<n; i++) {
+		if (batch[i].device_id!=0) continue;
+		batch[i].device_id=resolve_device(batch[i].mac);
+		if (batch[i].device_id==0) {
+			db_error("device lookup");
+			return 0;
+		}
+		//Later check-ins from the same device in this batch get the same id
+		for (int j=i+1; j<n; j++) {
+			if (batch[j].mac==batch[i].mac) batch[j].device_id=batch[i].device_id;
+		}
+		new_devices=1;
+	}
+	//Worst case every field needs escaping, which doubles it.
+	size_t cap=64+n*(32+2*sizeof(batch[0].ip)+2*sizeof(batch[0].fw));
+	char *q=malloc(cap);
+	char *p=q+sprintf(q, "INSERT INTO checkins (device_id,battery_mv,ip,fw) VALUES ");
+	for (int i=0; i<n; i++) {
+		p+=sprintf(p, "%s(%d,%d,'", i?",":"", batch[i].device_id, batch[i].battery_mv);
+		p+=mysql_real_escape_string(mysql, p, batch[i].ip, strlen(batch[i].ip));
+		p+=sprintf(p, "','");
+		p+=mysql_real_escape_string(mysql, p, batch[i].fw, strlen(batch[i].fw));
+		p+=sprintf(p, "')");
+	}
+	int ok=(mysql_real_query(mysql, q, p-q)==0);
+	free(q);
+	if (!ok) {
+		db_error("checkin insert");
+		return 0;
+	}
+	if (new_devices) db_request_reload();
+	return 1;
+}
+
+//Splits one wake of telemetry (see epd-info.php) into its fields. Returns 0 if it's
+//malformed; that's also what keeps anything but numbers out of the query.
+static int parse_wake(const char *s, const char *end, char *kind, int *v) {
+	for (int i=0; i<TEL_FIELDS; i++) {
+		if (i>0) {
+			if (s==end || *s!=',') return 0;
+			s++;
+		}
+		if (i==1) {
+			if (s==end || *s<'a' || *s>'z') return 0;
+			*kind=*s++;
+			continue;
+		}
+		v[i]=0;
+		while (s!=end && *s>='0' && *s<='9' && v[i]<100000000) v[i]=v[i]*10+(*s++-'0');
+	}
+	return s==end;
+}
+
+//Stores the wake telemetry of a batch that's in the checkins table, so the device ids are
+//known. It's only statistics: if this fails, it's gone.
+static void write_telemetry(checkin_t *batch, int n) {
+	//A row is at most TEL_FIELDS numbers of 11 characters and the kind.
+	size_t cap=256;
+	for (int i=0; i<n; i++) {
+		for (const char *s=batch[i].tel; s && *s; s=strchr(s+1, '.')) cap+=TEL_FIELDS*12+8;
+	}
+	char *q=malloc(cap);
+	char *p=q+sprintf(q, "INSERT INTO wake_telemetry (device_id,seq,kind,battery_mv,images,boot_ms,wifi_ms,"
+				"manifest_ms,download_ms,image_max_ms,flash_erase_ms,flash_write_ms,spi_ms,refresh_ms,awake_ms) VALUES ");
+	int rows=0;
+	for (int i=0; i<n; i++) {
+		for (const char *s=batch[i].tel; s && *s; ) {
+			const char *end=strchr(s, '.');
+			if (!end) end=s+strlen(s);
+			char kind=0;
+			int v[TEL_FIELDS];
+			if (parse_wake(s, end, &kind, v)) {
+				p+=sprintf(p, "%s(%d,%d,'%c'", rows++?",":"", batch[i].device_id, v[0], kind);
+				for (int j=2; j<TEL_FIELDS; j++) p+=sprintf(p, ",%d", v[j]);
+				p+=sprintf(p, ")");
+			}
+			s=*end?end+1:end;
+		}
+	}
+	if (rows && mysql_real_query(mysql, q, p-q)) db_error("telemetry insert");
+	free(q);
+	for (int i=0; i<n; i++) {
+		free(batch[i].tel);
+		batch[i].tel=NULL;
+	}
+}
+
+static void *db_thread(void *arg) {
+	checkin_t *batch=NULL;
+	int batch_len=0;
+	time_t last_reload=0;
+	while (1) {
+		pthread_mutex_lock(&lock);
+		if (queue_len<BATCH_MAX && !reload_requested) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec+=FLUSH_INTERVAL;
+			pthread_cond_timedwait(&cond, &lock, &ts);
+		}
+		int reload=reload_requested || (time(NULL)-last_reload>=RELOAD_INTERVAL);
+		reload_requested=0;
+		if (batch_len==0 && queue_len>0) {
+			//Take the whole queue; the event loop starts a new one.
+			batch=queue;
+			batch_len=queue_len;
+			queue=NULL;
+			queue_len=0;
+			queue_cap=0;
+		}
+		pthread_mutex_unlock(&lock);
+
+		if (!db_connect()) {
+			sleep(1);
+			if (reload) db_request_reload();
+			continue;
+		}
+		if (batch_len) {
+			if (write_checkins(batch, batch_len)) {
+				write_telemetry(batch, batch_len);
+				free(batch);
+				batch=NULL;
+				batch_len=0;
+			}
+		}
+		if (reload) {
+			cache_t *c=build_cache();
+			if (c) {
+				last_reload=c->loaded;
+				pthread_mutex_lock(&lock);
+				if (pending_cache) cache_free(pending_cache);
+				pending_cache=c;
+				pthread_mutex_unlock(&lock);
+				uint64_t one=1;
+				if (write(notify_fd, &one, sizeof(one))<0) perror("eventfd");
+			} else {
+				db_request_reload(); //try again next round
+			}
+		}
+	}
+	return NULL;
+}
+
+int db_start(const db_config_t *config, int fd) {
+	cfg=*config;
+	notify_fd=fd;
+	pthread_t t;
+	return pthread_create(&t, NULL, db_thread, NULL)==0;
+}
+
+void db_request_reload() {
+	pthread_mutex_lock(&lock);
+	reload_requested=1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+cache_t *db_take_cache() {
+	pthread_mutex_lock(&lock);
+	cache_t *c=pending_cache;
+	pending_cache=NULL;
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+void db_queue_checkin(const checkin_t *c) {
+	pthread_mutex_lock(&lock);
+	if (queue_len>=QUEUE_MAX) {
+		if ((dropped_checkins++%1000)==0) fprintf(stderr, "db: check-in queue full, dropped %ld\n", dropped_checkins);
+		free(c->tel);
+	} else {
+		if (queue_len==queue_cap) {
+			queue_cap=queue_cap?queue_cap*2:256;
+			queue=realloc(queue, queue_cap*sizeof(checkin_t));
+		}
+		queue[queue_len++]=*c;
+		if (queue_len==BATCH_MAX) pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
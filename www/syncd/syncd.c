@@ -0,0 +1,702 @@
+/*
+syncd: a native replacement for epd-info.php, epd-img.php, epd-bundle.php and epd-imgdelta.php, for when there are enough
+frames checking in that starting PHP and opening a MySQL connection per request becomes
+the bottleneck. One epoll event loop handles all connections (with keep-alive); the
+answers come out of an in-memory cache that a database thread rebuilds when something
+changes, and check-ins are written back in batches. See README.md for how to run it.
+
+Usage: syncd [-p port] [-c config.php] [-d docroot] [-H dbhost]
+
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <endian.h>
+#include "syncd.h"
+
+//Touch this file in the docroot to make syncd reload the cache (upload.php does this).
+#define STAMP_FILE "syncd.stamp"
+//Keep-alive connections that are idle for this long get closed.
+#define IDLE_TIMEOUT 30
+#define REQ_MAX 4096
+#define HDR_MAX 1024
+#define BODY_MAX 1024
+#define MAX_EVENTS 256
+
+typedef struct conn_t conn_t;
+struct conn_t {
+	int fd;
+	char ip[48];
+	char in[REQ_MAX];
+	int in_len;
+	char out[HDR_MAX+BODY_MAX];
+	int out_len, out_pos;
+	int file_fd;			//file being sent with sendfile(), or -1
+	off_t file_pos;
+	size_t file_end;
+	int close_file;			//file_fd is ours to close (as opposed to the cache's)
+	cache_t *cache;			//cache the file_fd belongs to, if any
+	image_t bundle[MANIFEST_IMAGES+1];	//frames of a bundle response; the last is the end frame
+	int bundle_pos, bundle_len;
+	int keepalive;
+	char if_none_match[24];	//ETag the client sent, if any
+	time_t last_active;
+	conn_t *prev, *next;	//idle list, least recently active first
+};
+
+static int epfd;
+static conn_t **conns;		//indexed by fd
+static int conns_size;
+static conn_t *idle_head, *idle_tail;
+static cache_t *cache;
+static const char *docroot=".";
+static uint64_t stat_requests, stat_checkins;
+
+static void cache_unref(cache_t *c) {
+	if (c && --c->refs==0) cache_free(c);
+}
+
+static void idle_remove(conn_t *c) {
+	if (c->prev) c->prev->next=c->next; else idle_head=c->next;
+	if (c->next) c->next->prev=c->prev; else idle_tail=c->prev;
+	c->prev=c->next=NULL;
+}
+
+static void idle_touch(conn_t *c) {
+	if (c->prev || idle_head==c) idle_remove(c);
+	c->last_active=time(NULL);
+	c->prev=idle_tail;
+	if (idle_tail) idle_tail->next=c; else idle_head=c;
+	idle_tail=c;
+}
+
+static void end_file(conn_t *c) {
+	if (c->close_file && c->file_fd>=0) close(c->file_fd);
+	c->file_fd=-1;
+	c->close_file=0;
+	c->bundle_pos=c->bundle_len=0;
+	cache_unref(c->cache);
+	c->cache=NULL;
+}
+
+static void conn_close(conn_t *c) {
+	end_file(c);
+	idle_remove(c);
+	conns[c->fd]=NULL;
+	close(c->fd);
+	free(c);
+}
+
+static void set_events(conn_t *c, uint32_t events) {
+	struct epoll_event ev={.events=events, .data.fd=c->fd};
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+//Finds a query parameter. Values are copied as-is; none of ours need URL-decoding.
+static int get_param(const char *query, const char *name, char *val, int len) {
+	int nlen=strlen(name);
+	const char *p=query;
+	while (p && *p) {
+		if (strncmp(p, name, nlen)==0 && p[nlen]=='=') {
+			p+=nlen+1;
+			int i=0;
+			while (*p && *p!='&' && i<len-1) val[i++]=*p++;
+			val[i]=0;
+			return 1;
+		}
+		p=strchr(p, '&');
+		if (p) p++;
+	}
+	return 0;
+}
+
+//Escapes a string the way PHP's json_encode does (including the forward slashes).
+static char *json_str(char *p, const char *s) {
+	*p++='"';
+	for (; *s; s++) {
+		if (*s=='"' || *s=='\\' || *s=='/') {
+			*p++='\\';
+			*p++=*s;
+		} else if ((unsigned char)*s<0x20) {
+			p+=sprintf(p, "\\u%04x", *s);
+		} else {
+			*p++=*s;
+		}
+	}
+	*p++='"';
+	*p=0;
+	return p;
+}
+
+//Sends a response header, with optional extra header lines (each ending in \r\n).
+static void respond_hdrs(conn_t *c, int code, const char *type, const char *hdrs, const char *body, int body_len, size_t file_len) {
+	const char *status=(code==200)?"OK":(code==304)?"Not Modified":(code==404)?"Not Found":(code==503)?"Service Unavailable":"Bad Request";
+	c->out_len=snprintf(c->out, HDR_MAX, "HTTP/1.1 %d %s\r\n", code, status);
+	//A 304 has no body, so it doesn't say what kind or how long
+	if (code!=304) {
+		c->out_len+=snprintf(c->out+c->out_len, HDR_MAX-c->out_len,
+				"Content-Type: %s\r\n"
+				"Content-Length: %zu\r\n", type, body_len+file_len);
+	}
+	c->out_len+=snprintf(c->out+c->out_len, HDR_MAX-c->out_len,
+			"%s"
+			"Connection: %s\r\n"
+			"\r\n", hdrs, c->keepalive?"keep-alive":"close");
+	if (body_len) {
+		memcpy(c->out+c->out_len, body, body_len);
+		c->out_len+=body_len;
+	}
+	c->out_pos=0;
+}
+
+static void respond(conn_t *c, int code, const char *type, const char *body, int body_len, size_t file_len) {
+	respond_hdrs(c, code, type, "", body, body_len, file_len);
+}
+
+//Same CRC as PHP's crc32(), so the ETags match the ones epd-info.php makes.
+static uint32_t crc32(const char *p, size_t len) {
+	uint32_t crc=0xffffffff;
+	while (len--) {
+		crc^=(uint8_t)*p++;
+		for (int i=0; i<8; i++) crc=(crc>>1)^(0xEDB88320&-(crc&1));
+	}
+	return ~crc;
+}
+
+static void error_response(conn_t *c, int code) {
+	respond(c, code, "text/plain", "", 0, 0);
+}
+
+static void handle_info(conn_t *c, const char *query) {
+	if (!cache) {
+		error_response(c, 503);
+		return;
+	}
+	char macstr[16]="", bat[16]="", fw[24]="unknown";
+	get_param(query, "mac", macstr, sizeof(macstr));
+	get_param(query, "bat", bat, sizeof(bat));
+	get_param(query, "fw", fw, sizeof(fw));
+	//Same sanitizing as the PHP: anything that isn't 12 hex digits is MAC 0.
+	uint64_t mac=0;
+	if (strlen(macstr)==12 && strspn(macstr, "0123456789abcdefABCDEF")==12) mac=strtoull(macstr, NULL, 16);
+
+	checkin_t ci={.mac=mac, .battery_mv=atoi(bat)};
+	snprintf(ci.ip, sizeof(ci.ip), "%s", c->ip);
+	snprintf(ci.fw, sizeof(ci.fw), "%s", fw);
+	char tel[1024];
+	if (get_param(query, "tel", tel, sizeof(tel)) && tel[0]) ci.tel=strdup(tel);
+
+	const device_t *dev=cache_find_device(cache, mac);
+	device_t def={.update_hour=DEF_UPDATE_HOUR, .tz=DEF_TZ, .fw_upd=DEF_FW_UPD};
+	if (dev) {
+		ci.device_id=dev->id;
+	} else {
+		//New device. The DB thread creates it; until then it gets the defaults.
+		def.fw=cache_find_fw(cache, DEF_FW_UPD);
+		dev=&def;
+	}
+	db_queue_checkin(&ci);
+	stat_checkins++;
+
+	//Everything but the time goes in first, as the ETag doesn't cover that.
+	char body[BODY_MAX];
+	char *start=body+32;
+	char *p=start;
+	p+=sprintf(p, "{\"fw_sha\":");
+	p=json_str(p, dev->fw->sha);
+	p+=sprintf(p, ",\"fw_upd\":");
+	p=json_str(p, dev->fw_upd);
+	//Offer a delta update if otadiff made one from what the frame runs now
+	if (strlen(fw)==16 && strspn(fw, "0123456789ABCDEF")==16 && dev->fw->sha_hex[0] && strcmp(fw, dev->fw->sha_hex)!=0) {
+		char patch[64], path[512];
+		snprintf(patch, sizeof(patch), "%s-%s.patch", fw, dev->fw->sha_hex);
+		snprintf(path, sizeof(path), "%s/%s", docroot, patch);
+		if (access(path, R_OK)==0) {
+			p+=sprintf(p, ",\"fw_patch\":");
+			p=json_str(p, patch);
+		}
+	}
+	p+=sprintf(p, ",\"tz\":");
+	p=json_str(p, dev->tz);
+	p+=sprintf(p, ",\"update_hour\":%d,\"images\":%s", dev->update_hour, cache->images_json);
+	//The ETag covers what we have so far, as if that were all of it; the deltas only
+	//matter if the images changed anyway.
+	char etag[16];
+	*p='}';
+	snprintf(etag, sizeof(etag), "\"%08x\"", crc32(start, p+1-start));
+	//For every image, a delta from one the frame says it has, if there is one
+	char havestr[128]="";
+	get_param(query, "have", havestr, sizeof(havestr));
+	int have[MANIFEST_IMAGES], have_count=0;
+	for (char *h=havestr; *h && have_count<MANIFEST_IMAGES; ) {
+		int id=strtol(h, &h, 10);
+		if (*h==',') h++; else if (*h) break;
+		if (id>0) have[have_count++]=id;
+	}
+	p+=sprintf(p, ",\"deltas\":[");
+	for (int i=0; i<MANIFEST_IMAGES; i++) {
+		const image_t *d=cache_find_delta(cache, cache->image_ids[i], have, have_count);
+		p+=sprintf(p, "%s%d", i?",":"", d?d->base_id:0);
+	}
+	p+=sprintf(p, "]}");
+
+	char hdrs[96];
+	if (strcmp(c->if_none_match, etag)==0) {
+		snprintf(hdrs, sizeof(hdrs), "ETag: %s\r\nX-Time: %lld\r\n", etag, (long long)time(NULL));
+		respond_hdrs(c, 304, NULL, hdrs, NULL, 0, 0);
+		return;
+	}
+	snprintf(hdrs, sizeof(hdrs), "ETag: %s\r\n", etag);
+	//Now put the time in front
+	char tm[32];
+	int tlen=snprintf(tm, sizeof(tm), "{\"time\":%lld,", (long long)time(NULL));
+	start+=1-tlen;
+	memcpy(start, tm, tlen);
+	respond_hdrs(c, 200, "text/json", hdrs, start, p-start, 0);
+}
+
+static void handle_img(conn_t *c, const char *query) {
+	if (!cache) {
+		error_response(c, 503);
+		return;
+	}
+	char idstr[16];
+	int id=get_param(query, "id", idstr, sizeof(idstr))?atoi(idstr):cache->image_ids[0];
+	const image_t *img=cache_find_image(cache, id);
+	if (!img) {
+		error_response(c, 404);
+		return;
+	}
+	respond(c, 200, "image/epd", NULL, 0, img->len);
+	c->file_fd=img->fd;
+	c->file_pos=0;
+	c->file_end=img->len;
+	c->close_file=0;
+	//The image stays valid for as long as we hold on to the cache it's in.
+	c->cache=cache;
+	cache->refs++;
+}
+
+static void handle_imgdelta(conn_t *c, const char *query) {
+	if (!cache) {
+		error_response(c, 503);
+		return;
+	}
+	char idstr[16]="", basestr[16]="";
+	get_param(query, "id", idstr, sizeof(idstr));
+	get_param(query, "base", basestr, sizeof(basestr));
+	const image_t *d=cache_get_delta(cache, atoi(idstr), atoi(basestr));
+	if (!d) {
+		error_response(c, 404);
+		return;
+	}
+	respond(c, 200, "application/x-epd-delta", NULL, 0, d->len);
+	c->file_fd=d->fd;
+	c->file_pos=0;
+	c->file_end=d->len;
+	c->close_file=0;
+	c->cache=cache;
+	cache->refs++;
+}
+
+//Several images in one response; see epd-bundle.php for the format. Images we don't
+//have go out as empty frames.
+static void handle_bundle(conn_t *c, const char *query) {
+	if (!cache) {
+		error_response(c, 503);
+		return;
+	}
+	char ids[128]="";
+	get_param(query, "ids", ids, sizeof(ids));
+	size_t len=0;
+	int n=0;
+	for (char *p=ids; *p && n<MANIFEST_IMAGES; ) {
+		int id=strtol(p, &p, 10);
+		if (*p==',') p++; else if (*p) break;
+		if (id<=0) continue;
+		const image_t *img=cache_find_image(cache, id);
+		c->bundle[n]=img?*img:(image_t){.id=id, .fd=-1, .len=0};
+		len+=8+c->bundle[n].len;
+		n++;
+	}
+	c->bundle[n]=(image_t){.id=0, .fd=-1, .len=0};
+	len+=8;
+	c->bundle_len=n+1;
+	c->bundle_pos=0;
+	respond(c, 200, "application/x-epd-bundle", NULL, 0, len);
+	//The images stay valid for as long as we hold on to the cache they're in.
+	c->cache=cache;
+	cache->refs++;
+}
+
+static void handle_file(conn_t *c, const char *name) {
+	char path[512];
+	if (name[0]=='.' || strchr(name, '/')) {
+		error_response(c, 404);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%s", docroot, name);
+	int fd=open(path, O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	if (fd<0 || fstat(fd, &st)<0 || !S_ISREG(st.st_mode)) {
+		if (fd>=0) close(fd);
+		error_response(c, 404);
+		return;
+	}
+	respond(c, 200, "application/octet-stream", NULL, 0, st.st_size);
+	c->file_fd=fd;
+	c->file_pos=0;
+	c->file_end=st.st_size;
+	c->close_file=1;
+}
+
+//Parses one request out of the input buffer and sets up the response. Returns 0 if
+//the request isn't complete yet, -1 if the connection should be dropped.
+static int handle_request(conn_t *c) {
+	char *end=memmem(c->in, c->in_len, "\r\n\r\n", 4);
+	if (!end) return (c->in_len==REQ_MAX)?-1:0;
+	*end=0;
+	int req_len=(end-c->in)+4;
+
+	char method[8], target[512], version[16];
+	if (sscanf(c->in, "%7s %511s %15s", method, target, version)!=3) return -1;
+	//HTTP/1.1 is keep-alive unless told otherwise; 1.0 only if asked for.
+	int is11=(strcmp(version, "HTTP/1.1")==0);
+	const char *conn_hdr=strcasestr(c->in, "\r\nConnection:");
+	if (conn_hdr) {
+		conn_hdr+=13;
+		while (*conn_hdr==' ') conn_hdr++;
+		c->keepalive=(strncasecmp(conn_hdr, "keep-alive", 10)==0) || (is11 && strncasecmp(conn_hdr, "close", 5)!=0);
+	} else {
+		c->keepalive=is11;
+	}
+	c->if_none_match[0]=0;
+	const char *inm=strcasestr(c->in, "\r\nIf-None-Match:");
+	if (inm) {
+		inm+=16;
+		inm+=strspn(inm, " ");
+		int n=strcspn(inm, "\r ");
+		if (n<(int)sizeof(c->if_none_match)) {
+			memcpy(c->if_none_match, inm, n);
+			c->if_none_match[n]=0;
+		}
+	}
+	//We don't take request bodies, so anything left is the next (pipelined) request.
+	memmove(c->in, c->in+req_len, c->in_len-req_len);
+	c->in_len-=req_len;
+	stat_requests++;
+
+	char *query=strchr(target, '?');
+	if (query) *query++=0; else query="";
+	const char *path=target;
+	//Accept both /epd-info.php and /<subdir>/epd-info.php, as the base URL may have a path.
+	const char *base=strrchr(path, '/');
+	base=base?base+1:path;
+	if (strcmp(method, "GET")!=0) {
+		c->keepalive=0;
+		error_response(c, 400);
+	} else if (strcmp(base, "epd-info.php")==0) {
+		handle_info(c, query);
+	} else if (strcmp(base, "epd-img.php")==0) {
+		handle_img(c, query);
+	} else if (strcmp(base, "epd-bundle.php")==0) {
+		handle_bundle(c, query);
+	} else if (strcmp(base, "epd-imgdelta.php")==0) {
+		handle_imgdelta(c, query);
+	} else if ((strlen(base)>4 && strcmp(base+strlen(base)-4, ".bin")==0) ||
+				(strlen(base)>6 && strcmp(base+strlen(base)-6, ".patch")==0)) {
+		handle_file(c, base);
+	} else {
+		error_response(c, 404);
+	}
+	return 1;
+}
+
+//Sends as much of the response as the socket takes. Returns 1 if all of it went out,
+//0 if the socket is full, -1 on error.
+static int send_response(conn_t *c) {
+	while (1) {
+		while (c->out_pos<c->out_len) {
+			ssize_t r=send(c->fd, c->out+c->out_pos, c->out_len-c->out_pos, MSG_NOSIGNAL);
+			if (r<0) return (errno==EAGAIN)?0:-1;
+			c->out_pos+=r;
+		}
+		while (c->file_fd>=0 && (size_t)c->file_pos<c->file_end) {
+			ssize_t r=sendfile(c->fd, c->file_fd, &c->file_pos, c->file_end-c->file_pos);
+			if (r<0) return (errno==EAGAIN)?0:-1;
+			if (r==0) return -1; //file got shorter
+		}
+		if (c->bundle_pos==c->bundle_len) break;
+		//Next frame of a bundle: id and length as little-endian uint32s, then the image.
+		const image_t *img=&c->bundle[c->bundle_pos++];
+		uint32_t hdr[2]={htole32(img->id), htole32(img->len)};
+		memcpy(c->out, hdr, 8);
+		c->out_len=8;
+		c->out_pos=0;
+		c->file_fd=img->fd;
+		c->file_pos=0;
+		c->file_end=img->len;
+	}
+	end_file(c);
+	c->out_len=0;
+	return 1;
+}
+
+//Handles whatever is in the input buffer and sends the responses, until we either run
+//out of requests or out of socket buffer.
+static void conn_process(conn_t *c) {
+	while (1) {
+		if (c->out_len) {
+			int r=send_response(c);
+			if (r<0) {
+				conn_close(c);
+				return;
+			}
+			if (r==0) {
+				set_events(c, EPOLLOUT);
+				return;
+			}
+			if (!c->keepalive) {
+				conn_close(c);
+				return;
+			}
+		}
+		int r=handle_request(c);
+		if (r<0) {
+			conn_close(c);
+			return;
+		}
+		if (r==0) break;
+	}
+	set_events(c, EPOLLIN);
+}
+
+static void conn_read(conn_t *c) {
+	while (c->in_len<REQ_MAX) {
+		ssize_t r=recv(c->fd, c->in+c->in_len, REQ_MAX-c->in_len, 0);
+		if (r==0 || (r<0 && errno!=EAGAIN)) {
+			conn_close(c);
+			return;
+		}
+		if (r<0) break;
+		c->in_len+=r;
+	}
+	idle_touch(c);
+	conn_process(c);
+}
+
+static void do_accept(int lfd) {
+	while (1) {
+		struct sockaddr_in6 addr;
+		socklen_t alen=sizeof(addr);
+		int fd=accept4(lfd, (struct sockaddr*)&addr, &alen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if (fd<0) {
+			if (errno!=EAGAIN) perror("accept");
+			return;
+		}
+		if (fd>=conns_size) {
+			int n=fd*2;
+			conns=realloc(conns, n*sizeof(conn_t*));
+			memset(conns+conns_size, 0, (n-conns_size)*sizeof(conn_t*));
+			conns_size=n;
+		}
+		int one=1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn_t *c=calloc(1, sizeof(conn_t));
+		c->fd=fd;
+		c->file_fd=-1;
+		//Show v4-mapped addresses as plain v4, like Apache does for REMOTE_ADDR.
+		if (IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr)) {
+			inet_ntop(AF_INET, &addr.sin6_addr.s6_addr[12], c->ip, sizeof(c->ip));
+		} else {
+			inet_ntop(AF_INET6, &addr.sin6_addr, c->ip, sizeof(c->ip));
+		}
+		conns[fd]=c;
+		idle_touch(c);
+		struct epoll_event ev={.events=EPOLLIN, .data.fd=fd};
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+static void close_idle() {
+	time_t now=time(NULL);
+	while (idle_head && now-idle_head->last_active>=IDLE_TIMEOUT) conn_close(idle_head);
+}
+
+//Grabs the value of a PHP variable assignment like $pass="secret"; out of config.php.
+static char *php_var(const char *conf, const char *name) {
+	char pat[64];
+	snprintf(pat, sizeof(pat), "$%s", name);
+	const char *p=conf;
+	while ((p=strstr(p, pat))) {
+		p+=strlen(pat);
+		while (*p==' ' || *p=='\t') p++;
+		if (*p!='=') continue;
+		p++;
+		while (*p==' ' || *p=='\t') p++;
+		if (*p!='"' && *p!='\'') continue;
+		char q=*p++;
+		const char *e=strchr(p, q);
+		if (!e) return NULL;
+		return strndup(p, e-p);
+	}
+	return NULL;
+}
+
+static void add_fd(int fd) {
+	struct epoll_event ev={.events=EPOLLIN, .data.fd=fd};
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int main(int argc, char **argv) {
+	int port=8080;
+	const char *config_file=NULL;
+	db_config_t dbcfg={.host="localhost"};
+	int opt;
+	while ((opt=getopt(argc, argv, "p:c:d:H:"))!=-1) {
+		if (opt=='p') port=atoi(optarg);
+		else if (opt=='c') config_file=optarg;
+		else if (opt=='d') docroot=optarg;
+		else if (opt=='H') dbcfg.host=optarg;
+		else {
+			fprintf(stderr, "Usage: %s [-p port] [-c config.php] [-d docroot] [-H dbhost]\n", argv[0]);
+			exit(1);
+		}
+	}
+	char conf_path[512];
+	if (!config_file) {
+		snprintf(conf_path, sizeof(conf_path), "%s/config.php", docroot);
+		config_file=conf_path;
+	}
+	FILE *f=fopen(config_file, "r");
+	if (!f) {
+		perror(config_file);
+		exit(1);
+	}
+	char conf[4096];
+	size_t n=fread(conf, 1, sizeof(conf)-1, f);
+	conf[n]=0;
+	fclose(f);
+	dbcfg.db=php_var(conf, "db");
+	dbcfg.user=php_var(conf, "username");
+	dbcfg.pass=php_var(conf, "pass");
+	dbcfg.docroot=docroot;
+	if (!dbcfg.db || !dbcfg.user || !dbcfg.pass) {
+		fprintf(stderr, "%s: need $db, $username and $pass\n", config_file);
+		exit(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	epfd=epoll_create1(EPOLL_CLOEXEC);
+
+	int lfd=socket(AF_INET6, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	int one=1, zero=0;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(lfd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+	struct sockaddr_in6 addr={.sin6_family=AF_INET6, .sin6_port=htons(port), .sin6_addr=in6addr_any};
+	if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(lfd, 1024)<0) {
+		perror("listen");
+		exit(1);
+	}
+	add_fd(lfd);
+
+	int notify_fd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	add_fd(notify_fd);
+
+	int ino_fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (inotify_add_watch(ino_fd, docroot, IN_CLOSE_WRITE|IN_ATTRIB|IN_MOVED_TO)<0) perror("inotify");
+	add_fd(ino_fd);
+
+	int timer_fd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	struct itimerspec its={.it_interval={1, 0}, .it_value={1, 0}};
+	timerfd_settime(timer_fd, 0, &its, NULL);
+	add_fd(timer_fd);
+
+	if (!db_start(&dbcfg, notify_fd)) {
+		fprintf(stderr, "Couldn't start database thread\n");
+		exit(1);
+	}
+	printf("syncd listening on port %d, docroot %s\n", port, docroot);
+
+	struct epoll_event events[MAX_EVENTS];
+	time_t last_stats=time(NULL);
+	while (1) {
+		int nev=epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (nev<0 && errno!=EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (int i=0; i<nev; i++) {
+			int fd=events[i].data.fd;
+			if (fd==lfd) {
+				do_accept(lfd);
+			} else if (fd==notify_fd) {
+				uint64_t v;
+				if (read(notify_fd, &v, sizeof(v))<0) continue;
+				cache_t *c=db_take_cache();
+				if (c) {
+					c->refs=1;
+					cache_unref(cache);
+					cache=c;
+				}
+			} else if (fd==ino_fd) {
+				char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+				ssize_t len;
+				int reload=0;
+				while ((len=read(ino_fd, buf, sizeof(buf)))>0) {
+					for (char *p=buf; p<buf+len; ) {
+						struct inotify_event *ev=(struct inotify_event*)p;
+						size_t nl=ev->len?strlen(ev->name):0;
+						//New images, or new firmware which changes the SHA we hand out
+						if (nl && (strcmp(ev->name, STAMP_FILE)==0 || (nl>4 && strcmp(ev->name+nl-4, ".bin")==0))) reload=1;
+						p+=sizeof(struct inotify_event)+ev->len;
+					}
+				}
+				if (reload) db_request_reload();
+			} else if (fd==timer_fd) {
+				uint64_t v;
+				if (read(timer_fd, &v, sizeof(v))<0) continue;
+				close_idle();
+				if (time(NULL)-last_stats>=60) {
+					printf("%llu requests, %llu check-ins\n", (unsigned long long)stat_requests, (unsigned long long)stat_checkins);
+					fflush(stdout);
+					last_stats=time(NULL);
+				}
+			} else if (fd<conns_size && conns[fd]) {
+				conn_t *c=conns[fd];
+				if (events[i].events&(EPOLLHUP|EPOLLERR)) {
+					conn_close(c);
+				} else if (events[i].events&EPOLLOUT) {
+					idle_touch(c);
+					conn_process(c);
+				} else {
+					conn_read(c);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+//Keep in sync with IMG_SLOT_COUNT in the firmware, and the LIMIT in epd-info.php.
+#define MANIFEST_IMAGES 10
+
+//Device defaults; same as epd-info.php uses for a new device.
+#define DEF_TZ "CST-8"
+#define DEF_FW_UPD "picframe.bin"
+#define DEF_UPDATE_HOUR 3
+
+typedef struct {
+	char name[64];
+	char sha[48];			//base64 of the app SHA256, or empty if not found
+	char sha_hex[17];		//first 8 bytes of it in hex, as frames report it and patches are named
+} firmware_t;
+
+typedef struct {
+	uint64_t mac;			//48-bit MAC, as a number
+	int id;
+	int update_hour;
+	char tz[32];
+	char fw_upd[64];
+	const firmware_t *fw;	//points into the firmware list
+} device_t;
+
+typedef struct {
+	int id;
+	int fd;					//memfd holding the epd_bin (or the delta)
+	size_t len;
+	int base_id;			//for deltas: the image it's made from
+} image_t;
+
+//Everything needed to answer a check-in without going to the database. The DB thread
+//builds a new one whenever something changed and hands it to the event loop, which
+//owns it from then on.
+typedef struct {
+	int refs;				//only touched by the event loop thread
+	time_t loaded;
+	int image_ids[MANIFEST_IMAGES];
+	image_t images[MANIFEST_IMAGES];
+	int image_count;
+	char images_json[MANIFEST_IMAGES*12+4];
+	image_t *deltas;		//deltas to the images above from older ones, smallest first
+	int delta_count;
+	device_t *devices;		//sorted by MAC
+	int device_count;
+	firmware_t *firmware;
+	int firmware_count;
+} cache_t;
+
+typedef struct {
+	uint64_t mac;
+	int device_id;			//0 if the device wasn't known yet
+	int battery_mv;
+	char ip[48];
+	char fw[24];
+	char *tel;				//wake telemetry as sent by the frame, malloc()ed; or NULL
+} checkin_t;
+
+typedef struct {
+	const char *host;
+	const char *user;
+	const char *pass;
+	const char *db;
+	const char *docroot;	//where the firmware files live
+} db_config_t;
+
+//Starts the database thread. It posts to notify_fd (an eventfd) whenever a new cache is
+//ready; pick it up with db_take_cache().
+int db_start(const db_config_t *cfg, int notify_fd);
+//Asks for the cache to be rebuilt.
+void db_request_reload();
+//Returns the newest cache and clears it, or NULL if there's nothing new.
+cache_t *db_take_cache();
+//Queues a check-in. They get written in batches. Takes over c->tel.
+void db_queue_checkin(const checkin_t *c);
+
+void cache_free(cache_t *c);
+const device_t *cache_find_device(const cache_t *c, uint64_t mac);
+const image_t *cache_find_image(const cache_t *c, int id);
+//Finds the smallest delta to image id from any of the have_count images in have, or NULL.
+const image_t *cache_find_delta(const cache_t *c, int id, const int *have, int have_count);
+const image_t *cache_get_delta(const cache_t *c, int id, int base_id);
+//Never returns NULL; unknown firmware has an empty SHA.
+const firmware_t *cache_find_fw(const cache_t *c, const char *name);
+
+//Reads the app SHA out of a firmware image, like get_app_image_data() in epd-info.php, into
+//fw->sha and fw->sha_hex. They're empty strings if it can't be found.
+void firmware_sha(const char *path, firmware_t *fw);
@@ -0,0 +1,23 @@
+<?php
+
+//Where an upload handed to convd is: queued, converting, done (with the image id) or
+//failed. Only meaningful if $convd_url is set; see upload.php.
+
+require("config.php");
+
+if (!isset($convd_url) || $convd_url=="" || !isset($_GET["job"])) {
+	http_response_code(404);
+	exit(0);
+}
+
+$ctx=stream_context_create(array("http"=>array("ignore_errors"=>true, "timeout"=>10)));
+$resp=@file_get_contents($convd_url."/jobs/".intval($_GET["job"]), false, $ctx);
+if ($resp===false) {
+	http_response_code(503);
+	exit(0);
+}
+if (!json_decode($resp, true)) http_response_code(404);
+header("Content-Type: text/json");
+echo $resp;
+
+?>
@@ -1,6 +1,7 @@
 <?php
 
 require("config.php");
+require("imgdelta.inc.php");
 
 //(id, timestamp, orig_name, epd_bin)
 
@@ -8,9 +9,37 @@ if (!isset($_FILES["image"])) {
 	header("Location: /index.html");
 }
 
+//With convd running, it does the conversion and storing in the background; we just hand
+//it the upload and pass on the quick preview it makes.
+if (isset($convd_url) && $convd_url!="") {
+	$lane=isset($_POST["bulk"])?"bulk":"interactive";
+	$ctx=stream_context_create(array("http"=>array(
+		"method"=>"POST",
+		"header"=>"Content-Type: application/octet-stream\r\n",
+		"content"=>file_get_contents($_FILES["image"]["tmp_name"]),
+		"ignore_errors"=>true,
+		"timeout"=>30)));
+	$resp=@file_get_contents($convd_url."/jobs?lane=".$lane."&name=".urlencode($_FILES["image"]["name"]), false, $ctx);
+	$job=($resp===false)?null:json_decode($resp, true);
+	if ($job && isset($job["preview"])) {
+		//Poll upload-status.php?job=<id> to see when it's stored
+		header("X-Conv-Job: ".intval($job["job"]));
+		echo $job["preview"];
+	} else if ($job && isset($job["state"]) && $job["state"]=="failed") {
+		http_response_code(400);
+	} else {
+		//Queue full, or convd not running: try again later
+		http_response_code(503);
+		header("Retry-After: 10");
+	}
+	exit(0);
+}
+
 //system("/bin/cp \"".$_FILES["image"]["tmp_name"]."\" /tmp/img.png");
 $pngfile=tempnam("/tmp","epd");
-$convproc=popen(__DIR__."/conv/conv -p \"".$pngfile."\" \"".$_FILES["image"]["tmp_name"]."\"", "r");
+$deadline="";
+if (isset($conv_deadline_ms) && $conv_deadline_ms>0) $deadline="--deadline ".intval($conv_deadline_ms)." ";
+$convproc=popen(__DIR__."/conv/conv ".$deadline."-p \"".$pngfile."\" \"".$_FILES["image"]["tmp_name"]."\"", "r");
 
 $mysqli = mysqli_connect("localhost",$username, $pass, $db); 
 
@@ -31,6 +60,9 @@ if ($ret!=0) {
 }
 
 $stmt->execute() || die($stmt->error);
+store_image_deltas($mysqli, $mysqli->insert_id);
+//Tell syncd (if it runs) there is a new image
+@touch(__DIR__."/syncd.stamp");
 
 //header("Content-Type: image/png");
 //readfile($pngfile);